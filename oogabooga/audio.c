@@ -374,20 +374,20 @@ wav_read_frames(Wav_Stream *wav, Audio_Format format, void *frames,
 	local_persist thread_local void *convert_buffer = 0;
 	local_persist thread_local u64  convert_buffer_size = 0;
 	if (!raw_buffer || required_size > raw_buffer_size) {
-		if (raw_buffer) dealloc(get_heap_allocator(), raw_buffer);
+		if (raw_buffer) dealloc(get_tagged_heap_allocator(MEMORY_TAG_AUDIO), raw_buffer);
 		
 		u64 new_size = get_next_power_of_two(required_size);
 		
-		raw_buffer = alloc(get_heap_allocator(), new_size);
+		raw_buffer = alloc(get_tagged_heap_allocator(MEMORY_TAG_AUDIO), new_size);
 		memset(raw_buffer, 0, new_size);
 		raw_buffer_size = new_size;
 	}
 	if (!convert_buffer || required_size > convert_buffer_size) {
-		if (convert_buffer) dealloc(get_heap_allocator(), convert_buffer);
+		if (convert_buffer) dealloc(get_tagged_heap_allocator(MEMORY_TAG_AUDIO), convert_buffer);
 		
 		u64 new_size = get_next_power_of_two(required_size);
 		
-		convert_buffer = alloc(get_heap_allocator(), new_size);
+		convert_buffer = alloc(get_tagged_heap_allocator(MEMORY_TAG_AUDIO), new_size);
 		memset(convert_buffer, 0, new_size);
 		convert_buffer_size = new_size;
 	}
@@ -750,11 +750,11 @@ audio_source_get_frames(Audio_Source *src, u64 first_frame_index,
 		local_persist thread_local void *convert_buffer = 0;
 		local_persist thread_local u64  convert_buffer_size = 0;
 		if (!convert_buffer || required_size > convert_buffer_size) {
-			if (convert_buffer) dealloc(get_heap_allocator(), convert_buffer);
+			if (convert_buffer) dealloc(get_tagged_heap_allocator(MEMORY_TAG_AUDIO), convert_buffer);
 			
 			u64 new_size = get_next_power_of_two(required_size);
 			
-			convert_buffer = alloc(get_heap_allocator(), new_size);
+			convert_buffer = alloc(get_tagged_heap_allocator(MEMORY_TAG_AUDIO), new_size);
 			memset(convert_buffer, 0, new_size);
 			convert_buffer_size = new_size;
 		}
@@ -1219,7 +1219,7 @@ audio_player_get_one() {
 	
 	// No free player found, make another block
 	// #Volatile can't assign to last->next before this is zero initialized
-	Audio_Player_Block *new_block = alloc(get_heap_allocator(), sizeof(Audio_Player_Block));
+	Audio_Player_Block *new_block = alloc(get_tagged_heap_allocator(MEMORY_TAG_AUDIO), sizeof(Audio_Player_Block));
 	
 #if !DO_ZERO_INITIALIATION
 	memset(new_block, 0, sizeof(*new_block));
@@ -1360,6 +1360,7 @@ audio_player_set_looping(Audio_Player *p, bool looping) {
 }
 
 // #Global
+// Atom of the path -> Audio_Source
 ogb_instance Hash_Table just_audio_clips;
 ogb_instance bool just_audio_clips_initted;
 
@@ -1398,20 +1399,21 @@ void
 DEPRECATED(play_one_audio_clip_at_position(string path, Vector3 pos), "Use play_one_audio_clip_with_config() instead") {
 	if (!just_audio_clips_initted) {
 		just_audio_clips_initted = true;
-		just_audio_clips = make_hash_table(string, Audio_Source, get_heap_allocator());
+		just_audio_clips = make_hash_table(Atom, Audio_Source, get_tagged_heap_allocator(MEMORY_TAG_AUDIO));
 	}
 	
-	Audio_Source *src_ptr = hash_table_find(&just_audio_clips, path);
+	Atom path_atom = intern_string(path);
+	Audio_Source *src_ptr = hash_table_find(&just_audio_clips, path_atom);
 	if (src_ptr) {
 		play_one_audio_clip_source_at_position(*src_ptr, pos);
 	} else {
 		Audio_Source new_src;
-		bool ok = audio_open_source_stream(&new_src, path, get_heap_allocator());
+		bool ok = audio_open_source_stream(&new_src, path, get_tagged_heap_allocator(MEMORY_TAG_AUDIO));
 		if (!ok) {
 			log_error("Could not load audio to play from %s", path);
 			return;
 		}
-		hash_table_add(&just_audio_clips, path, new_src);
+		hash_table_add(&just_audio_clips, path_atom, new_src);
 		play_one_audio_clip_source_at_position(new_src, pos);
 	}
 	
@@ -1420,20 +1422,21 @@ void
 play_one_audio_clip_with_config(string path, Audio_Playback_Config config) {
 	if (!just_audio_clips_initted) {
 		just_audio_clips_initted = true;
-		just_audio_clips = make_hash_table(string, Audio_Source, get_heap_allocator());
+		just_audio_clips = make_hash_table(Atom, Audio_Source, get_tagged_heap_allocator(MEMORY_TAG_AUDIO));
 	}
 	
-	Audio_Source *src_ptr = hash_table_find(&just_audio_clips, path);
+	Atom path_atom = intern_string(path);
+	Audio_Source *src_ptr = hash_table_find(&just_audio_clips, path_atom);
 	if (src_ptr) {
 		play_one_audio_clip_source_with_config(*src_ptr, config);
 	} else {
 		Audio_Source new_src;
-		bool ok = audio_open_source_stream(&new_src, path, get_heap_allocator());
+		bool ok = audio_open_source_stream(&new_src, path, get_tagged_heap_allocator(MEMORY_TAG_AUDIO));
 		if (!ok) {
 			log_error("Could not load audio to play from %s", path);
 			return;
 		}
-		hash_table_add(&just_audio_clips, path, new_src);
+		hash_table_add(&just_audio_clips, path_atom, new_src);
 		play_one_audio_clip_source_with_config(new_src, config);
 	}
 }
@@ -1733,8 +1736,8 @@ do_program_audio_sample(u64 number_of_output_frames, Audio_Format out_format,
 			u64 biggest_size = max(input_size, output_size);
 			if (!mix_buffer || mix_buffer_size < biggest_size) {
 				u64 new_size = get_next_power_of_two(biggest_size);
-				if (mix_buffer) dealloc(get_heap_allocator(), mix_buffer);
-				mix_buffer = alloc(get_heap_allocator(), new_size);
+				if (mix_buffer) dealloc(get_tagged_heap_allocator(MEMORY_TAG_AUDIO), mix_buffer);
+				mix_buffer = alloc(get_tagged_heap_allocator(MEMORY_TAG_AUDIO), new_size);
 				mix_buffer_size = new_size;
 				memset(mix_buffer, 0, new_size);
 			}
@@ -1755,8 +1758,8 @@ do_program_audio_sample(u64 number_of_output_frames, Audio_Format out_format,
 					u64 biggest_size = max(input_size, output_size);
 					if (!mix_buffer || mix_buffer_size < biggest_size) {
 						u64 new_size = get_next_power_of_two(biggest_size);
-						if (mix_buffer) dealloc(get_heap_allocator(), mix_buffer);
-						mix_buffer = alloc(get_heap_allocator(), new_size);
+						if (mix_buffer) dealloc(get_tagged_heap_allocator(MEMORY_TAG_AUDIO), mix_buffer);
+						mix_buffer = alloc(get_tagged_heap_allocator(MEMORY_TAG_AUDIO), new_size);
 						mix_buffer_size = new_size;
 						memset(mix_buffer, 0, new_size);
 					}
@@ -1765,8 +1768,8 @@ do_program_audio_sample(u64 number_of_output_frames, Audio_Format out_format,
 				u64 biggest_size = max(input_size, output_size);
 				if (!convert_buffer || convert_buffer_size < biggest_size) {
 					u64 new_size = get_next_power_of_two(biggest_size);
-					if (convert_buffer) dealloc(get_heap_allocator(), convert_buffer);
-					convert_buffer = alloc(get_heap_allocator(), new_size);
+					if (convert_buffer) dealloc(get_tagged_heap_allocator(MEMORY_TAG_AUDIO), convert_buffer);
+					convert_buffer = alloc(get_tagged_heap_allocator(MEMORY_TAG_AUDIO), new_size);
 					convert_buffer_size = new_size;
 					memset(convert_buffer, 0, new_size);
 				}
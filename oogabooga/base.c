@@ -62,6 +62,15 @@ typedef enum Allocator_Message {
 	ALLOCATOR_ALLOCATE,
 	ALLOCATOR_DEALLOCATE,
 	ALLOCATOR_REALLOCATE,
+	// Resize without moving. Returns p if it worked, 0 if it didn't (and p is left untouched).
+	ALLOCATOR_TRY_EXPAND,
+	// Like ALLOCATOR_ALLOCATE, but the alignment (power of 2) is passed in p. Returns 0 if the
+	// allocator doesn't support it.
+	ALLOCATOR_ALLOCATE_ALIGNED,
+	// Like ALLOCATOR_ALLOCATE, but the memory must be zero. Allocators that know when memory
+	// is already zero (fresh pages from the OS) can skip clearing it. Returns 0 if the
+	// allocator doesn't support it.
+	ALLOCATOR_ALLOCATE_ZEROED,
 } Allocator_Message;
 typedef void*(*Allocator_Proc)(u64, void*, Allocator_Message, void*);
 
@@ -92,6 +101,10 @@ typedef struct Context {
 	
 	u64 thread_id;
 	
+	// Default allocator for library & engine code that doesn't get one passed in. Heap
+	// unless you push something else. Use get_context_allocator() rather than reading it.
+	Allocator allocator;
+	
 	CONTEXT_EXTRA extra;
 } Context;
 
@@ -111,14 +124,40 @@ alloc(Allocator allocator, u64 size);
 ogb_instance void* 
 alloc_uninitialized(Allocator allocator, u64 size);
 
+// Always zero, even without DO_ZERO_INITIALIZATION.
+ogb_instance void* 
+alloc_zeroed(Allocator allocator, u64 size);
+
+// For SIMD & cache line aligned buffers. Dealloc it like any other allocation.
+// Note that reallocating it may move it to memory which is only aligned as usual.
+ogb_instance void* 
+alloc_aligned(Allocator allocator, u64 size, u64 alignment);
+
 ogb_instance void 
 dealloc(Allocator allocator, void *p);
 
+// Tries to make the allocation at p size bytes big without moving it, so containers can grow
+// without copying. Returns false if the allocator can't, in which case you need to alloc & copy.
+ogb_instance bool 
+try_expand(Allocator allocator, void *p, u64 size);
+
 ogb_instance void 
 push_context(Context c);
 
 ogb_instance void 
 pop_context();
+
+// The allocator in the current context, heap if none was set.
+ogb_instance Allocator 
+get_context_allocator();
+
+// Pushes a copy of the current context with a different allocator. Pop with pop_context().
+// For example to load a level into an arena and throw it all away at once:
+//     push_allocator(level_arena);
+//     load_level(path);
+//     pop_context();
+ogb_instance void 
+push_allocator(Allocator allocator);
 //
 //
 
@@ -129,28 +168,74 @@ thread_local Context context;
 thread_local Context context_stack[CONTEXT_STACK_MAX];
 thread_local u64 num_contexts = 0;
 
+void zero_memory_streaming(void *p, u64 size);
+
+#if ENABLE_ALLOCATION_PROFILING
+// In memory.c
+void allocation_profiler_sample(Allocator allocator, u64 size);
+thread_local s64 allocation_profiler_countdown = 0;
+#define profile_allocation(allocator, size) do { if (--allocation_profiler_countdown < 0) allocation_profiler_sample(allocator, size); } while (0)
+#else
+#define profile_allocation(...) do {} while (0)
+#endif
+
 void* 
 alloc(Allocator allocator, u64 size) {
-	assert(size > 0, "You requested an allocation of zero bytes. I'm not sure what you want with that.");
-	void *p = allocator.proc(size, 0, ALLOCATOR_ALLOCATE, allocator.data);
 #if DO_ZERO_INITIALIZATION
-	memset(p, 0, size);
+	return alloc_zeroed(allocator, size);
+#else
+	assert(size > 0, "You requested an allocation of zero bytes. I'm not sure what you want with that.");
+	profile_allocation(allocator, size);
+	return allocator.proc(size, 0, ALLOCATOR_ALLOCATE, allocator.data);
 #endif
+}
+
+void* 
+alloc_zeroed(Allocator allocator, u64 size) {
+	assert(size > 0, "You requested an allocation of zero bytes. I'm not sure what you want with that.");
+	profile_allocation(allocator, size);
+	void *p = allocator.proc(size, 0, ALLOCATOR_ALLOCATE_ZEROED, allocator.data);
+	if (!p) {
+		p = allocator.proc(size, 0, ALLOCATOR_ALLOCATE, allocator.data);
+		zero_memory_streaming(p, size);
+	}
 	return p;
 }
 
 void* 
 alloc_uninitialized(Allocator allocator, u64 size) {
 	assert(size > 0, "You requested an allocation of zero bytes. I'm not sure what you want with that.");
+	profile_allocation(allocator, size);
 	return allocator.proc(size, 0, ALLOCATOR_ALLOCATE, allocator.data);	
 }
 
+void* 
+alloc_aligned(Allocator allocator, u64 size, u64 alignment) {
+	assert(size > 0, "You requested an allocation of zero bytes. I'm not sure what you want with that.");
+	assert(alignment > 0 && (alignment & (alignment-1)) == 0, "Alignment must be a power of 2, got %llu", alignment);
+	profile_allocation(allocator, size);
+	void *p = allocator.proc(size, (void*)alignment, ALLOCATOR_ALLOCATE_ALIGNED, allocator.data);
+	assert(p != 0, "This allocator does not support aligned allocations");
+	assert((u64)p % alignment == 0, "Allocator returned memory which is not aligned to %llu", alignment);
+#if DO_ZERO_INITIALIZATION
+	zero_memory_streaming(p, size);
+#endif
+	return p;
+}
+
 void 
 dealloc(Allocator allocator, void *p) {
 	assert(p != 0, "You tried to deallocate a pointer at adress 0. That doesn't make sense!");
 	allocator.proc(0, p, ALLOCATOR_DEALLOCATE, allocator.data);
 }
 
+bool 
+try_expand(Allocator allocator, void *p, u64 size) {
+	assert(p != 0, "You tried to expand a pointer at adress 0. That doesn't make sense!");
+	assert(size > 0, "You tried to expand to zero bytes. I'm not sure what you want with that.");
+	return allocator.proc(size, p, ALLOCATOR_TRY_EXPAND, allocator.data) != 0;
+}
+
 void 
 push_context(Context c) {
 	assert(num_contexts < CONTEXT_STACK_MAX, "Context stack overflow");
@@ -171,6 +256,20 @@ Context get_context() {
     return context;
 }
 
+Allocator 
+get_context_allocator() {
+	if (!context.allocator.proc) return get_heap_allocator();
+	return context.allocator;
+}
+
+void 
+push_allocator(Allocator allocator) {
+	assert(allocator.proc, "Pushed an allocator without a proc");
+	Context c = context;
+	c.allocator = allocator;
+	push_context(c);
+}
+
 #endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
 
 u64 
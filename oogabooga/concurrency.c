@@ -10,6 +10,25 @@ inline bool compare_and_swap_32(volatile uint32_t *a, uint32_t b, uint32_t old);
 inline bool compare_and_swap_64(volatile uint64_t *a, uint64_t b, uint64_t old);
 inline bool compare_and_swap_bool(volatile bool *a, bool b, bool old);
 
+///
+// Waiting in spin loops
+// _mm_pause tells the core we're spinning, so it doesn't flood the memory bus & gives the
+// other hyperthread on the core more time. Backing off exponentially means that many threads
+// spinning on the same lock don't all rush it the moment it's released.
+#define SPIN_BACKOFF_MAX_PAUSES 64
+
+inline void
+spin_pause() {
+	_mm_pause();
+}
+
+// Start with *pauses = 1, it doubles every call up to SPIN_BACKOFF_MAX_PAUSES
+inline void
+spin_backoff(u32 *pauses) {
+	for (u32 i = 0; i < *pauses; i += 1) spin_pause();
+	if (*pauses < SPIN_BACKOFF_MAX_PAUSES) *pauses *= 2;
+}
+
 ///
 // Spinlock "primitive"
 // Like a mutex but it eats up the entire core while waiting.
@@ -33,16 +52,44 @@ spinlock_release(Spinlock* l);
 
 
 ///
-// High-level mutex primitive (short spinlock then OS mutex lock)
-// Just spins for a few (configurable) microseconds with a spinlock,
-// and if acquiring fails it falls back to a OS mutex.
-#define MUTEX_DEFAULT_SPIN_TIME_MICROSECONDS 100
+// Ticket lock
+// A spinlock where threads get the lock in the order they started waiting for it, so no
+// thread can be starved by others that keep grabbing it. The price is that the lock can only
+// be handed to the thread next in line, so it gets slow with more waiters than there are cores.
+#define TICKET_LOCK_SPINS_BEFORE_YIELD 16
+
+typedef struct Ticket_Lock {
+	volatile u32 next_ticket;
+	volatile u32 now_serving;
+} Ticket_Lock;
+
+void ogb_instance
+ticket_lock_init(Ticket_Lock *l);
+
+void ogb_instance
+ticket_lock_acquire_or_wait(Ticket_Lock *l);
+
+void ogb_instance
+ticket_lock_release(Ticket_Lock *l);
+
+
+///
+// High-level mutex primitive
+// A single 32-bit word. Spins for a short while with backoff, which is usually all it takes
+// because locks are mostly held for a very short time, and then sleeps the thread with
+// os_wait_on_address until the lock is released.
+// Releasing only goes to the OS if a thread is actually sleeping on the mutex.
+#define MUTEX_SPIN_COUNT 64
+
+typedef enum Mutex_State {
+	MUTEX_UNLOCKED = 0,
+	MUTEX_LOCKED,
+	// Locked, and threads might be sleeping on it
+	MUTEX_LOCKED_WITH_WAITERS,
+} Mutex_State;
+
 typedef struct Mutex {
-	Spinlock spinlock;
-	f64 spin_time_microseconds;
-	Mutex_Handle os_handle;
-	volatile bool spinlock_acquired;
-	volatile u64 acquiring_thread;
+	volatile u32 state; // Mutex_State
 } Mutex;
 
 void ogb_instance
@@ -54,81 +101,633 @@ mutex_destroy(Mutex *m);
 void ogb_instance
 mutex_acquire_or_wait(Mutex *m);
 
+// Returns false right away if another thread has it
+bool ogb_instance
+mutex_try_acquire(Mutex *m);
+
 void ogb_instance
 mutex_release(Mutex *m);
 
 
+///
+// Reader-writer lock
+// Any number of readers at once, or one writer. Waiting writers stop new readers from
+// getting in, so a steady stream of readers can't keep a writer out forever.
+// Spins & sleeps like Mutex.
+#define RW_LOCK_WRITER         0x80000000
+#define RW_LOCK_WRITER_WAITING 0x40000000
+// Threads might be sleeping on the lock
+#define RW_LOCK_PARKED         0x20000000
+#define RW_LOCK_READER_MASK    0x1FFFFFFF
+
+typedef struct RW_Lock {
+	volatile u32 state;
+} RW_Lock;
+
+void ogb_instance
+rw_lock_init(RW_Lock *l);
+
+void ogb_instance
+rw_lock_acquire_read(RW_Lock *l);
+
+void ogb_instance
+rw_lock_release_read(RW_Lock *l);
+
+void ogb_instance
+rw_lock_acquire_write(RW_Lock *l);
+
+void ogb_instance
+rw_lock_release_write(RW_Lock *l);
+
 #if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
 
 void spinlock_init(Spinlock *l) {
 	memset(l, 0, sizeof(*l));
 }
 void spinlock_acquire_or_wait(Spinlock* l) {
+	u32 pauses = 1;
 	while (true) {
         bool expected = false;
         if (compare_and_swap_bool(&l->locked, true, expected)) {
             return;
         }
+        // Only read while it's locked, so we're not fighting over the cache line
         while (l->locked) {
-            // spinny boi
+            spin_backoff(&pauses);
         }
     }
 }
 // Returns true on aquired, false if timeout seconds reached
 bool spinlock_acquire_or_wait_timeout(Spinlock* l, f64 timeout_seconds) {
     f64 start = os_get_elapsed_seconds();
+	u32 pauses = 1;
 	while (true) {
         bool expected = false;
         if (compare_and_swap_bool(&l->locked, true, expected)) {
             return true;
         }
         while (l->locked) {
-            // spinny boi
+            spin_backoff(&pauses);
             if ((os_get_elapsed_seconds()-start) >= timeout_seconds) return false;
         }
     }
     return true;
 }
 void spinlock_release(Spinlock* l) {
-	bool expected = true;
-    bool success = compare_and_swap_bool(&l->locked, false, expected);
-    assert(success, "This thread should have acquired the spinlock but compare_and_swap failed");
+    assert(l->locked, "This thread should have acquired the spinlock but it is not locked");
+    atomic_store_release_bool(&l->locked, false);
+}
+
+
+///
+// Ticket lock
+
+void ticket_lock_init(Ticket_Lock *l) {
+	l->next_ticket = 0;
+	l->now_serving = 0;
+}
+void ticket_lock_acquire_or_wait(Ticket_Lock *l) {
+	u32 ticket = atomic_fetch_add_relaxed_32(&l->next_ticket, 1);
+	
+	u32 spins = 0;
+	while (true) {
+		u32 serving = atomic_load_acquire_32(&l->now_serving);
+		if (serving == ticket) break;
+		// Wait longer the further back in line we are
+		u32 pauses = (ticket - serving) * 16;
+		for (u32 i = 0; i < pauses; i += 1) spin_pause();
+		
+		// The thread next in line might not be running (more waiters than cores), so give
+		// it our time slice instead of spinning through it.
+		spins += 1;
+		if (spins >= TICKET_LOCK_SPINS_BEFORE_YIELD) os_yield_thread();
+	}
+}
+void ticket_lock_release(Ticket_Lock *l) {
+	assert(l->now_serving != l->next_ticket, "Tried to release a ticket lock which is not acquired");
+	// Only the thread holding the lock writes this
+	atomic_store_release_32(&l->now_serving, l->now_serving + 1);
 }
 
 
 ///
-// High-level mutex primitive (short spinlock then OS mutex lock)
+// High-level mutex primitive
 
 void mutex_init(Mutex *m) {
-	spinlock_init(&m->spinlock);
-	m->spin_time_microseconds = MUTEX_DEFAULT_SPIN_TIME_MICROSECONDS;
-	m->os_handle = os_make_mutex();
-	m->spinlock_acquired = false;
-	m->acquiring_thread = 0;
+	m->state = MUTEX_UNLOCKED;
 }
 void mutex_destroy(Mutex *m) {
-	os_destroy_mutex(m->os_handle);
+	assert(m->state == MUTEX_UNLOCKED, "Destroyed a mutex which is acquired");
+}
+bool mutex_try_acquire(Mutex *m) {
+	return compare_and_swap_32(&m->state, MUTEX_LOCKED, MUTEX_UNLOCKED);
 }
 void mutex_acquire_or_wait(Mutex *m) {
-	if (spinlock_acquire_or_wait_timeout(&m->spinlock, m->spin_time_microseconds / 1000000.0)) {
-        assert(!m->spinlock_acquired, "Internal sync error in Mutex");
-    	m->spinlock_acquired = true;
-    }
-    os_lock_mutex(m->os_handle);
-    
-    assert(!m->acquiring_thread, "Internal sync error in Mutex: Multiple threads acquired");
-    m->acquiring_thread = context.thread_id;
+	if (mutex_try_acquire(m)) return;
+	
+	u32 pauses = 1;
+	for (u32 i = 0; i < MUTEX_SPIN_COUNT; i += 1) {
+		spin_backoff(&pauses);
+		if (m->state == MUTEX_UNLOCKED && mutex_try_acquire(m)) return;
+	}
+	
+	while (true) {
+		u32 state = m->state;
+		if (state == MUTEX_UNLOCKED) {
+			// We don't know if others are sleeping, so assume they are
+			if (compare_and_swap_32(&m->state, MUTEX_LOCKED_WITH_WAITERS, MUTEX_UNLOCKED)) return;
+			continue;
+		}
+		if (state == MUTEX_LOCKED) {
+			// Let the holder know it needs to wake someone up when it releases
+			if (!compare_and_swap_32(&m->state, MUTEX_LOCKED_WITH_WAITERS, MUTEX_LOCKED)) continue;
+		}
+		
+		u32 compare = MUTEX_LOCKED_WITH_WAITERS;
+		os_wait_on_address(&m->state, &compare, sizeof(compare));
+	}
 }
 void mutex_release(Mutex *m) {
-	assert(m->acquiring_thread != 0, "Tried to release a mutex which is not acquired");
-	assert(m->acquiring_thread == context.thread_id, "Non-owning thread tried to release mutex");
-	m->acquiring_thread = 0;
-	bool was_spinlock_acquired = m->spinlock_acquired;
-	m->spinlock_acquired = false;
-	os_unlock_mutex(m->os_handle);
-	if (was_spinlock_acquired) {
-		spinlock_release(&m->spinlock);
+	u32 state = atomic_exchange_32(&m->state, MUTEX_UNLOCKED);
+	assert(state != MUTEX_UNLOCKED, "Tried to release a mutex which is not acquired");
+	
+	if (state == MUTEX_LOCKED_WITH_WAITERS) os_wake_one_on_address(&m->state);
+}
+
+
+///
+// Reader-writer lock
+
+void rw_lock_init(RW_Lock *l) {
+	l->state = 0;
+}
+
+// Call after setting RW_LOCK_PARKED in the state we're waiting to change
+void rw_lock_park(RW_Lock *l, u32 state) {
+	os_wait_on_address(&l->state, &state, sizeof(state));
+}
+
+void rw_lock_acquire_read(RW_Lock *l) {
+	u32 pauses = 1;
+	u32 spins = 0;
+	while (true) {
+		u32 state = l->state;
+		if (!(state & (RW_LOCK_WRITER | RW_LOCK_WRITER_WAITING))) {
+			assert((state & RW_LOCK_READER_MASK) != RW_LOCK_READER_MASK, "Too many readers on RW_Lock");
+			if (compare_and_swap_32(&l->state, state + 1, state)) return;
+			continue;
+		}
+		
+		if (spins < MUTEX_SPIN_COUNT) {
+			spin_backoff(&pauses);
+			spins += 1;
+			continue;
+		}
+		
+		if (!(state & RW_LOCK_PARKED)) {
+			if (!compare_and_swap_32(&l->state, state | RW_LOCK_PARKED, state)) continue;
+			state |= RW_LOCK_PARKED;
+		}
+		rw_lock_park(l, state);
 	}
 }
+void rw_lock_release_read(RW_Lock *l) {
+	u32 state, new_state;
+	do {
+		state = l->state;
+		assert((state & RW_LOCK_READER_MASK) > 0, "Tried to release a read lock which is not acquired");
+		new_state = state - 1;
+		// Last reader out lets sleeping writers know
+		if ((new_state & RW_LOCK_READER_MASK) == 0) new_state &= ~RW_LOCK_PARKED;
+	} while (!compare_and_swap_32(&l->state, new_state, state));
+	
+	if ((state & RW_LOCK_PARKED) && !(new_state & RW_LOCK_PARKED)) os_wake_all_on_address(&l->state);
+}
+void rw_lock_acquire_write(RW_Lock *l) {
+	u32 pauses = 1;
+	u32 spins = 0;
+	while (true) {
+		u32 state = l->state;
+		if (!(state & (RW_LOCK_WRITER | RW_LOCK_READER_MASK))) {
+			// Other writers that are still waiting set WRITER_WAITING again
+			if (compare_and_swap_32(&l->state, RW_LOCK_WRITER | (state & RW_LOCK_PARKED), state)) return;
+			continue;
+		}
+		
+		if (!(state & RW_LOCK_WRITER_WAITING)) {
+			compare_and_swap_32(&l->state, state | RW_LOCK_WRITER_WAITING, state);
+			continue;
+		}
+		
+		if (spins < MUTEX_SPIN_COUNT) {
+			spin_backoff(&pauses);
+			spins += 1;
+			continue;
+		}
+		
+		if (!(state & RW_LOCK_PARKED)) {
+			if (!compare_and_swap_32(&l->state, state | RW_LOCK_PARKED, state)) continue;
+			state |= RW_LOCK_PARKED;
+		}
+		rw_lock_park(l, state);
+	}
+}
+void rw_lock_release_write(RW_Lock *l) {
+	u32 state, new_state;
+	do {
+		state = l->state;
+		assert(state & RW_LOCK_WRITER, "Tried to release a write lock which is not acquired");
+		new_state = state & ~(RW_LOCK_WRITER | RW_LOCK_PARKED);
+	} while (!compare_and_swap_32(&l->state, new_state, state));
+	
+	if (state & RW_LOCK_PARKED) os_wake_all_on_address(&l->state);
+}
+
+#endif
+///
+// Concurrent hash table
+// A Hash_Table split into shards by hash, each with its own spinlock on its own cache line,
+// so threads only wait for each other when they hit the same shard at the same time.
+// Values are copied in & out under the lock (pointers into a table can move when another
+// thread grows it), so keep values small; store a pointer or handle for anything big.
+/*
+
+	// Shared cache of images by path
+	Concurrent_Hash_Table images = make_concurrent_hash_table(string, Gfx_Image*, get_heap_allocator());
+	
+	Gfx_Image *image = 0;
+	if (!concurrent_hash_table_find(&images, path, image)) {
+		Gfx_Image *loaded = load_image_from_disk(path, get_heap_allocator());
+		image = loaded;
+		// If another thread got there first, image is set to theirs and we can throw ours away
+		if (!concurrent_hash_table_get_or_insert(&images, path, image)) {
+			delete_image(loaded);
+		}
+	}
+	
+	Same lvalue rules as Hash_Table. value is written to by find & get_or_insert.
+*/
+
+#define CONCURRENT_HASH_TABLE_SHARD_COUNT_LOG2 6
+#define CONCURRENT_HASH_TABLE_SHARD_COUNT (1 << CONCURRENT_HASH_TABLE_SHARD_COUNT_LOG2)
+
+#define make_concurrent_hash_table(Key_Type, Value_Type, allocator) \
+	make_concurrent_hash_table_raw(sizeof(Key_Type), sizeof(Value_Type), hash_table_key_is_string(Key_Type), allocator)
+
+#define concurrent_hash_table_find(table_ptr, key, value) \
+	concurrent_hash_table_find_raw((table_ptr), get_hash(key), &(key), &(value), sizeof(key), sizeof(value))
+
+#define concurrent_hash_table_contains(table_ptr, key) \
+	concurrent_hash_table_find_raw((table_ptr), get_hash(key), &(key), 0, sizeof(key), 0)
 
-#endif
\ No newline at end of file
+#define concurrent_hash_table_get_or_insert(table_ptr, key, value) \
+	concurrent_hash_table_get_or_insert_raw((table_ptr), get_hash(key), &(key), &(value), sizeof(key), sizeof(value))
+
+#define concurrent_hash_table_set(table_ptr, key, value) \
+	concurrent_hash_table_set_raw((table_ptr), get_hash(key), &(key), &(value), sizeof(key), sizeof(value))
+
+#define concurrent_hash_table_remove(table_ptr, key) \
+	concurrent_hash_table_remove_raw((table_ptr), get_hash(key), &(key), sizeof(key))
+
+typedef struct alignat(64) Concurrent_Hash_Table_Shard {
+	Spinlock lock;
+	Hash_Table table;
+} Concurrent_Hash_Table_Shard;
+
+typedef struct Concurrent_Hash_Table {
+	Concurrent_Hash_Table_Shard *shards;
+	Allocator allocator;
+} Concurrent_Hash_Table;
+
+Concurrent_Hash_Table make_concurrent_hash_table_raw(u64 key_size, u64 value_size, bool key_is_string, Allocator allocator) {
+	Concurrent_Hash_Table t;
+	t.allocator = allocator;
+	t.shards = (Concurrent_Hash_Table_Shard*)alloc_aligned(allocator, sizeof(Concurrent_Hash_Table_Shard)*CONCURRENT_HASH_TABLE_SHARD_COUNT, CACHE_LINE_SIZE);
+	
+	for (u64 i = 0; i < CONCURRENT_HASH_TABLE_SHARD_COUNT; i += 1) {
+		spinlock_init(&t.shards[i].lock);
+		t.shards[i].table = make_hash_table_reserve_raw(key_size, value_size, key_is_string, 16, allocator);
+	}
+	
+	return t;
+}
+void concurrent_hash_table_destroy(Concurrent_Hash_Table *t) {
+	for (u64 i = 0; i < CONCURRENT_HASH_TABLE_SHARD_COUNT; i += 1) {
+		hash_table_destroy(&t->shards[i].table);
+	}
+	dealloc(t->allocator, t->shards);
+	t->shards = 0;
+}
+
+inline Concurrent_Hash_Table_Shard *concurrent_hash_table_get_shard(Concurrent_Hash_Table *t, u64 hash) {
+	// Different bits than the ones the shard's own table uses for its index
+	return &t->shards[(hash * PRIME64_2) >> (64 - CONCURRENT_HASH_TABLE_SHARD_COUNT_LOG2)];
+}
+
+// Copies the value to v if found and v isn't null
+bool concurrent_hash_table_find_raw(Concurrent_Hash_Table *t, u64 hash, void *k, void *v, u64 key_size, u64 value_size) {
+	Concurrent_Hash_Table_Shard *shard = concurrent_hash_table_get_shard(t, hash);
+	
+	spinlock_acquire_or_wait(&shard->lock);
+	void *existing = hash_table_find_raw(&shard->table, hash, k, key_size);
+	if (existing && v) {
+		assert(shard->table._value_size == value_size, "Value type size does not match hash table initted value type size");
+		memcpy(v, existing, value_size);
+	}
+	spinlock_release(&shard->lock);
+	
+	return existing != 0;
+}
+
+// Adds the key with value v if it's not in the table. Otherwise v is set to the value
+// that is already there. Returns true if it was added.
+bool concurrent_hash_table_get_or_insert_raw(Concurrent_Hash_Table *t, u64 hash, void *k, void *v, u64 key_size, u64 value_size) {
+	Concurrent_Hash_Table_Shard *shard = concurrent_hash_table_get_shard(t, hash);
+	
+	spinlock_acquire_or_wait(&shard->lock);
+	void *existing = hash_table_find_raw(&shard->table, hash, k, key_size);
+	if (existing) {
+		memcpy(v, existing, value_size);
+	} else {
+		hash_table_add_raw(&shard->table, hash, k, v, key_size, value_size);
+	}
+	spinlock_release(&shard->lock);
+	
+	return existing == 0;
+}
+
+// Returns true if key was newly added or false if it already existed
+bool concurrent_hash_table_set_raw(Concurrent_Hash_Table *t, u64 hash, void *k, void *v, u64 key_size, u64 value_size) {
+	Concurrent_Hash_Table_Shard *shard = concurrent_hash_table_get_shard(t, hash);
+	
+	spinlock_acquire_or_wait(&shard->lock);
+	bool newly_added = hash_table_set_raw(&shard->table, hash, k, v, key_size, value_size);
+	spinlock_release(&shard->lock);
+	
+	return newly_added;
+}
+
+bool concurrent_hash_table_remove_raw(Concurrent_Hash_Table *t, u64 hash, void *k, u64 key_size) {
+	Concurrent_Hash_Table_Shard *shard = concurrent_hash_table_get_shard(t, hash);
+	
+	spinlock_acquire_or_wait(&shard->lock);
+	bool removed = hash_table_remove_raw(&shard->table, hash, k, key_size);
+	spinlock_release(&shard->lock);
+	
+	return removed;
+}
+
+// Not synchronized with other threads modifying the table, just a snapshot
+u64 concurrent_hash_table_get_count(Concurrent_Hash_Table *t) {
+	u64 count = 0;
+	for (u64 i = 0; i < CONCURRENT_HASH_TABLE_SHARD_COUNT; i += 1) {
+		count += t->shards[i].table.count;
+	}
+	return count;
+}
+
+///
+// Lock-free queues
+// Bounded ring buffers of fixed size elements, for handing data between threads without
+// locks (commands to the audio thread, log messages, work items). Capacity is rounded up to
+// a power of two. Push fails when the queue is full & pop fails when it's empty, so it's up
+// to the caller to retry, drop, or fall back to something else.
+// The read & write positions are on separate cache lines, so producers & consumers don't
+// fight over the same line unless the queue is close to empty or full.
+/*
+
+	Spsc_Queue commands;
+	spsc_queue_init(&commands, 1024, sizeof(Audio_Command), get_heap_allocator());
+	
+	// Game thread
+	Audio_Command c = ...;
+	if (!spsc_queue_push(&commands, &c)) log_warning("Audio command queue is full");
+	
+	// Audio thread
+	Audio_Command batch[64];
+	u64 count = spsc_queue_pop_batch(&commands, batch, 64);
+
+*/
+
+///
+// Single producer, single consumer
+// Exactly one thread may push & exactly one thread may pop. Both are wait-free.
+typedef struct alignat(64) Spsc_Queue {
+	// Written by the consumer
+	volatile u64 head;
+	// Producer's tail as last seen by the consumer, so it doesn't read the producer's cache
+	// line every pop
+	u64 cached_tail;
+	u8 _pad0[CACHE_LINE_SIZE-sizeof(u64)*2];
+	
+	// Written by the producer
+	volatile u64 tail;
+	u64 cached_head;
+	u8 _pad1[CACHE_LINE_SIZE-sizeof(u64)*2];
+	
+	u8 *buffer;
+	u64 capacity;
+	u64 element_size;
+	Allocator allocator;
+} Spsc_Queue;
+
+void spsc_queue_init(Spsc_Queue *q, u64 capacity, u64 element_size, Allocator allocator) {
+	assert(capacity > 0, "Spsc_Queue capacity must be more than 0");
+	memset(q, 0, sizeof(*q));
+	q->capacity = get_next_power_of_two(capacity);
+	q->element_size = element_size;
+	q->allocator = allocator;
+	q->buffer = (u8*)alloc_aligned(allocator, q->capacity*element_size, CACHE_LINE_SIZE);
+}
+void spsc_queue_destroy(Spsc_Queue *q) {
+	dealloc(q->allocator, q->buffer);
+	q->buffer = 0;
+}
+
+// Copies between items and the ring starting at position, wrapping around the end
+void spsc_queue_copy(Spsc_Queue *q, u64 position, void *items, u64 count, bool to_ring) {
+	u64 index = position & (q->capacity-1);
+	u64 first_count = min(count, q->capacity-index);
+	u8 *ring = q->buffer + index*q->element_size;
+	u8 *other = (u8*)items;
+	if (to_ring) {
+		memcpy(ring, other, first_count*q->element_size);
+		memcpy(q->buffer, other + first_count*q->element_size, (count-first_count)*q->element_size);
+	} else {
+		memcpy(other, ring, first_count*q->element_size);
+		memcpy(other + first_count*q->element_size, q->buffer, (count-first_count)*q->element_size);
+	}
+}
+
+// Only call from the producer thread. Returns how many of the items were pushed, which is
+// less than count if the queue filled up.
+u64 spsc_queue_push_batch(Spsc_Queue *q, void *items, u64 count) {
+	u64 tail = q->tail;
+	u64 free_count = q->capacity - (tail - q->cached_head);
+	if (free_count < count) {
+		q->cached_head = atomic_load_acquire_64(&q->head);
+		free_count = q->capacity - (tail - q->cached_head);
+	}
+	count = min(count, free_count);
+	if (count == 0) return 0;
+	
+	spsc_queue_copy(q, tail, items, count, true);
+	
+	// Items must be written before the consumer can see the new tail
+	atomic_store_release_64(&q->tail, tail + count);
+	
+	return count;
+}
+bool spsc_queue_push(Spsc_Queue *q, void *item) {
+	return spsc_queue_push_batch(q, item, 1) == 1;
+}
+
+// Only call from the consumer thread. Returns how many items were popped into items.
+u64 spsc_queue_pop_batch(Spsc_Queue *q, void *items, u64 max_count) {
+	u64 head = q->head;
+	u64 available = q->cached_tail - head;
+	if (available < max_count) {
+		// Acquire, so we don't read the items before we've seen the tail
+		q->cached_tail = atomic_load_acquire_64(&q->tail);
+		available = q->cached_tail - head;
+	}
+	u64 count = min(max_count, available);
+	if (count == 0) return 0;
+	
+	spsc_queue_copy(q, head, items, count, false);
+	
+	// Items must be read before the producer can reuse their slots
+	atomic_store_release_64(&q->head, head + count);
+	
+	return count;
+}
+bool spsc_queue_pop(Spsc_Queue *q, void *item) {
+	return spsc_queue_pop_batch(q, item, 1) == 1;
+}
+
+// Just a snapshot, might be stale by the time it returns
+u64 spsc_queue_get_count(Spsc_Queue *q) {
+	u64 head = atomic_load_relaxed_64(&q->head);
+	u64 tail = atomic_load_relaxed_64(&q->tail);
+	return tail > head ? tail - head : 0;
+}
+
+///
+// Multiple producers, multiple consumers
+// Dmitry Vyukov's bounded queue. Every slot has a sequence number that says which lap of the
+// ring it's ready for, so a producer or consumer only needs a single compare_and_swap on the
+// write or read position to claim slots, and never waits for another thread to finish
+// with a slot it isn't using.
+// Lock-free but not wait-free: a thread can retry when another thread claims the same
+// slots first.
+typedef struct alignat(64) Mpmc_Queue {
+	volatile u64 enqueue_position;
+	u8 _pad0[CACHE_LINE_SIZE-sizeof(u64)];
+	volatile u64 dequeue_position;
+	u8 _pad1[CACHE_LINE_SIZE-sizeof(u64)];
+	
+	// Each cell is a u64 sequence number followed by the element
+	u8 *cells;
+	u64 cell_stride;
+	u64 capacity;
+	u64 element_size;
+	Allocator allocator;
+} Mpmc_Queue;
+
+void mpmc_queue_init(Mpmc_Queue *q, u64 capacity, u64 element_size, Allocator allocator) {
+	assert(capacity > 0, "Mpmc_Queue capacity must be more than 0");
+	memset(q, 0, sizeof(*q));
+	q->capacity = get_next_power_of_two(capacity);
+	q->element_size = element_size;
+	q->cell_stride = align_next(sizeof(u64) + element_size, sizeof(u64));
+	q->allocator = allocator;
+	q->cells = (u8*)alloc_aligned(allocator, q->capacity*q->cell_stride, CACHE_LINE_SIZE);
+	
+	for (u64 i = 0; i < q->capacity; i += 1) {
+		*(volatile u64*)(q->cells + i*q->cell_stride) = i;
+	}
+}
+void mpmc_queue_destroy(Mpmc_Queue *q) {
+	dealloc(q->allocator, q->cells);
+	q->cells = 0;
+}
+
+inline volatile u64 *mpmc_queue_get_sequence(Mpmc_Queue *q, u64 position) {
+	return (volatile u64*)(q->cells + (position & (q->capacity-1))*q->cell_stride);
+}
+inline u8 *mpmc_queue_get_element(Mpmc_Queue *q, u64 position) {
+	return q->cells + (position & (q->capacity-1))*q->cell_stride + sizeof(u64);
+}
+
+// Claims up to max_count consecutive cells at the enqueue or dequeue position which are
+// ready for it. Returns the number claimed and sets *first to the first claimed position.
+u64 mpmc_queue_claim(Mpmc_Queue *q, volatile u64 *position, u64 ready_offset, u64 max_count, u64 *first) {
+	u64 p = *position;
+	while (true) {
+		u64 count = 0;
+		bool behind = false;
+		while (count < max_count) {
+			s64 diff = (s64)(atomic_load_acquire_64(mpmc_queue_get_sequence(q, p+count)) - (p+count+ready_offset));
+			if (diff != 0) {
+				// Another thread already claimed this position, so ours is stale
+				behind = diff > 0 && count == 0;
+				break;
+			}
+			count += 1;
+		}
+		
+		if (behind) {
+			p = *position;
+			continue;
+		}
+		if (count == 0) return 0;
+		
+		if (compare_and_swap_64(position, p+count, p)) {
+			*first = p;
+			return count;
+		}
+		spin_pause();
+		p = *position;
+	}
+}
+
+// Returns how many of the items were pushed, which is less than count if the queue filled up.
+u64 mpmc_queue_push_batch(Mpmc_Queue *q, void *items, u64 count) {
+	u64 first;
+	count = mpmc_queue_claim(q, &q->enqueue_position, 0, count, &first);
+	
+	for (u64 i = 0; i < count; i += 1) {
+		memcpy(mpmc_queue_get_element(q, first+i), (u8*)items + i*q->element_size, q->element_size);
+		// Element must be written before consumers can see the cell is ready
+		atomic_store_release_64(mpmc_queue_get_sequence(q, first+i), first+i+1);
+	}
+	
+	return count;
+}
+bool mpmc_queue_push(Mpmc_Queue *q, void *item) {
+	return mpmc_queue_push_batch(q, item, 1) == 1;
+}
+
+// Returns how many items were popped into items.
+u64 mpmc_queue_pop_batch(Mpmc_Queue *q, void *items, u64 max_count) {
+	u64 first;
+	u64 count = mpmc_queue_claim(q, &q->dequeue_position, 1, max_count, &first);
+	
+	for (u64 i = 0; i < count; i += 1) {
+		memcpy((u8*)items + i*q->element_size, mpmc_queue_get_element(q, first+i), q->element_size);
+		// Element must be read before producers can see the cell is free for the next lap
+		atomic_store_release_64(mpmc_queue_get_sequence(q, first+i), first+i+q->capacity);
+	}
+	
+	return count;
+}
+bool mpmc_queue_pop(Mpmc_Queue *q, void *item) {
+	return mpmc_queue_pop_batch(q, item, 1) == 1;
+}
+
+// Just a snapshot, might be stale by the time it returns
+u64 mpmc_queue_get_count(Mpmc_Queue *q) {
+	u64 dequeue_position = atomic_load_relaxed_64(&q->dequeue_position);
+	u64 enqueue_position = atomic_load_relaxed_64(&q->enqueue_position);
+	return enqueue_position > dequeue_position ? enqueue_position - dequeue_position : 0;
+}
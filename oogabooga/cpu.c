@@ -23,6 +23,9 @@ typedef struct Cpu_Capabilities {
 // I think this is the standard? (sse1)
 #define COMPILER_CAN_DO_SSE 1
 
+// Not queried, but it's 64 on every x86 we care about
+#define CACHE_LINE_SIZE 64
+
 ///
 // Compiler specific stuff
 #if COMPILER_MVSC
@@ -105,6 +108,50 @@ typedef struct Cpu_Capabilities {
 	    return compare_and_swap_8((uint8_t*)a, (uint8_t)b, (uint8_t)old);
 	}
 	
+	// Interlocked ops are full barriers on x86, so every order gets the same intrinsic.
+	// Plain loads & stores are already acquire & release on x86; the compiler just must not
+	// move other memory accesses across them.
+	#define ATOMIC_DEFINE_FUNCTIONS(bits, T, Msvc_Type, suffix) \
+		inline T atomic_load_relaxed_##bits(volatile T *a) { return *a; } \
+		inline T atomic_load_acquire_##bits(volatile T *a) { T x = *a; _ReadWriteBarrier(); return x; } \
+		inline void atomic_store_relaxed_##bits(volatile T *a, T x) { *a = x; } \
+		inline void atomic_store_release_##bits(volatile T *a, T x) { _ReadWriteBarrier(); *a = x; } \
+		inline T atomic_fetch_add_relaxed_##bits(volatile T *a, T x) { return (T)_InterlockedExchangeAdd##suffix((volatile Msvc_Type*)a, (Msvc_Type)x); } \
+		inline T atomic_fetch_add_acquire_##bits(volatile T *a, T x) { return (T)_InterlockedExchangeAdd##suffix((volatile Msvc_Type*)a, (Msvc_Type)x); } \
+		inline T atomic_fetch_add_release_##bits(volatile T *a, T x) { return (T)_InterlockedExchangeAdd##suffix((volatile Msvc_Type*)a, (Msvc_Type)x); } \
+		inline T atomic_fetch_add_##bits(volatile T *a, T x) { return (T)_InterlockedExchangeAdd##suffix((volatile Msvc_Type*)a, (Msvc_Type)x); } \
+		inline T atomic_exchange_relaxed_##bits(volatile T *a, T x) { return (T)_InterlockedExchange##suffix((volatile Msvc_Type*)a, (Msvc_Type)x); } \
+		inline T atomic_exchange_acquire_##bits(volatile T *a, T x) { return (T)_InterlockedExchange##suffix((volatile Msvc_Type*)a, (Msvc_Type)x); } \
+		inline T atomic_exchange_release_##bits(volatile T *a, T x) { return (T)_InterlockedExchange##suffix((volatile Msvc_Type*)a, (Msvc_Type)x); } \
+		inline T atomic_exchange_##bits(volatile T *a, T x) { return (T)_InterlockedExchange##suffix((volatile Msvc_Type*)a, (Msvc_Type)x); }
+	
+	ATOMIC_DEFINE_FUNCTIONS(8,  uint8_t,  char,      8)
+	ATOMIC_DEFINE_FUNCTIONS(16, uint16_t, short,     16)
+	ATOMIC_DEFINE_FUNCTIONS(32, uint32_t, long,      )
+	ATOMIC_DEFINE_FUNCTIONS(64, uint64_t, long long, 64)
+	
+	#define atomic_fence_acquire()    _ReadWriteBarrier()
+	#define atomic_fence_release()    _ReadWriteBarrier()
+	#define atomic_fence_sequential() { _ReadWriteBarrier(); _mm_mfence(); _ReadWriteBarrier(); }
+	
+	#pragma intrinsic(_BitScanForward64)
+	#pragma intrinsic(_BitScanReverse64)
+	
+	// x must not be 0
+	inline u32 
+	bit_scan_forward_64(u64 x) {
+		unsigned long index;
+		_BitScanForward64(&index, x);
+		return (u32)index;
+	}
+	// x must not be 0
+	inline u32 
+	bit_scan_reverse_64(u64 x) {
+		unsigned long index;
+		_BitScanReverse64(&index, x);
+		return (u32)index;
+	}
+	
 	#define MEMORY_BARRIER _ReadWriteBarrier()
 	
 	#define thread_local __declspec(thread)
@@ -225,6 +272,40 @@ typedef struct Cpu_Capabilities {
 	    return compare_and_swap_8((uint8_t*)a, (uint8_t)b, (uint8_t)old);
 	}
 	
+	#define ATOMIC_DEFINE_FUNCTIONS(bits, T) \
+		inline T atomic_load_relaxed_##bits(volatile T *a) { return __atomic_load_n(a, __ATOMIC_RELAXED); } \
+		inline T atomic_load_acquire_##bits(volatile T *a) { return __atomic_load_n(a, __ATOMIC_ACQUIRE); } \
+		inline void atomic_store_relaxed_##bits(volatile T *a, T x) { __atomic_store_n(a, x, __ATOMIC_RELAXED); } \
+		inline void atomic_store_release_##bits(volatile T *a, T x) { __atomic_store_n(a, x, __ATOMIC_RELEASE); } \
+		inline T atomic_fetch_add_relaxed_##bits(volatile T *a, T x) { return __atomic_fetch_add(a, x, __ATOMIC_RELAXED); } \
+		inline T atomic_fetch_add_acquire_##bits(volatile T *a, T x) { return __atomic_fetch_add(a, x, __ATOMIC_ACQUIRE); } \
+		inline T atomic_fetch_add_release_##bits(volatile T *a, T x) { return __atomic_fetch_add(a, x, __ATOMIC_RELEASE); } \
+		inline T atomic_fetch_add_##bits(volatile T *a, T x) { return __atomic_fetch_add(a, x, __ATOMIC_ACQ_REL); } \
+		inline T atomic_exchange_relaxed_##bits(volatile T *a, T x) { return __atomic_exchange_n(a, x, __ATOMIC_RELAXED); } \
+		inline T atomic_exchange_acquire_##bits(volatile T *a, T x) { return __atomic_exchange_n(a, x, __ATOMIC_ACQUIRE); } \
+		inline T atomic_exchange_release_##bits(volatile T *a, T x) { return __atomic_exchange_n(a, x, __ATOMIC_RELEASE); } \
+		inline T atomic_exchange_##bits(volatile T *a, T x) { return __atomic_exchange_n(a, x, __ATOMIC_ACQ_REL); }
+	
+	ATOMIC_DEFINE_FUNCTIONS(8,  uint8_t)
+	ATOMIC_DEFINE_FUNCTIONS(16, uint16_t)
+	ATOMIC_DEFINE_FUNCTIONS(32, uint32_t)
+	ATOMIC_DEFINE_FUNCTIONS(64, uint64_t)
+	
+	#define atomic_fence_acquire()    __atomic_thread_fence(__ATOMIC_ACQUIRE)
+	#define atomic_fence_release()    __atomic_thread_fence(__ATOMIC_RELEASE)
+	#define atomic_fence_sequential() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+	
+	// x must not be 0
+	inline u32 
+	bit_scan_forward_64(u64 x) {
+		return (u32)__builtin_ctzll(x);
+	}
+	// x must not be 0
+	inline u32 
+	bit_scan_reverse_64(u64 x) {
+		return 63 - (u32)__builtin_clzll(x);
+	}
+	
 	#define MEMORY_BARRIER {__asm__ __volatile__("" ::: "memory");__sync_synchronize();}
 	
 	#define thread_local __thread
@@ -251,11 +332,53 @@ typedef struct Cpu_Capabilities {
     
     #define DEPRECATED(proc, msg) 
     
+    inline u32 
+    bit_scan_forward_64(u64 x) {
+    	u32 i = 0;
+    	while (!(x & 1)) { x >>= 1; i += 1; }
+    	return i;
+    }
+    inline u32 
+    bit_scan_reverse_64(u64 x) {
+    	u32 i = 0;
+    	while (x >>= 1) i += 1;
+    	return i;
+    }
+    
     #define MEMORY_BARRIER
     
     #warning "Compiler is not explicitly supported, some things will probably not work as expected"
 #endif
 
+///
+// Atomics
+// Defined above for each compiler, for uint8_t, uint16_t, uint32_t & uint64_t (_8/_16/_32/_64):
+//
+//   atomic_load_relaxed_N      atomic_load_acquire_N
+//   atomic_store_relaxed_N     atomic_store_release_N
+//   atomic_fetch_add_N         atomic_fetch_add_relaxed_N   _acquire_N   _release_N
+//   atomic_exchange_N          atomic_exchange_relaxed_N    _acquire_N   _release_N
+//
+// fetch_add & exchange return the old value. Without an order in the name they are both
+// acquire & release. compare_and_swap_N is a full barrier.
+//
+// relaxed: only this one access is atomic, no ordering with other memory. Counters & stats.
+// release: memory writes before it are visible to whoever acquire-loads the value it stored.
+//          Publishing data, unlocking.
+// acquire: memory reads after it see what was written before the release it reads from.
+//          Consuming published data, locking.
+//
+// None of these stop a store from moving after a later load. That takes
+// atomic_fence_sequential() or a compare_and_swap.
+// Prefer these over MEMORY_BARRIER, which is a full hardware fence on gcc/clang but only a
+// compiler barrier on msvc.
+
+inline bool atomic_load_relaxed_bool(volatile bool *a) { return (bool)atomic_load_relaxed_8((volatile uint8_t*)a); }
+inline bool atomic_load_acquire_bool(volatile bool *a) { return (bool)atomic_load_acquire_8((volatile uint8_t*)a); }
+inline void atomic_store_relaxed_bool(volatile bool *a, bool x) { atomic_store_relaxed_8((volatile uint8_t*)a, (uint8_t)x); }
+inline void atomic_store_release_bool(volatile bool *a, bool x) { atomic_store_release_8((volatile uint8_t*)a, (uint8_t)x); }
+inline bool atomic_exchange_bool(volatile bool *a, bool x) { return (bool)atomic_exchange_8((volatile uint8_t*)a, (uint8_t)x); }
+
 
 
 Cpu_Capabilities 
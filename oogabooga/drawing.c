@@ -113,6 +113,8 @@
 				might change.
 			- draw_frame_init_reserve does the same as draw_frame_init, but you can pre-allocate for a certain
 				amount of quads.
+			- The quads are allocated with the context allocator (see push_allocator()), so a frame that
+				is only used for a while can live in an arena.
 			- draw_frame_reset will, in short, clear the array of computed Draw_Quad's and zero everything
 				out.	
 				
@@ -199,6 +201,8 @@ typedef struct Draw_Frame {
 	Vector4 scissor_stack[SCISSOR_STACK_MAX];
 	
 	Draw_Quad *quad_buffer;
+	// In case quad_buffer is in the context allocator and it needs to be tagged
+	Tagged_Allocator quad_buffer_allocator;
 	
 	u64 z_count;
 	s32 z_stack[Z_STACK_MAX];
@@ -209,12 +213,12 @@ typedef struct Draw_Frame {
 void draw_frame_init(Draw_Frame *frame) {
 	*frame = ZERO(Draw_Frame);
 	
-	growing_array_init((void**)&frame->quad_buffer, sizeof(Draw_Quad), get_heap_allocator());
+	growing_array_init((void**)&frame->quad_buffer, sizeof(Draw_Quad), get_tagged_context_allocator(MEMORY_TAG_DRAW_FRAME, &frame->quad_buffer_allocator));
 }
 void draw_frame_init_reserve(Draw_Frame *frame, u64 number_of_quads_to_reserve) {
 	*frame = ZERO(Draw_Frame);
 	
-	growing_array_init_reserve((void**)&frame->quad_buffer, sizeof(Draw_Quad), number_of_quads_to_reserve, get_heap_allocator());
+	growing_array_init_reserve((void**)&frame->quad_buffer, sizeof(Draw_Quad), number_of_quads_to_reserve, get_tagged_context_allocator(MEMORY_TAG_DRAW_FRAME, &frame->quad_buffer_allocator));
 }
 
 void draw_frame_reset(Draw_Frame *frame) {
@@ -227,10 +231,14 @@ void draw_frame_reset(Draw_Frame *frame) {
 
 	Draw_Quad *quad_buffer = frame->quad_buffer;
 	if (quad_buffer) growing_array_clear((void**)&quad_buffer);
+	
+	// The quad buffer might be growing with this
+	Tagged_Allocator quad_buffer_allocator = frame->quad_buffer_allocator;
 
 	*frame = (Draw_Frame){0};
 	
 	frame->quad_buffer = quad_buffer;
+	frame->quad_buffer_allocator = quad_buffer_allocator;
 	
 	frame->projection 
 		= m4_make_orthographic_projection(-window.width/2, window.width/2, -window.height/2, window.height/2, -1, 10);
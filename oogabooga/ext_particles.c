@@ -325,7 +325,7 @@ void emission_release(Emission_Handle h) {
 }
 
 void particles_init() {
-	growing_array_init_reserve((void**)&emissions, sizeof(Emission_Instance), 16, get_heap_allocator());
+	growing_array_init_reserve((void**)&emissions, sizeof(Emission_Instance), 16, get_tagged_heap_allocator(MEMORY_TAG_PARTICLES));
 }
 
 void particles_update() {
@@ -112,11 +112,17 @@ typedef struct Gfx_Font {
 	stbtt_fontinfo stbtt_handle;
 	string raw_font_data;
 	Gfx_Font_Variation variations[MAX_FONT_HEIGHT]; // Variation per font height
-	Allocator allocator;
+	Allocator allocator; // Tags everything with MEMORY_TAG_FONT
+	Tagged_Allocator tagged_allocator;
 } Gfx_Font;
 
 Gfx_Font *load_font_from_disk(string path, Allocator allocator) {
 	
+	// Tagged allocators only need the parent to dealloc, so we can use this one until the font
+	// is allocated and then move it in there.
+	Tagged_Allocator tagged_allocator;
+	allocator = make_tagged_allocator_in_place(&tagged_allocator, allocator, MEMORY_TAG_FONT);
+	
 	string font_data;
 	bool read_ok = os_read_entire_file(path, &font_data, allocator);
 	
@@ -127,13 +133,18 @@ Gfx_Font *load_font_from_disk(string path, Allocator allocator) {
 	stbtt_fontinfo stbtt_handle;
 	int result = stbtt_InitFont(&stbtt_handle, font_data.data, stbtt_GetFontOffsetForIndex(font_data.data, 0));
 	
-	if (result == 0) return 0;
+	if (result == 0) {
+		third_party_allocator = ZERO(Allocator); // It's pointing at our stack
+		return 0;
+	}
 	
 	Gfx_Font *font = alloc(allocator, sizeof(Gfx_Font));
 	memset(font, 0, sizeof(Gfx_Font));
 	font->stbtt_handle = stbtt_handle;
 	font->raw_font_data = font_data;
+	font->tagged_allocator = tagged_allocator;
 	font->allocator = allocator;
+	font->allocator.data = &font->tagged_allocator;
 	
 	third_party_allocator = ZERO(Allocator);
 	
@@ -163,6 +174,35 @@ void destroy_font(Gfx_Font *font) {
 	third_party_allocator = ZERO(Allocator);
 }
 
+// #Global
+// Atom of the path -> Gfx_Font*
+ogb_instance Concurrent_Hash_Table cached_fonts;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Concurrent_Hash_Table cached_fonts;
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+// Called in oogabooga_init()
+void cached_fonts_init() {
+	cached_fonts = make_concurrent_hash_table(Atom, Gfx_Font*, get_tagged_heap_allocator(MEMORY_TAG_FONT));
+}
+
+// Loads the font the first time a path is asked for and returns the same one after that.
+// The cache owns the font, so don't destroy_font() it. Safe to call from any thread.
+Gfx_Font *get_cached_font_from_disk(string path) {
+	Atom path_atom = intern_string(path);
+	Gfx_Font *font = 0;
+	if (concurrent_hash_table_find(&cached_fonts, path_atom, font)) return font;
+	
+	Gfx_Font *loaded = load_font_from_disk(path, get_heap_allocator());
+	if (!loaded) return 0;
+	
+	// If another thread loaded it at the same time, everyone gets theirs
+	font = loaded;
+	if (!concurrent_hash_table_get_or_insert(&cached_fonts, path_atom, font)) destroy_font(loaded);
+	return font;
+}
+
 void font_variation_init(Gfx_Font_Variation *variation, Gfx_Font *font, u32 font_height) {
 
 	variation->font = font;
@@ -645,15 +645,16 @@ void gfx_render_draw_frame(Draw_Frame *frame, Gfx_Image *render_target) {
 	if (required_size > d3d11_quad_vbo_size) {
 		if (d3d11_quad_vbo) {
 			D3D11Release(d3d11_quad_vbo);
-			dealloc(get_heap_allocator(), d3d11_staging_quad_buffer);
+			if (d3d11_quad_ibo) D3D11Release(d3d11_quad_ibo);
+			dealloc(get_tagged_heap_allocator(MEMORY_TAG_DRAW_FRAME), d3d11_staging_quad_buffer);
 		}
 		u64 new_size = get_next_power_of_two(required_size);
 		u64 new_indices = ((new_size/sizeof(D3D11_Vertex))/4)*6;
 		
 		d3d11_quad_vbo_size = new_size;
 		
-		d3d11_staging_quad_buffer = alloc(get_heap_allocator(), d3d11_quad_vbo_size);
-		u32 *indices = (u32*)alloc(get_heap_allocator(), new_indices*sizeof(u32));
+		d3d11_staging_quad_buffer = alloc(get_tagged_heap_allocator(MEMORY_TAG_DRAW_FRAME), d3d11_quad_vbo_size);
+		u32 *indices = (u32*)alloc(get_tagged_heap_allocator(MEMORY_TAG_DRAW_FRAME), new_indices*sizeof(u32));
 		
 		for (u64 i = 0; i < new_indices; i += 6) {
 			indices[i + 0] = (i/6)*4 + 0;
@@ -683,6 +684,8 @@ void gfx_render_draw_frame(Draw_Frame *frame, Gfx_Image *render_target) {
 		
 		ID3D11Device_CreateBuffer(d3d11_device, &index_buffer_desc, &index_data, &d3d11_quad_ibo);
 		
+		// The index buffer has its own copy now
+		dealloc(get_tagged_heap_allocator(MEMORY_TAG_DRAW_FRAME), indices);
 		
 		log_verbose("Grew quad vbo to %d bytes.", d3d11_quad_vbo_size);
 	}
@@ -713,8 +716,8 @@ void gfx_render_draw_frame(Draw_Frame *frame, Gfx_Image *render_target) {
 			if (frame->enable_z_sorting) tm_scope("Z sorting") {
 				if (!d3d11_sort_quad_buffer || (d3d11_sort_quad_buffer_size < number_of_quads*sizeof(Draw_Quad))) {
 					// #Memory #Heapalloc
-					if (d3d11_sort_quad_buffer) dealloc(get_heap_allocator(), d3d11_sort_quad_buffer);
-					d3d11_sort_quad_buffer = alloc(get_heap_allocator(), number_of_quads*sizeof(Draw_Quad));
+					if (d3d11_sort_quad_buffer) dealloc(get_tagged_heap_allocator(MEMORY_TAG_DRAW_FRAME), d3d11_sort_quad_buffer);
+					d3d11_sort_quad_buffer = alloc(get_tagged_heap_allocator(MEMORY_TAG_DRAW_FRAME), number_of_quads*sizeof(Draw_Quad));
 					d3d11_sort_quad_buffer_size = number_of_quads*sizeof(Draw_Quad);
 				}
 				radix_sort(frame->quad_buffer, d3d11_sort_quad_buffer, number_of_quads, sizeof(Draw_Quad), offsetof(Draw_Quad, z), MAX_Z_BITS);
@@ -915,15 +918,16 @@ void gfx_reserve_vbo_bytes(u64 number_of_bytes) {
 	if (number_of_bytes > d3d11_quad_vbo_size) {
 		if (d3d11_quad_vbo) {
 			D3D11Release(d3d11_quad_vbo);
-			dealloc(get_heap_allocator(), d3d11_staging_quad_buffer);
+			if (d3d11_quad_ibo) D3D11Release(d3d11_quad_ibo);
+			dealloc(get_tagged_heap_allocator(MEMORY_TAG_DRAW_FRAME), d3d11_staging_quad_buffer);
 		}
 		u64 new_size = get_next_power_of_two(number_of_bytes);
 		u64 new_indices = ((new_size/sizeof(D3D11_Vertex))/4)*6;
 		
 		d3d11_quad_vbo_size = new_size;
 		
-		d3d11_staging_quad_buffer = alloc(get_heap_allocator(), d3d11_quad_vbo_size);
-		u32 *indices = (u32*)alloc(get_heap_allocator(), new_indices*sizeof(u32));
+		d3d11_staging_quad_buffer = alloc(get_tagged_heap_allocator(MEMORY_TAG_DRAW_FRAME), d3d11_quad_vbo_size);
+		u32 *indices = (u32*)alloc(get_tagged_heap_allocator(MEMORY_TAG_DRAW_FRAME), new_indices*sizeof(u32));
 		
 		for (u64 i = 0; i < new_indices; i += 6) {
 			indices[i + 0] = (i/6)*4 + 0;
@@ -953,6 +957,8 @@ void gfx_reserve_vbo_bytes(u64 number_of_bytes) {
 		
 		ID3D11Device_CreateBuffer(d3d11_device, &index_buffer_desc, &index_data, &d3d11_quad_ibo);
 		
+		// The index buffer has its own copy now
+		dealloc(get_tagged_heap_allocator(MEMORY_TAG_DRAW_FRAME), indices);
 		
 		log_verbose("Grew quad vbo to %d bytes.", d3d11_quad_vbo_size);
 	}
@@ -133,3 +133,34 @@ delete_image(Gfx_Image *image) {
     gfx_deinit_image(image);
     dealloc(image->allocator, image);
 }
+
+// #Global
+// Atom of the path -> Gfx_Image*
+ogb_instance Concurrent_Hash_Table cached_images;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Concurrent_Hash_Table cached_images;
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+// Called in oogabooga_init()
+void
+cached_images_init() {
+    cached_images = make_concurrent_hash_table(Atom, Gfx_Image*, get_tagged_heap_allocator(MEMORY_TAG_IMAGES));
+}
+
+// Loads the image the first time a path is asked for and returns the same one after that.
+// The cache owns the image, so don't delete_image() it. Safe to call from any thread.
+Gfx_Image *
+get_cached_image_from_disk(string path) {
+    Atom path_atom = intern_string(path);
+    Gfx_Image *image = 0;
+    if (concurrent_hash_table_find(&cached_images, path_atom, image)) return image;
+    
+    Gfx_Image *loaded = load_image_from_disk(path, get_tagged_heap_allocator(MEMORY_TAG_IMAGES));
+    if (!loaded) return 0;
+    
+    // If another thread loaded it at the same time, everyone gets theirs
+    image = loaded;
+    if (!concurrent_hash_table_get_or_insert(&cached_images, path_atom, image)) delete_image(loaded);
+    return image;
+}
@@ -26,8 +26,12 @@ static inline u64 city_hash(string s) {
     u64 d = b;
 
     if (s.count <= 16) {
-        memcpy(&a, s.data, sizeof(u64));
-        memcpy(&b, s.data + s.count - 8, sizeof(u64));
+        // Don't read past the string for short ones, equal strings must hash the same
+        u64 n = min(s.count, sizeof(u64));
+        a = 0;
+        b = 0;
+        memcpy(&a, s.data, n);
+        memcpy(&b, s.data + s.count - n, n);
     } else {
         memcpy(&a, s.data, sizeof(u64));
         memcpy(&b, s.data + 8, sizeof(u64));
@@ -54,9 +58,280 @@ u64 djb2_hash(string s) {
     return hash;
 }
 
+///
+// Bulk hashing
+// wyhash for up to HASH_SHORT_MAX bytes. Longer inputs go through an xxh3 style
+// accumulator: 8 64-bit lanes eating a 64 byte stripe per step, 4 lanes per instruction
+// with AVX2 and 2 with SSE2. All paths give the same result, and so does the streaming
+// Hasher for the same bytes no matter how they are split up.
+// Not for anything security related, and may change between versions, so don't store it.
+
+#define HASH_SHORT_MAX 128
+#define HASH_STRIPE_SIZE 64
+#define HASH_STRIPES_PER_BLOCK 16
+
+// Random odd numbers. Stripe n in a block is keyed with hash_secret[n..n+7], so that
+// swapping stripes around changes the hash.
+static const u64 hash_secret[32] = {
+	0x6ddd8625a432ef85ULL, 0x53c57028cea8103bULL, 0xfa8da8bd7a353b53ULL, 0xc65fd17ae28bdfb9ULL,
+	0x2661b1319c7bc161ULL, 0x9e1afdcee4216793ULL, 0xf217c2b9bf489bebULL, 0x96caacc1cec90ef1ULL,
+	0x5b7bfae5bdfea081ULL, 0xf4e593909d55e623ULL, 0x5861e26f6e047ca3ULL, 0xda33aeb844c53f77ULL,
+	0xcd2425ded1c70383ULL, 0xe65417b043cedac1ULL, 0x40e2047f4b80fb71ULL, 0x907329ea0143510bULL,
+	0x65748c817eea7d31ULL, 0xd847cf4727b267e7ULL, 0x2d2ee4fc0402b717ULL, 0x1d63af7048b91975ULL,
+	0x47e3a62a2394024dULL, 0x25d0cf77147f48b7ULL, 0xfb3ea46825e86743ULL, 0xc1e0269b7d5a034fULL,
+	0x56b833ab964aade1ULL, 0xf5e328e86446603fULL, 0x36b9f1c83cdd4ed1ULL, 0x00be13f8f7346329ULL,
+	0xe09c39a4bef20fc1ULL, 0xcee87bbd30158795ULL, 0xd80de829e6be8693ULL, 0xdb91f67a3593b179ULL,
+};
+
+static inline u64 hash_read64(const u8 *p) {
+	u64 x;
+	memcpy(&x, p, sizeof(u64));
+	return x;
+}
+static inline u64 hash_read32(const u8 *p) {
+	u32 x;
+	memcpy(&x, p, sizeof(u32));
+	return x;
+}
+
+// Full 64x64 -> 128 bit multiply, low half in a and high half in b
+static inline void hash_mum(u64 *a, u64 *b) {
+#if COMPILER_MSVC
+	*a = _umul128(*a, *b, b);
+#else
+	__uint128_t r = (__uint128_t)*a * *b;
+	*a = (u64)r;
+	*b = (u64)(r >> 64);
+#endif
+}
+static inline u64 hash_mix(u64 a, u64 b) {
+	hash_mum(&a, &b);
+	return a ^ b;
+}
+
+u64 hash_bytes_short(const u8 *p, u64 size, u64 seed) {
+	assert(size <= HASH_SHORT_MAX);
+	
+	seed ^= hash_mix(seed ^ hash_secret[0], hash_secret[1]);
+	
+	u64 a, b;
+	if (size <= 16) {
+		if (size >= 4) {
+			// Two overlapping 4 byte reads from each end covers all of it
+			u64 middle = (size >> 3) << 2;
+			a = (hash_read32(p) << 32) | hash_read32(p + middle);
+			b = (hash_read32(p + size - 4) << 32) | hash_read32(p + size - 4 - middle);
+		} else if (size > 0) {
+			a = ((u64)p[0] << 16) | ((u64)p[size >> 1] << 8) | p[size - 1];
+			b = 0;
+		} else {
+			a = 0;
+			b = 0;
+		}
+	} else {
+		const u8 *q = p;
+		u64 left = size;
+		while (left > 16) {
+			seed = hash_mix(hash_read64(q) ^ hash_secret[1], hash_read64(q + 8) ^ seed);
+			q += 16;
+			left -= 16;
+		}
+		a = hash_read64(p + size - 16);
+		b = hash_read64(p + size - 8);
+	}
+	
+	a ^= hash_secret[1];
+	b ^= seed;
+	hash_mum(&a, &b);
+	return hash_mix(a ^ hash_secret[0] ^ size, b ^ hash_secret[1]);
+}
+
+static inline void hash_accumulate_init(u64 *acc, u64 seed) {
+	for (u64 i = 0; i < 8; i += 1) acc[i] = hash_secret[8+i] ^ seed;
+}
+
+// Each lane: acc[i] += lo32(d^k) * hi32(d^k), and the raw data goes into the neighbour lane
+// so none of it gets lost in the multiply. Stripe n is keyed with key[n..n+7].
+static inline void hash_accumulate_run(u64 *acc, const u8 *p, u64 stripe_count, const u64 *key) {
+#if ENABLE_SIMD && SIMD_ENABLE_AVX2
+	__m256i a0 = _mm256_loadu_si256((__m256i*)(acc + 0));
+	__m256i a1 = _mm256_loadu_si256((__m256i*)(acc + 4));
+	for (u64 n = 0; n < stripe_count; n += 1) {
+		const u8 *stripe = p + n*HASH_STRIPE_SIZE;
+		__m256i d0 = _mm256_loadu_si256((__m256i*)(stripe + 0));
+		__m256i d1 = _mm256_loadu_si256((__m256i*)(stripe + 32));
+		__m256i k0 = _mm256_xor_si256(d0, _mm256_loadu_si256((__m256i*)(key + n + 0)));
+		__m256i k1 = _mm256_xor_si256(d1, _mm256_loadu_si256((__m256i*)(key + n + 4)));
+		a0 = _mm256_add_epi64(a0, _mm256_mul_epu32(k0, _mm256_srli_epi64(k0, 32)));
+		a1 = _mm256_add_epi64(a1, _mm256_mul_epu32(k1, _mm256_srli_epi64(k1, 32)));
+		a0 = _mm256_add_epi64(a0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2)));
+		a1 = _mm256_add_epi64(a1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2)));
+	}
+	_mm256_storeu_si256((__m256i*)(acc + 0), a0);
+	_mm256_storeu_si256((__m256i*)(acc + 4), a1);
+#elif ENABLE_SIMD && SIMD_ENABLE_SSE2
+	__m128i a[4];
+	for (u64 i = 0; i < 4; i += 1) a[i] = _mm_loadu_si128((__m128i*)(acc + i*2));
+	for (u64 n = 0; n < stripe_count; n += 1) {
+		const u8 *stripe = p + n*HASH_STRIPE_SIZE;
+		for (u64 i = 0; i < 4; i += 1) {
+			__m128i d = _mm_loadu_si128((__m128i*)(stripe + i*16));
+			__m128i k = _mm_xor_si128(d, _mm_loadu_si128((__m128i*)(key + n + i*2)));
+			a[i] = _mm_add_epi64(a[i], _mm_mul_epu32(k, _mm_srli_epi64(k, 32)));
+			a[i] = _mm_add_epi64(a[i], _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+		}
+	}
+	for (u64 i = 0; i < 4; i += 1) _mm_storeu_si128((__m128i*)(acc + i*2), a[i]);
+#else
+	for (u64 n = 0; n < stripe_count; n += 1) {
+		const u8 *stripe = p + n*HASH_STRIPE_SIZE;
+		for (u64 i = 0; i < 8; i += 1) {
+			u64 d = hash_read64(stripe + i*8);
+			u64 k = d ^ key[n + i];
+			acc[i^1] += d;
+			acc[i] += (k & 0xFFFFFFFF) * (k >> 32);
+		}
+	}
+#endif
+}
+
+// Stirs the lanes between blocks, so the high bits make it down to where the next
+// multiplies can see them.
+static inline void hash_scramble(u64 *acc) {
+	for (u64 i = 0; i < 8; i += 1) {
+		u64 a = acc[i];
+		a ^= a >> 47;
+		a ^= hash_secret[16+i];
+		acc[i] = a * 0x9E3779B1ULL;
+	}
+}
+
+void hash_accumulate_stripes(u64 *acc, u64 *stripes_in_block, const u8 *p, u64 stripe_count) {
+	while (stripe_count > 0) {
+		u64 run = min(stripe_count, HASH_STRIPES_PER_BLOCK - *stripes_in_block);
+		hash_accumulate_run(acc, p, run, hash_secret + *stripes_in_block);
+		p += run*HASH_STRIPE_SIZE;
+		stripe_count -= run;
+		*stripes_in_block += run;
+		if (*stripes_in_block == HASH_STRIPES_PER_BLOCK) {
+			hash_scramble(acc);
+			*stripes_in_block = 0;
+		}
+	}
+}
+
+// tail is what's left after the last whole stripe, less than HASH_STRIPE_SIZE bytes
+u64 hash_accumulate_finish(u64 *acc, u64 stripes_in_block, const u8 *tail, u64 tail_size, u64 total_size) {
+	if (tail_size) {
+		u8 last[HASH_STRIPE_SIZE] = {0};
+		memcpy(last, tail, tail_size);
+		hash_accumulate_run(acc, last, 1, hash_secret + stripes_in_block);
+	}
+	
+	u64 h = total_size * PRIME64_1;
+	for (u64 i = 0; i < 8; i += 2) {
+		h += hash_mix(acc[i] ^ hash_secret[24+i], acc[i+1] ^ hash_secret[25+i]);
+	}
+	
+	h ^= h >> 37;
+	h *= 0x165667919E3779F9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+u64 hash_bytes(const void *data, u64 size, u64 seed) {
+	const u8 *p = (const u8*)data;
+	
+	if (size <= HASH_SHORT_MAX) return hash_bytes_short(p, size, seed);
+	
+	u64 acc[8];
+	u64 stripes_in_block = 0;
+	hash_accumulate_init(acc, seed);
+	
+	u64 stripe_count = size / HASH_STRIPE_SIZE;
+	hash_accumulate_stripes(acc, &stripes_in_block, p, stripe_count);
+	
+	u64 done = stripe_count*HASH_STRIPE_SIZE;
+	return hash_accumulate_finish(acc, stripes_in_block, p + done, size - done, size);
+}
+
+///
+// Streaming hasher, for hashing something piece by piece (struct members, a file in
+// chunks) without putting it in one buffer first. Gives the same result as hash_bytes
+// on all the bytes at once.
+/*
+	Hasher h;
+	hasher_begin(&h, 0);
+	hasher_update(&h, &thing->id, sizeof(thing->id));
+	hasher_update(&h, thing->name.data, thing->name.count);
+	u64 hash = hasher_finish(&h);
+*/
+typedef struct Hasher {
+	u64 acc[8];
+	u64 stripes_in_block;
+	u64 seed;
+	u64 total_size;
+	
+	// Until there's more than HASH_SHORT_MAX bytes we don't know if it's a long hash, so
+	// that much needs to be kept around.
+	u64 buffered;
+	u8 buffer[HASH_SHORT_MAX];
+} Hasher;
+
+void hasher_begin(Hasher *h, u64 seed) {
+	hash_accumulate_init(h->acc, seed);
+	h->stripes_in_block = 0;
+	h->seed = seed;
+	h->total_size = 0;
+	h->buffered = 0;
+}
+
+void hasher_update(Hasher *h, const void *data, u64 size) {
+	const u8 *p = (const u8*)data;
+	
+	h->total_size += size;
+	
+	while (size > 0) {
+		if (h->buffered == HASH_SHORT_MAX) {
+			// More is coming, so it's a long hash and the buffer can go in the accumulator
+			hash_accumulate_stripes(h->acc, &h->stripes_in_block, h->buffer, HASH_SHORT_MAX/HASH_STRIPE_SIZE);
+			h->buffered = 0;
+		}
+		
+		if (h->buffered == 0 && size > HASH_SHORT_MAX) {
+			// Skip the copy for big chunks
+			u64 stripe_count = size / HASH_STRIPE_SIZE;
+			hash_accumulate_stripes(h->acc, &h->stripes_in_block, p, stripe_count);
+			p    += stripe_count*HASH_STRIPE_SIZE;
+			size -= stripe_count*HASH_STRIPE_SIZE;
+			continue;
+		}
+		
+		u64 to_copy = min(size, HASH_SHORT_MAX - h->buffered);
+		memcpy(h->buffer + h->buffered, p, to_copy);
+		h->buffered += to_copy;
+		p    += to_copy;
+		size -= to_copy;
+	}
+}
+
+// The hasher can keep going after this
+u64 hasher_finish(Hasher *h) {
+	if (h->total_size <= HASH_SHORT_MAX) return hash_bytes_short(h->buffer, h->total_size, h->seed);
+	
+	u64 acc[8];
+	memcpy(acc, h->acc, sizeof(acc));
+	u64 stripes_in_block = h->stripes_in_block;
+	
+	u64 stripe_count = h->buffered / HASH_STRIPE_SIZE;
+	hash_accumulate_stripes(acc, &stripes_in_block, h->buffer, stripe_count);
+	
+	u64 done = stripe_count*HASH_STRIPE_SIZE;
+	return hash_accumulate_finish(acc, stripes_in_block, h->buffer + done, h->buffered - done, h->total_size);
+}
+
 u64 string_get_hash(string s) {
-    if (s.count > 32) return djb2_hash(s);
-    return city_hash(s);
+    return hash_bytes(s.data, s.count, 0);
 }
 u64 pointer_get_hash(void *p) {
 	return xx_hash((u64)p);
@@ -1,9 +1,14 @@
 
-// Very naive implementation but it should be very cache efficient so it's alright
-// for non-excessive use for now.
+// Entries are packed in a dense array and found through a separate robin hood index: an
+// open addressed array of small slots holding 32 bits of the hash and the entry index.
+// Slots are linearly probed and an insertion takes the place of a slot which is closer to
+// its home than the new one would be, so probe lengths stay short and even and a lookup
+// can stop as soon as it sees a slot closer to home than itself.
+// Removing shifts the following slots back one step instead of leaving tombstones, and
+// moves the last entry into the hole so the entries stay dense.
 
 /*
-
+	
 	Example Usage:
 	
 	
@@ -12,7 +17,8 @@
 	
 	// Set key "Key string" to integer value 69. This returns whether or not key was newly added.
 	string key = STR("Key string");
-	bool newly_added = hash_table_set(&table, key, 69);
+	int value = 69;
+	bool newly_added = hash_table_set(&table, key, value);
 	
 	// Find value associated with given key. Returns pointer to that value.
 	string other_key = STR("Some other key");
@@ -27,7 +33,16 @@
 	// Same as hash_table_find() != NULL
 	string another_key = STR("Another key");
 	if (hash_table_contains(&table, another_key)) {
-		
+	
+	}
+	
+	// Returns whether or not the key existed
+	hash_table_remove(&table, key);
+	
+	// Iterate all entries (in no particular order)
+	for (Hash_Table_Iterator it = hash_table_iterate(&table); hash_table_next(&it);) {
+		string *key = (string*)it.key;
+		int *value = (int*)it.value;
 	}
 	
 	// Reset all entries (but keep allocated memory)
@@ -38,12 +53,15 @@
 	
 	
 	Limitations:
-		- Key can only be a base type or pointer
+		- Key can only be a base type, pointer or string. Other keys are compared byte by byte.
+		- String keys are copied into the table's allocator, so they don't need to outlive the call.
+		- Value pointers (and keys) are invalidated by any add, set or remove.
 		- Key and value passed to the following function needs to be lvalues (we need to be able to take their addresses with '&'):
 			- hash_table_add
 			- hash_table_find
 			- hash_table_contains
 			- hash_table_set
+			- hash_table_remove
 			
 			Example:
 			
@@ -52,83 +70,217 @@
 			int key = my_key+5;
 			int value = my_value+3;
 			hash_table_set(&table, key, value); // OK
-			
+
 
 */
 
 typedef struct Hash_Table Hash_Table;
 
+#define hash_table_key_is_string(Key_Type) _Generic((Key_Type){0}, string: true, default: false)
+
 // API:
 #define make_hash_table_reserve(Key_Type, Value_Type, capacity_count, allocator) \
-	make_hash_table_reserve(sizeof(Key_Type), sizeof(Value_Type), capacity_count, allocator)
-	
+	make_hash_table_reserve_raw(sizeof(Key_Type), sizeof(Value_Type), hash_table_key_is_string(Key_Type), capacity_count, allocator)
+
 #define make_hash_table(Key_Type, Value_Type, allocator) \
-	make_hash_table_raw(sizeof(Key_Type), sizeof(Value_Type), allocator)
+	make_hash_table_raw(sizeof(Key_Type), sizeof(Value_Type), hash_table_key_is_string(Key_Type), allocator)
 
 #define hash_table_add(table_ptr, key, value) \
 	hash_table_add_raw((table_ptr), get_hash(key), &(key), &(value), sizeof(key), sizeof(value))
 
 #define hash_table_find(table_ptr, key) \
-	hash_table_find_raw((table_ptr), get_hash(key))
-	
+	hash_table_find_raw((table_ptr), get_hash(key), &(key), sizeof(key))
+
 #define hash_table_contains(table_ptr, key) \
-	hash_table_contains_raw((table_ptr), get_hash(key))
-	
+	hash_table_contains_raw((table_ptr), get_hash(key), &(key), sizeof(key))
+
 #define hash_table_set(table_ptr, key, value) \
 	hash_table_set_raw((table_ptr), get_hash(key), &key, &value, sizeof(key), sizeof(value))
 
+#define hash_table_remove(table_ptr, key) \
+	hash_table_remove_raw((table_ptr), get_hash(key), &(key), sizeof(key))
+
 void hash_table_reserve(Hash_Table *t, u64 required_count);
 
 
+typedef struct Hash_Table_Slot {
+	u32 hash;  // Bits of the mixed hash, also decides the home slot
+	u32 entry; // Index into entries + 1, 0 means empty
+} Hash_Table_Slot;
+
 typedef struct Hash_Table {
 	
 	// Each entry is hash-key-value
-	// Hash is sizeof(u64) bytes, key is _key_size bytes and value is _value_size bytes
-	void *entries; 
+	// Hash is sizeof(u64) bytes, key is _key_size bytes and value is _value_size bytes,
+	// value and entry are padded to 8 bytes.
+	void *entries;
 	
 	u64 count; // Number of valid entries
 	u64 capacity_count; // Number of allocated entries
 	
+	// Robin hood index into entries. Always twice capacity_count so the load stays <= 50%
+	Hash_Table_Slot *slots;
+	u64 slot_count;
+	
 	u64 _key_size;
 	u64 _value_size;
+	u64 _value_offset;
+	u64 _entry_size;
+	bool _key_is_string;
 	
 	Allocator allocator;
 } Hash_Table;
 
-Hash_Table make_hash_table_reserve_raw(u64 key_size, u64 value_size, u64 capacity_count, Allocator allocator) {
+typedef struct Hash_Table_Iterator {
+	Hash_Table *table;
+	u64 index;
+	
+	// Set by hash_table_next
+	void *key;
+	void *value;
+} Hash_Table_Iterator;
 
-	capacity_count = min(capacity_count, 8);
+// Spread the hash bits so weak hashes (djb2, small integers) still land all over the index
+inline u32 hash_table_slot_hash(u64 hash) {
+	return (u32)((hash * PRIME64_1) >> 32);
+}
+// Maps the 32 bit slot hash to [0, slot_count) without a modulo
+inline u64 hash_table_home_slot(Hash_Table *t, u32 slot_hash) {
+	return ((u64)slot_hash * t->slot_count) >> 32;
+}
+inline u64 hash_table_probe_distance(Hash_Table *t, u64 slot_index, u32 slot_hash) {
+	return (slot_index - hash_table_home_slot(t, slot_hash)) & (t->slot_count-1);
+}
 
+inline u8 *hash_table_get_entry(Hash_Table *t, u64 index) {
+	return (u8*)t->entries + index*t->_entry_size;
+}
+
+inline bool hash_table_keys_match(Hash_Table *t, void *a, void *b) {
+	if (t->_key_is_string) return strings_match(*(string*)a, *(string*)b);
+	return bytes_match(a, b, t->_key_size);
+}
+
+void hash_table_insert_slot(Hash_Table *t, Hash_Table_Slot slot) {
+	u64 mask = t->slot_count-1;
+	u64 i = hash_table_home_slot(t, slot.hash);
+	u64 distance = 0;
+	
+	while (true) {
+		Hash_Table_Slot *existing = &t->slots[i];
+		if (existing->entry == 0) {
+			*existing = slot;
+			return;
+		}
+		
+		// Take from the rich, give to the poor
+		u64 existing_distance = hash_table_probe_distance(t, i, existing->hash);
+		if (existing_distance < distance) {
+			Hash_Table_Slot tmp = *existing;
+			*existing = slot;
+			slot = tmp;
+			distance = existing_distance;
+		}
+		
+		i = (i+1) & mask;
+		distance += 1;
+	}
+}
+
+// Returns the index of the slot pointing to the entry with given hash & key, or -1.
+s64 hash_table_find_slot(Hash_Table *t, u64 hash, void *k) {
+	u32 slot_hash = hash_table_slot_hash(hash);
+	u64 mask = t->slot_count-1;
+	u64 i = hash_table_home_slot(t, slot_hash);
+	
+	for (u64 distance = 0; ; distance += 1) {
+		Hash_Table_Slot slot = t->slots[i];
+		
+		// An entry with our hash would have taken this slot
+		if (slot.entry == 0) return -1;
+		if (hash_table_probe_distance(t, i, slot.hash) < distance) return -1;
+		
+		if (slot.hash == slot_hash) {
+			u8 *entry = hash_table_get_entry(t, slot.entry-1);
+			if (*(u64*)entry == hash && hash_table_keys_match(t, entry+sizeof(u64), k)) {
+				return (s64)i;
+			}
+		}
+		
+		i = (i+1) & mask;
+	}
+	return -1;
+}
+
+void hash_table_rebuild_slots(Hash_Table *t, u64 slot_count) {
+	assert(slot_count <= (1ULL << 32), "Hash table too large");
+	
+	if (t->slots) dealloc(t->allocator, t->slots);
+	t->slots = (Hash_Table_Slot*)alloc_zeroed(t->allocator, slot_count*sizeof(Hash_Table_Slot));
+	t->slot_count = slot_count;
+	
+	for (u64 i = 0; i < t->count; i += 1) {
+		u64 hash = *(u64*)hash_table_get_entry(t, i);
+		Hash_Table_Slot slot = {hash_table_slot_hash(hash), (u32)(i+1)};
+		hash_table_insert_slot(t, slot);
+	}
+}
+
+Hash_Table make_hash_table_reserve_raw(u64 key_size, u64 value_size, bool key_is_string, u64 capacity_count, Allocator allocator) {
+	
+	capacity_count = get_next_power_of_two(max(capacity_count, 8));
+	
 	Hash_Table t = ZERO(Hash_Table);
 	
 	t._key_size = key_size;
 	t._value_size = value_size;
+	t._value_offset = align_next(sizeof(u64)+key_size, 8);
+	t._entry_size = align_next(t._value_offset+value_size, 8);
+	t._key_is_string = key_is_string;
 	t.allocator = allocator;
 	
-	u64 entry_size = value_size+sizeof(u64);
-	t.entries = alloc(t.allocator, entry_size*capacity_count);
-	memset(t.entries, 0, entry_size*capacity_count);
+	assert(!key_is_string || key_size == sizeof(string), "Bad key size for string keys");
+	
+	t.entries = alloc(t.allocator, t._entry_size*capacity_count);
+	memset(t.entries, 0, t._entry_size*capacity_count);
 	t.capacity_count = capacity_count;
 	
+	hash_table_rebuild_slots(&t, capacity_count*2);
+	
 	return t;
 }
-inline Hash_Table make_hash_table_raw(u64 key_size, u64 value_size, Allocator allocator) {
-	return make_hash_table_reserve_raw(key_size, value_size, 128, allocator);
+inline Hash_Table make_hash_table_raw(u64 key_size, u64 value_size, bool key_is_string, Allocator allocator) {
+	return make_hash_table_reserve_raw(key_size, value_size, key_is_string, 128, allocator);
+}
+
+void hash_table_free_string_keys(Hash_Table *t) {
+	if (!t->_key_is_string) return;
+	for (u64 i = 0; i < t->count; i += 1) {
+		string *key = (string*)(hash_table_get_entry(t, i)+sizeof(u64));
+		if (key->count) dealloc_string(t->allocator, *key);
+	}
 }
 
 void hash_table_reset(Hash_Table *t) {
+	hash_table_free_string_keys(t);
 	t->count = 0;
+	memset(t->slots, 0, t->slot_count*sizeof(Hash_Table_Slot));
 }
 void hash_table_destroy(Hash_Table *t) {
+	hash_table_free_string_keys(t);
+	
 	dealloc(t->allocator, t->entries);
+	dealloc(t->allocator, t->slots);
 	
 	t->entries = 0;
 	t->count = 0;
 	t->capacity_count = 0;
+	t->slots = 0;
+	t->slot_count = 0;
 }
 
 void hash_table_reserve(Hash_Table *t, u64 required_count) {
-	u64 entry_size = t->_value_size+sizeof(u64);
+	u64 entry_size = t->_entry_size;
 	
 	u64 required_size = required_count*entry_size;
 	
@@ -146,73 +298,133 @@ void hash_table_reserve(Hash_Table *t, u64 required_count) {
 	
 	t->entries = new_entries;
 	t->capacity_count = new_count;
+	
+	hash_table_rebuild_slots(t, new_count*2);
 }
 
-// This can add multiple entries of same hash, beware!
+// This can add multiple entries of same key, beware!
 void hash_table_add_raw(Hash_Table *t, u64 hash, void *k, void *v, u64 key_size, u64 value_size) {
-
+	
 	assert(t->_key_size == key_size, "Key type size does not match hash table initted key type size");
 	assert(t->_value_size == value_size, "Value type size does not match hash table initted value type size");
-
-	hash_table_reserve(t, t->count+1);
 	
-	u64 entry_size = t->_value_size+sizeof(u64);
+	hash_table_reserve(t, t->count+1);
 	
-	u64 index = entry_size*t->count;
+	u8 *entry = hash_table_get_entry(t, t->count);
 	t->count += 1;
 	
-	u64 hash_offset = 0;
-	u64 value_offset = hash_offset + sizeof(u64);
+	memcpy(entry, &hash, sizeof(u64));
+	if (t->_key_is_string) {
+		string key = *(string*)k;
+		if (key.count) key = string_copy(key, t->allocator);
+		memcpy(entry+sizeof(u64), &key, sizeof(string));
+	} else {
+		memcpy(entry+sizeof(u64), k, key_size);
+	}
+	memcpy(entry+t->_value_offset, v, value_size);
 	
-	memcpy((u8*)t->entries+index+hash_offset,  &hash, sizeof(u64));
-	memcpy((u8*)t->entries+index+value_offset, v,     value_size);
+	Hash_Table_Slot slot = {hash_table_slot_hash(hash), (u32)t->count};
+	hash_table_insert_slot(t, slot);
 }
 
-void *hash_table_find_raw(Hash_Table *t, u64 hash) {
-
-	// #Speed #Incomplete
-	// Do quadratic probe 'triangular numbers'
-
-	u64 entry_size = t->_value_size+sizeof(u64);
-	u64 hash_offset = 0;
-	u64 value_offset = hash_offset + sizeof(u64);
+void *hash_table_find_raw(Hash_Table *t, u64 hash, void *k, u64 key_size) {
+	assert(t->_key_size == key_size, "Key type size does not match hash table initted key type size");
 	
-	for (u64 i = 0; i < t->count; i += 1) {
-		u64 existing_hash = *(u64*)((u8*)t->entries+i*entry_size+hash_offset);
-		if (existing_hash == hash) {
-			void *value = ((u8*)t->entries+i*entry_size+value_offset);
-			return value;
-		}
-	}
-	return 0;
+	s64 i = hash_table_find_slot(t, hash, k);
+	if (i < 0) return 0;
+	
+	return hash_table_get_entry(t, t->slots[i].entry-1) + t->_value_offset;
 }
 
 void *hash_table_get_nth_value(Hash_Table *t, u64 n) {
 	assert(n < t->count, "Hash table n is out of range");
 	
-	u64 entry_size = t->_value_size+sizeof(u64);
-	u64 hash_offset = 0;
-	u64 value_offset = hash_offset + sizeof(u64);
+	return hash_table_get_entry(t, n) + t->_value_offset;
+}
+void *hash_table_get_nth_key(Hash_Table *t, u64 n) {
+	assert(n < t->count, "Hash table n is out of range");
 	
-	return (u8*)t->entries+entry_size*n+value_offset;
+	return hash_table_get_entry(t, n) + sizeof(u64);
 }
 
-bool hash_table_contains_raw(Hash_Table *t, u64 hash) {
-	return hash_table_find_raw(t, hash) != 0;
+bool hash_table_contains_raw(Hash_Table *t, u64 hash, void *k, u64 key_size) {
+	return hash_table_find_raw(t, hash, k, key_size) != 0;
 }
 
 // Returns true if key was newly added or false if it already existed
 bool hash_table_set_raw(Hash_Table *t, u64 hash, void *k, void *v, u64 key_size, u64 value_size) {
-	bool newly_added = true;
+	void *existing = hash_table_find_raw(t, hash, k, key_size);
 	
-	if (hash_table_contains_raw(t, hash)) newly_added = false;
+	if (existing) {
+		memcpy(existing, v, value_size);
+		return false;
+	}
 	
-	if (newly_added) {
-		hash_table_add_raw(t, hash, k, v, key_size, value_size);
-	} else {
-		memcpy(hash_table_find_raw(t, hash), v, value_size);
+	hash_table_add_raw(t, hash, k, v, key_size, value_size);
+	return true;
+}
+
+// Returns true if the key existed
+bool hash_table_remove_raw(Hash_Table *t, u64 hash, void *k, u64 key_size) {
+	assert(t->_key_size == key_size, "Key type size does not match hash table initted key type size");
+	
+	s64 found = hash_table_find_slot(t, hash, k);
+	if (found < 0) return false;
+	
+	u64 mask = t->slot_count-1;
+	u64 entry_index = t->slots[found].entry-1;
+	
+	// Backward shift: pull each following slot one step closer to home until we hit an
+	// empty slot or one which already is home.
+	u64 i = (u64)found;
+	while (true) {
+		u64 next = (i+1) & mask;
+		Hash_Table_Slot next_slot = t->slots[next];
+		if (next_slot.entry == 0 || hash_table_probe_distance(t, next, next_slot.hash) == 0) {
+			t->slots[i] = ZERO(Hash_Table_Slot);
+			break;
+		}
+		t->slots[i] = next_slot;
+		i = next;
+	}
+	
+	u8 *entry = hash_table_get_entry(t, entry_index);
+	if (t->_key_is_string) {
+		string *key = (string*)(entry+sizeof(u64));
+		if (key->count) dealloc_string(t->allocator, *key);
+	}
+	
+	// Move the last entry into the hole and repoint its slot
+	u64 last_index = t->count-1;
+	if (entry_index != last_index) {
+		u8 *last = hash_table_get_entry(t, last_index);
+		memcpy(entry, last, t->_entry_size);
+		
+		u64 last_hash = *(u64*)last;
+		u32 slot_hash = hash_table_slot_hash(last_hash);
+		u64 j = hash_table_home_slot(t, slot_hash);
+		while (t->slots[j].entry != last_index+1) j = (j+1) & mask;
+		t->slots[j].entry = (u32)(entry_index+1);
 	}
 	
-	return newly_added;
+	t->count -= 1;
+	
+	return true;
 }
 
+// Walks the entries in memory order. Adding or removing while iterating is not allowed.
+Hash_Table_Iterator hash_table_iterate(Hash_Table *t) {
+	Hash_Table_Iterator it = ZERO(Hash_Table_Iterator);
+	it.table = t;
+	return it;
+}
+bool hash_table_next(Hash_Table_Iterator *it) {
+	if (it->index >= it->table->count) return false;
+	
+	u8 *entry = hash_table_get_entry(it->table, it->index);
+	it->key = entry+sizeof(u64);
+	it->value = entry+it->table->_value_offset;
+	it->index += 1;
+	
+	return true;
+}
@@ -0,0 +1,622 @@
+
+///
+///
+// Job system
+///
+// One worker per logical processor, where the thread that called job_system_init() (the main
+// thread) is worker 0 and the rest get their own threads. Each worker has its own queue of
+// jobs. Workers take from their own queue first and steal from others' when it's empty, so
+// work spreads out without one shared, contended queue.
+//
+// Use this instead of starting your own threads, so everything shares the same workers
+// rather than fighting over the cores.
+/*
+
+	void decode_chunk(void *data) {
+		Decode_Chunk *chunk = (Decode_Chunk*)data;
+		...
+	}
+
+	Job_Counter counter = {0};
+	for (u64 i = 0; i < chunk_count; i += 1) {
+		job_run(decode_chunk, &chunks[i], &counter);
+	}
+	// Runs jobs itself while waiting
+	job_counter_wait(&counter);
+
+*/
+// Dependencies are counters: job_run() adds one to the counter & it's decremented when the
+// job is done, so a job that needs other jobs to finish first runs them with a counter and
+// job_counter_wait()'s it. Waiting threads run other jobs in the meantime, so waiting inside
+// a job is fine.
+//
+// Each worker has its own temporary storage, which is reset after each job that the worker
+// picked up itself. So talloc'd memory is valid until the job returns.
+// Jobs can be started from any thread. Jobs started from a thread that isn't a worker go
+// in a shared queue, which is a bit slower.
+// With only one worker (i.e. on a single logical processor) there are no threads to take jobs
+// off the queues, so jobs just run right away on the thread that started them.
+
+#ifndef JOB_QUEUE_CAPACITY
+	// Per worker. If a queue is full the job runs right away on the thread that started it.
+	#define JOB_QUEUE_CAPACITY 4096
+#endif
+#ifndef JOB_WORKER_TEMPORARY_STORAGE_SIZE
+	#define JOB_WORKER_TEMPORARY_STORAGE_SIZE MB(1)
+#endif
+// Times an idle worker looks for work before it sleeps
+#define JOB_WORKER_SPIN_COUNT 2000
+
+typedef void(*Job_Proc)(void *data);
+
+typedef struct Job_Counter {
+	volatile u64 value;
+} Job_Counter;
+
+typedef struct Job {
+	Job_Proc proc;
+	void *data;
+	Job_Counter *counter;
+} Job;
+
+// Chase-Lev deque. The owner pushes & pops at the bottom, other workers steal from the top.
+// top & bottom are on separate cache lines so stealing doesn't slow down the owner.
+typedef struct alignat(64) Job_Queue {
+	volatile s64 top;
+	u8 _pad0[CACHE_LINE_SIZE-sizeof(s64)];
+	volatile s64 bottom;
+	u8 _pad1[CACHE_LINE_SIZE-sizeof(s64)];
+	Job *jobs;
+} Job_Queue;
+
+typedef struct alignat(64) Job_Worker {
+	Job_Queue queue;
+	Thread thread;
+	u64 index;
+	volatile bool sleeping;
+	Binary_Semaphore wake;
+} Job_Worker;
+
+typedef struct Job_System {
+	Job_Worker *workers;
+	u64 worker_count;
+	volatile bool running;
+	volatile u64 sleeping_count;
+
+	// For jobs started on threads that aren't workers
+	Spinlock shared_lock;
+	Job *shared_jobs;
+	volatile u64 shared_first;
+	volatile u64 shared_count;
+} Job_System;
+
+// #Global
+ogb_instance Job_System job_system;
+
+// Starts worker_count-1 threads, 0 means one worker per logical processor.
+ogb_instance void
+job_system_init(u64 worker_count);
+
+ogb_instance void
+job_system_deinit();
+
+// counter may be 0 if you don't need to wait for it
+ogb_instance void
+job_run(Job_Proc proc, void *data, Job_Counter *counter);
+
+ogb_instance bool
+job_counter_is_done(Job_Counter *counter);
+
+// Runs jobs until the counter is 0
+ogb_instance void
+job_counter_wait(Job_Counter *counter);
+
+// 0 for the thread that called job_system_init(), -1 on threads that aren't workers.
+// For per-worker data, together with job_system_get_worker_count().
+ogb_instance s64
+job_get_worker_index();
+
+ogb_instance u64
+job_system_get_worker_count();
+
+///
+// Parallel loops
+// Splits [0, count) into ranges and runs proc on them on all workers, including the calling
+// thread, and returns when all of it is done. Ranges start at min_batch items, then get
+// sized by what's left & by how long items have been taking, so that cheap items come in big
+// ranges (less overhead) and the last bits are split finely (less waiting on one thread).
+/*
+
+	void update_particles(u64 first, u64 end, void *userdata) {
+		Particle *particles = (Particle*)userdata;
+		for (u64 i = first; i < end; i += 1) { ... }
+	}
+	parallel_for(particle_count, 256, update_particles, particles);
+
+*/
+// parallel_reduce() gives every participating thread its own copy of *result to accumulate
+// into, and combines them into *result at the end. So *result needs to start out as the
+// identity value (like 0 for a sum).
+/*
+
+	void sum_range(u64 first, u64 end, void *partial, void *userdata) {
+		f64 *sum = (f64*)partial;
+		for (u64 i = first; i < end; i += 1) *sum += ((f32*)userdata)[i];
+	}
+	void add_sums(void *result, void *partial, void *userdata) {
+		*(f64*)result += *(f64*)partial;
+	}
+	f64 sum = 0;
+	parallel_reduce(count, 1024, sum_range, add_sums, samples, &sum, sizeof(sum));
+
+*/
+
+typedef void(*Parallel_For_Proc)(u64 first, u64 end, void *userdata);
+typedef void(*Parallel_Reduce_Proc)(u64 first, u64 end, void *partial, void *userdata);
+typedef void(*Parallel_Combine_Proc)(void *result, void *partial, void *userdata);
+
+// About how long a range should take, so the cost of taking it is small in comparison
+#define PARALLEL_FOR_TARGET_CYCLES 40000
+
+ogb_instance void
+parallel_for(u64 count, u64 min_batch, Parallel_For_Proc proc, void *userdata);
+
+ogb_instance void
+parallel_reduce(u64 count, u64 min_batch, Parallel_Reduce_Proc proc, Parallel_Combine_Proc combine, void *userdata, void *result, u64 result_size);
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Job_System job_system = {0};
+
+thread_local s64 job_worker_index = -1;
+// Own random state, so stealing doesn't change what get_random() gives the game
+thread_local u64 job_steal_seed = 0;
+
+void
+job_queue_init(Job_Queue *q) {
+	q->top = 0;
+	q->bottom = 0;
+	q->jobs = (Job*)alloc(get_heap_allocator(), sizeof(Job)*JOB_QUEUE_CAPACITY);
+}
+
+// Owner only. Returns false if the queue is full.
+bool
+job_queue_push(Job_Queue *q, Job job) {
+	s64 b = q->bottom;
+	s64 t = q->top;
+	if (b - t >= JOB_QUEUE_CAPACITY) return false;
+
+	q->jobs[b & (JOB_QUEUE_CAPACITY-1)] = job;
+	// The job must be written before thieves can see the new bottom
+	atomic_store_release_64((volatile u64*)&q->bottom, (u64)(b + 1));
+	return true;
+}
+
+// Owner only
+bool
+job_queue_pop(Job_Queue *q, Job *job) {
+	s64 b = q->bottom - 1;
+	q->bottom = b;
+	// Thieves must see the new bottom before we look at top
+	atomic_fence_sequential();
+	s64 t = q->top;
+
+	if (t > b) {
+		// Empty
+		q->bottom = b + 1;
+		return false;
+	}
+
+	*job = q->jobs[b & (JOB_QUEUE_CAPACITY-1)];
+	if (t != b) return true;
+
+	// Last job, a thief might be going for it too
+	bool won = compare_and_swap_64((volatile u64*)&q->top, t + 1, t);
+	q->bottom = b + 1;
+	return won;
+}
+
+// Any thread
+bool
+job_queue_steal(Job_Queue *q, Job *job) {
+	s64 t = (s64)atomic_load_acquire_64((volatile u64*)&q->top);
+	atomic_fence_sequential();
+	s64 b = (s64)atomic_load_acquire_64((volatile u64*)&q->bottom);
+
+	if (t >= b) return false;
+
+	// If the owner or another thief took it in the meantime, the copy might be torn but the
+	// swap fails and we throw it away.
+	Job stolen = q->jobs[t & (JOB_QUEUE_CAPACITY-1)];
+	if (!compare_and_swap_64((volatile u64*)&q->top, t + 1, t)) return false;
+
+	*job = stolen;
+	return true;
+}
+
+bool
+job_shared_queue_pop(Job *job) {
+	if (job_system.shared_count == 0) return false;
+
+	spinlock_acquire_or_wait(&job_system.shared_lock);
+	bool found = job_system.shared_count > 0;
+	if (found) {
+		*job = job_system.shared_jobs[job_system.shared_first];
+		job_system.shared_first = (job_system.shared_first + 1) & (JOB_QUEUE_CAPACITY-1);
+		job_system.shared_count -= 1;
+	}
+	spinlock_release(&job_system.shared_lock);
+
+	return found;
+}
+
+bool
+job_shared_queue_push(Job job) {
+	spinlock_acquire_or_wait(&job_system.shared_lock);
+	bool ok = job_system.shared_count < JOB_QUEUE_CAPACITY;
+	if (ok) {
+		u64 index = (job_system.shared_first + job_system.shared_count) & (JOB_QUEUE_CAPACITY-1);
+		job_system.shared_jobs[index] = job;
+		job_system.shared_count += 1;
+	}
+	spinlock_release(&job_system.shared_lock);
+
+	return ok;
+}
+
+bool
+job_find(Job *job) {
+	s64 self = job_worker_index;
+	if (self >= 0 && job_queue_pop(&job_system.workers[self].queue, job)) return true;
+
+	if (job_shared_queue_pop(job)) return true;
+
+	// Start at a random worker so thieves don't all go for the same one
+	if (job_steal_seed == 0) job_steal_seed = rdtsc() | 1;
+	job_steal_seed = job_steal_seed*MULTIPLIER + INCREMENT;
+	u64 start = (job_steal_seed >> 33) % job_system.worker_count;
+	for (u64 i = 0; i < job_system.worker_count; i += 1) {
+		u64 victim = (start + i) % job_system.worker_count;
+		if ((s64)victim == self) continue;
+		if (job_queue_steal(&job_system.workers[victim].queue, job)) return true;
+	}
+
+	return false;
+}
+
+void
+job_execute(Job job) {
+	job.proc(job.data);
+
+	if (job.counter) {
+		// Release, so the job's writes are visible before the counter says it's done
+		atomic_fetch_add_64(&job.counter->value, (u64)-1);
+	}
+}
+
+void
+job_wake_one() {
+	// The pushed job must be visible before we look at who is sleeping, and a worker going to
+	// sleep sets its flag before it looks for jobs one last time, so one of us sees the other.
+	atomic_fence_sequential();
+	if (job_system.sleeping_count == 0) return;
+
+	for (u64 i = 0; i < job_system.worker_count; i += 1) {
+		Job_Worker *w = &job_system.workers[i];
+		if (w->sleeping && compare_and_swap_bool(&w->sleeping, false, true)) {
+			os_binary_semaphore_signal(&w->wake);
+			return;
+		}
+	}
+}
+
+void
+job_worker_proc(Thread *t) {
+	Job_Worker *w = (Job_Worker*)t->data;
+	job_worker_index = (s64)w->index;
+
+	u64 spins = 0;
+	while (job_system.running) {
+		Job job;
+		if (job_find(&job)) {
+			job_execute(job);
+			reset_temporary_storage();
+			spins = 0;
+			continue;
+		}
+
+		spins += 1;
+		if (spins < JOB_WORKER_SPIN_COUNT) {
+			_mm_pause();
+			continue;
+		}
+		spins = 0;
+
+		w->sleeping = true;
+		atomic_fetch_add_64(&job_system.sleeping_count, 1);
+
+		bool found = job_find(&job);
+		if (found || !job_system.running) {
+			// If someone already took our flag they signalled us too, which just means the
+			// next sleep wakes up right away.
+			compare_and_swap_bool(&w->sleeping, false, true);
+		} else {
+			os_binary_semaphore_wait(&w->wake);
+		}
+
+		atomic_fetch_add_64(&job_system.sleeping_count, (u64)-1);
+
+		if (found) {
+			job_execute(job);
+			reset_temporary_storage();
+		}
+	}
+}
+
+void
+job_system_init(u64 worker_count) {
+	assert(!job_system.running, "Job system is already initialized");
+
+	if (worker_count == 0) worker_count = os_get_number_of_logical_processors();
+	worker_count = max(worker_count, 1);
+
+	Allocator heap = get_heap_allocator();
+
+	job_system.worker_count = worker_count;
+	job_system.workers = (Job_Worker*)alloc_aligned(heap, sizeof(Job_Worker)*worker_count, CACHE_LINE_SIZE);
+	job_system.sleeping_count = 0;
+	spinlock_init(&job_system.shared_lock);
+	job_system.shared_jobs = (Job*)alloc(heap, sizeof(Job)*JOB_QUEUE_CAPACITY);
+	job_system.shared_first = 0;
+	job_system.shared_count = 0;
+	job_system.running = true;
+
+	for (u64 i = 0; i < worker_count; i += 1) {
+		Job_Worker *w = &job_system.workers[i];
+		job_queue_init(&w->queue);
+		w->index = i;
+		w->sleeping = false;
+		os_binary_semaphore_init(&w->wake, false);
+	}
+
+	// This thread is worker 0
+	job_worker_index = 0;
+
+	for (u64 i = 1; i < worker_count; i += 1) {
+		Job_Worker *w = &job_system.workers[i];
+		os_thread_init(&w->thread, job_worker_proc);
+		w->thread.data = w;
+		w->thread.temporary_storage_size = JOB_WORKER_TEMPORARY_STORAGE_SIZE;
+		os_thread_start(&w->thread);
+	}
+}
+
+// Waits for the workers to finish the job they are on. Jobs still in the queues are dropped.
+void
+job_system_deinit() {
+	assert(job_system.running, "Job system is not initialized");
+	assert(job_worker_index == 0, "Job system must be deinitialized from the thread that initialized it");
+
+	job_system.running = false;
+	atomic_fence_sequential();
+
+	for (u64 i = 1; i < job_system.worker_count; i += 1) {
+		Job_Worker *w = &job_system.workers[i];
+		w->sleeping = false;
+		os_binary_semaphore_signal(&w->wake);
+	}
+
+	Allocator heap = get_heap_allocator();
+	for (u64 i = 0; i < job_system.worker_count; i += 1) {
+		Job_Worker *w = &job_system.workers[i];
+		if (i > 0) os_thread_destroy(&w->thread);
+		os_binary_semaphore_destroy(&w->wake);
+		dealloc(heap, w->queue.jobs);
+	}
+
+	dealloc(heap, job_system.shared_jobs);
+	dealloc(heap, job_system.workers);
+	job_system.workers = 0;
+	job_system.worker_count = 0;
+	job_worker_index = -1;
+}
+
+void
+job_run(Job_Proc proc, void *data, Job_Counter *counter) {
+	assert(proc, "Job has no proc");
+
+	if (counter) atomic_fetch_add_64(&counter->value, 1);
+
+	Job job;
+	job.proc = proc;
+	job.data = data;
+	job.counter = counter;
+
+	// Nobody would run it until someone waits on a counter, if at all
+	if (!job_system.running || job_system.worker_count == 1) {
+		job_execute(job);
+		return;
+	}
+
+	bool queued;
+	if (job_worker_index >= 0) queued = job_queue_push(&job_system.workers[job_worker_index].queue, job);
+	else                       queued = job_shared_queue_push(job);
+
+	if (!queued) {
+		job_execute(job);
+		return;
+	}
+
+	job_wake_one();
+}
+
+bool
+job_counter_is_done(Job_Counter *counter) {
+	// Acquire, so we see everything the jobs wrote
+	return atomic_load_acquire_64(&counter->value) == 0;
+}
+
+void
+job_counter_wait(Job_Counter *counter) {
+	u64 spins = 0;
+	while (atomic_load_acquire_64(&counter->value) != 0) {
+		Job job;
+		if (job_system.running && job_find(&job)) {
+			job_execute(job);
+			spins = 0;
+		} else if (spins < 64) {
+			_mm_pause();
+			spins += 1;
+		} else {
+			os_yield_thread();
+		}
+	}
+}
+
+s64
+job_get_worker_index() {
+	return job_worker_index;
+}
+
+u64
+job_system_get_worker_count() {
+	return job_system.worker_count;
+}
+
+typedef struct Parallel_For {
+	volatile u64 next;
+	u64 count;
+	u64 min_batch;
+	u64 participant_count;
+	// Measured from the last finished range, 0 until one is done
+	volatile u64 cycles_per_item;
+
+	Parallel_For_Proc for_proc;
+	Parallel_Reduce_Proc reduce_proc;
+	void *userdata;
+
+	// One per participant, on their own cache lines
+	u8 *partials;
+	u64 partial_stride;
+	volatile u64 next_participant;
+} Parallel_For;
+
+u64
+parallel_for_get_range_size(Parallel_For *p, u64 first) {
+	u64 remaining = p->count - first;
+
+	// Half of an even share of what's left, so ranges get smaller towards the end
+	u64 size = remaining / (p->participant_count*2);
+
+	u64 cycles_per_item = atomic_load_relaxed_64(&p->cycles_per_item);
+	if (cycles_per_item) {
+		// But not so small that taking ranges is most of the work
+		size = max(size, PARALLEL_FOR_TARGET_CYCLES / cycles_per_item);
+	} else {
+		// Start small until we know what an item costs
+		size = min(size, p->min_batch);
+	}
+
+	size = max(size, p->min_batch);
+	return min(size, remaining);
+}
+
+void
+parallel_for_participate(Parallel_For *p) {
+	u64 participant = atomic_fetch_add_relaxed_64(&p->next_participant, 1);
+	assert(participant < p->participant_count, "Internal error: too many parallel_for participants");
+	void *partial = p->partials ? p->partials + participant*p->partial_stride : 0;
+
+	while (true) {
+		u64 first = p->next;
+		if (first >= p->count) break;
+
+		u64 size = parallel_for_get_range_size(p, first);
+		if (!compare_and_swap_64(&p->next, first + size, first)) continue;
+
+		u64 start_cycles = rdtsc();
+		if (p->reduce_proc) p->reduce_proc(first, first + size, partial, p->userdata);
+		else                p->for_proc(first, first + size, p->userdata);
+		u64 cycles_per_item = (rdtsc() - start_cycles) / size;
+		atomic_store_relaxed_64(&p->cycles_per_item, max(cycles_per_item, 1));
+	}
+}
+
+void
+parallel_for_job(void *data) {
+	parallel_for_participate((Parallel_For*)data);
+}
+
+void
+parallel_for_run(Parallel_For *p) {
+	Job_Counter counter = {0};
+	for (u64 i = 1; i < p->participant_count; i += 1) {
+		job_run(parallel_for_job, p, &counter);
+	}
+	parallel_for_participate(p);
+	job_counter_wait(&counter);
+}
+
+// How many threads it's worth splitting count items over
+u64
+parallel_for_get_participant_count(u64 count, u64 min_batch) {
+	if (!job_system.running) return 1;
+	u64 batches = (count + min_batch - 1) / min_batch;
+	return max(min(job_system.worker_count, batches), 1);
+}
+
+void
+parallel_for(u64 count, u64 min_batch, Parallel_For_Proc proc, void *userdata) {
+	if (count == 0) return;
+	min_batch = max(min_batch, 1);
+
+	u64 participant_count = parallel_for_get_participant_count(count, min_batch);
+	if (participant_count == 1) {
+		proc(0, count, userdata);
+		return;
+	}
+
+	Parallel_For p = {0};
+	p.count = count;
+	p.min_batch = min_batch;
+	p.participant_count = participant_count;
+	p.for_proc = proc;
+	p.userdata = userdata;
+
+	parallel_for_run(&p);
+}
+
+void
+parallel_reduce(u64 count, u64 min_batch, Parallel_Reduce_Proc proc, Parallel_Combine_Proc combine, void *userdata, void *result, u64 result_size) {
+	if (count == 0) return;
+	min_batch = max(min_batch, 1);
+
+	u64 participant_count = parallel_for_get_participant_count(count, min_batch);
+	if (participant_count == 1) {
+		proc(0, count, result, userdata);
+		return;
+	}
+
+	Parallel_For p = {0};
+	p.count = count;
+	p.min_batch = min_batch;
+	p.participant_count = participant_count;
+	p.reduce_proc = proc;
+	p.userdata = userdata;
+	p.partial_stride = align_next(result_size, CACHE_LINE_SIZE);
+
+	Allocator heap = get_heap_allocator();
+	p.partials = (u8*)alloc_aligned(heap, p.partial_stride*participant_count, CACHE_LINE_SIZE);
+	for (u64 i = 0; i < participant_count; i += 1) {
+		memcpy(p.partials + i*p.partial_stride, result, result_size);
+	}
+
+	parallel_for_run(&p);
+
+	for (u64 i = 0; i < participant_count; i += 1) {
+		combine(result, p.partials + i*p.partial_stride, userdata);
+	}
+
+	dealloc(heap, p.partials);
+}
+
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
@@ -31,6 +31,10 @@ void* initialization_allocator_proc(u64 size, void *p, Allocator_Message message
 		case ALLOCATOR_REALLOCATE: {
 			return 0;
 		}
+		case ALLOCATOR_ALLOCATE_ALIGNED: {
+			init_memory_head = (u8*)align_next((u64)init_memory_head, (u64)p);
+			return initialization_allocator_proc(size, 0, ALLOCATOR_ALLOCATE, data);
+		}
 	}
 	return 0;
 }
@@ -43,65 +47,237 @@ Allocator get_initialization_allocator() {
 
 ///
 ///
-// Basic general heap allocator, free list
+// General heap allocator, TLSF (Two-Level Segregated Fit)
 ///
+// Free chunks are binned by size in two levels. The first level is the power of two of the
+// size, and the second level splits that range linearly into HEAP_SL_COUNT lists.
+// Each level has a bitmap of which lists are non-empty, so finding a free chunk that fits
+// is a couple of bit scans no matter how many free chunks there are.
+// Every chunk knows its physical neighbours (size gives the next one, previous_physical
+// gives the previous one) so freed chunks are merged with free neighbours immediately.
+// Both heap_alloc and heap_dealloc are O(1).
+//
+// Freed memory stays committed so the same sizes can be freed & allocated again without
+// talking to the OS. heap_purge() (called from os_update() at the end of each frame) then
+// decommits the pages inside free chunks, biggest first, once there's more than
+// heap_retained_free_bytes of them, down to half that. When a purged chunk is reused, only
+// the pages the allocation covers are committed again, the rest stays decommitted in what's
+// left of the chunk. Merged chunks keep the purged pages of their parts. Each heap block keeps
+// a bitmap of which of its pages are committed, so pages are never committed or decommitted
+// twice and the stats stay exact. In DEBUG nothing is retained, so touching freed memory
+// after the frame it was freed in will crash.
+//
 // Technically thread safe but synchronization is horrible.
-// Fragmentation is catastrophic.
-// We could fix it by merging free nodes every now and then
-// BUT: We aren't really supposed to allocate/deallocate directly on the heap too much anyways...
 
 #define MAX_HEAP_BLOCK_SIZE align_next(MB(500), os.page_size)
 #define DEFAULT_HEAP_BLOCK_SIZE (min(MAX_HEAP_BLOCK_SIZE, program_memory_capacity))
-#define HEAP_ALIGNMENT (sizeof(Heap_Free_Node))
+#define HEAP_ALIGNMENT 16
+#define HEAP_ALIGNMENT_LOG2 4
+
+// Number of second level lists per first level, log2
+#define HEAP_SL_COUNT_LOG2 5
+#define HEAP_SL_COUNT (1 << HEAP_SL_COUNT_LOG2)
+// Chunks smaller than this all go in first level 0, split linearly in steps of HEAP_ALIGNMENT
+#define HEAP_FL_SHIFT (HEAP_SL_COUNT_LOG2 + HEAP_ALIGNMENT_LOG2)
+#define HEAP_SMALL_CHUNK_SIZE (1ull << HEAP_FL_SHIFT)
+// Chunks must be smaller than 1 << HEAP_FL_MAX
+#define HEAP_FL_MAX 40
+#define HEAP_FL_COUNT (HEAP_FL_MAX - HEAP_FL_SHIFT + 1)
+
+// Stored in the low bits of the chunk size, which are always 0 because of alignment
+#define HEAP_CHUNK_FREE   (1ull << 0)
+#define HEAP_CHUNK_CACHED (1ull << 1) // Slot in a thread cache span, not a heap chunk
+#define HEAP_CHUNK_LARGE  (1ull << 2) // Own range of pages, see Heap_Large_Allocation
+#define HEAP_CHUNK_PURGED (1ull << 3) // Free chunk with some pages inside it decommitted, see Heap_Free_Node
+#define HEAP_CHUNK_FLAGS  (HEAP_ALIGNMENT-1)
+
 typedef struct Heap_Free_Node Heap_Free_Node;
 typedef struct Heap_Block Heap_Block;
-
-typedef struct Heap_Free_Node {
-	u64 size;
-	Heap_Free_Node *next;
-} Heap_Free_Node;
+typedef struct Heap_Allocation_Metadata Heap_Allocation_Metadata;
+typedef struct Heap_Cache_Span Heap_Cache_Span;
+typedef struct Heap_Cache_Slot Heap_Cache_Slot;
+typedef struct Heap_Thread_Cache Heap_Thread_Cache;
+typedef struct Heap_Large_Allocation Heap_Large_Allocation;
 
 typedef struct Heap_Block {
 	u64 size;
-	Heap_Free_Node *free_head;
 	void* start;
 	Heap_Block *next;
-	// 32 bytes !!
 #if CONFIGURATION == DEBUG
 	u64 total_allocated;
+#else
 	u64 padding;
 #endif
+	// 32 bytes !!
+	// Followed by one bit per page in the block, set if the page is committed. See
+	// heap_block_get_page_bits().
 } Heap_Block;
 
+// Sits in front of every chunk, free or allocated.
 #define HEAP_META_SIGNATURE 6969694206942069ull
 typedef alignat(16) struct Heap_Allocation_Metadata {
-	u64 size;
-	Heap_Block *block;
+	u64 size; // Whole chunk including metadata. Low bits are HEAP_CHUNK_ flags, use heap_chunk_size()
+	union {
+		Heap_Allocation_Metadata *previous_physical; // 0 if first chunk in block or HEAP_CHUNK_LARGE
+		Heap_Cache_Span *span; // If HEAP_CHUNK_CACHED
+	};
 #if CONFIGURATION == DEBUG
+	Heap_Block *block;
 	u64 signature;
-	u64 padding;
 #endif
 } Heap_Allocation_Metadata;
 
+// Free chunks keep their list links right after the metadata, where the user memory would be
+typedef struct Heap_Free_Node {
+	Heap_Allocation_Metadata meta;
+	Heap_Free_Node *next;
+	Heap_Free_Node *previous;
+	// Bytes of the inner pages (heap_free_node_inner_pages()) that are decommitted, if
+	// HEAP_CHUNK_PURGED is set
+	u64 decommitted_size;
+} Heap_Free_Node;
+
+#define HEAP_MIN_CHUNK_SIZE align_next(sizeof(Heap_Free_Node), HEAP_ALIGNMENT)
+
+typedef struct Heap_Bins {
+	u64 fl_bitmap;
+	u32 sl_bitmaps[HEAP_FL_COUNT];
+	Heap_Free_Node *free_lists[HEAP_FL_COUNT][HEAP_SL_COUNT];
+} Heap_Bins;
+
 // #Global
 ogb_instance Heap_Block *heap_head;
 ogb_instance bool heap_initted;
 ogb_instance Spinlock heap_lock;
+ogb_instance Heap_Bins heap_bins;
 
 #if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
 Heap_Block *heap_head;
 bool heap_initted = false;
 Spinlock heap_lock;
+Heap_Bins heap_bins;
 #endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
-	
+
+typedef struct Heap_Stats {
+	// Program memory pages the heap has committed, including metadata
+	u64 committed_bytes;
+	// Allocated chunks including their metadata. Thread cache spans count as in use.
+	u64 in_use_bytes;
+	// Free chunks that haven't been purged yet
+	u64 free_committed_bytes;
+} Heap_Stats;
+
+// #Global
+ogb_instance Heap_Stats heap_stats;
+// heap_purge() leaves up to this much free memory committed
+ogb_instance u64 heap_retained_free_bytes;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Heap_Stats heap_stats = {0};
+#if CONFIGURATION == DEBUG
+u64 heap_retained_free_bytes = 0;
+#else
+u64 heap_retained_free_bytes = MB(32);
+#endif
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+// Caller must hold heap_lock
+void heap_commit_pages(void *start, u64 size) {
+	if (!size) return;
+	bool ok = os_commit_program_memory_pages(start, size);
+	assert(ok, "Out of memory: failed to commit %llukb for the heap", size/KB(1));
+	heap_stats.committed_bytes += size;
+}
+// Caller must hold heap_lock
+void heap_decommit_pages(void *start, u64 size) {
+	if (!size) return;
+	os_decommit_program_memory_pages(start, size);
+	heap_stats.committed_bytes -= size;
+}
+
+inline u64 *heap_block_get_page_bits(Heap_Block *block) {
+	return (u64*)(block+1);
+}
+inline bool heap_block_is_page_committed(u64 *bits, u64 page) {
+	return (bits[page/64] >> (page%64)) & 1;
+}
+u64 heap_block_count_decommitted_pages(u64 *bits, u64 first_page, u64 page_count) {
+	u64 count = 0;
+	u64 page = first_page;
+	u64 end_page = first_page + page_count;
+	while (page < end_page) {
+		if (page % 64 == 0 && end_page - page >= 64 && bits[page/64] == ~0ull) {
+			page += 64;
+			continue;
+		}
+		if (!heap_block_is_page_committed(bits, page)) count += 1;
+		page += 1;
+	}
+	return count;
+}
+Heap_Block *heap_block_from_pointer(void *p) {
+	for (Heap_Block *block = heap_head; block; block = block->next) {
+		if ((u8*)p >= (u8*)block && (u8*)p < (u8*)block + block->size) return block;
+	}
+	panic("Internal heap error: pointer %p is not in any heap block", p);
+	return 0;
+}
+// Caller must hold heap_lock
+// Commits or decommits the pages in the range that are not in that state already, one run
+// at a time. Returns the number of bytes that changed.
+u64 heap_block_set_pages_committed(void *start, u64 size, bool commit) {
+	if (!size) return 0;
+	Heap_Block *block = heap_block_from_pointer(start);
+	u64 *bits = heap_block_get_page_bits(block);
+	u64 page = ((u8*)start - (u8*)block) / os.page_size;
+	u64 end_page = page + size / os.page_size;
+	u64 skip_word = commit ? ~0ull : 0;
+
+	u64 changed = 0;
+	while (page < end_page) {
+		if (page % 64 == 0 && end_page - page >= 64 && bits[page/64] == skip_word) {
+			page += 64;
+			continue;
+		}
+		if (heap_block_is_page_committed(bits, page) == commit) {
+			page += 1;
+			continue;
+		}
+
+		u64 run_start = page;
+		while (page < end_page && heap_block_is_page_committed(bits, page) != commit) {
+			if (commit) bits[page/64] |=  (1ull << (page%64));
+			else        bits[page/64] &= ~(1ull << (page%64));
+			page += 1;
+		}
+
+		void *run = (u8*)block + run_start*os.page_size;
+		u64 run_size = (page-run_start)*os.page_size;
+		if (commit) heap_commit_pages(run, run_size);
+		else        heap_decommit_pages(run, run_size);
+		changed += run_size;
+	}
+	return changed;
+}
+
 
 u64 get_heap_block_size_excluding_metadata(Heap_Block *block) {
-	return block->size - sizeof(Heap_Block);
+	return block->size - ((u8*)block->start - (u8*)block);
 }
 u64 get_heap_block_size_including_metadata(Heap_Block *block) {
 	return block->size;
 }
 
+inline u64 heap_chunk_size(Heap_Allocation_Metadata *meta) {
+	return meta->size & ~HEAP_CHUNK_FLAGS;
+}
+inline bool heap_chunk_is_free(Heap_Allocation_Metadata *meta) {
+	return (meta->size & HEAP_CHUNK_FREE) != 0;
+}
+inline Heap_Allocation_Metadata *heap_chunk_next_physical(Heap_Allocation_Metadata *meta) {
+	return (Heap_Allocation_Metadata*)((u8*)meta + heap_chunk_size(meta));
+}
+
 bool is_pointer_in_program_memory(void *p) {
 	return (u8*)p >= (u8*)program_memory && (u8*)p<((u8*)program_memory+program_memory_capacity);
 }
@@ -117,452 +293,1314 @@ bool is_pointer_valid(void *p) {
 	return is_pointer_in_program_memory(p) || is_pointer_in_stack(p) || is_pointer_in_static_memory(p);
 }
 
+// Which list a free chunk of this size belongs in
+inline void heap_mapping_insert(u64 size, u32 *fl, u32 *sl) {
+	if (size < HEAP_SMALL_CHUNK_SIZE) {
+		*fl = 0;
+		*sl = (u32)(size / (HEAP_SMALL_CHUNK_SIZE / HEAP_SL_COUNT));
+	} else {
+		u32 log2 = bit_scan_reverse_64(size);
+		*sl = (u32)(size >> (log2 - HEAP_SL_COUNT_LOG2)) ^ HEAP_SL_COUNT;
+		*fl = log2 - (HEAP_FL_SHIFT - 1);
+	}
+}
+// Which list to start searching in so that any chunk in it is big enough
+inline void heap_mapping_search(u64 size, u32 *fl, u32 *sl) {
+	if (size >= HEAP_SMALL_CHUNK_SIZE) {
+		size += (1ull << (bit_scan_reverse_64(size) - HEAP_SL_COUNT_LOG2)) - 1;
+	}
+	heap_mapping_insert(size, fl, sl);
+}
+
+// The pages strictly inside a free chunk are not touched until it's allocated again, so
+// that's what gets decommitted when it's purged. Metadata & list links stay accessible.
+inline u64 heap_free_node_inner_pages(Heap_Free_Node *node, void **start) {
+	void *free_tail = (u8*)node + heap_chunk_size(&node->meta);
+	void *next_page = (void*)align_next((u8*)node + sizeof(Heap_Free_Node), os.page_size);
+	void *last_page_end = (void*)align_previous(free_tail, os.page_size);
+	*start = next_page;
+	if ((u8*)last_page_end <= (u8*)next_page) return 0;
+	return (u64)last_page_end-(u64)next_page;
+}
+
+void heap_insert_free_node(Heap_Free_Node *node, u64 decommitted_size) {
+	u32 fl, sl;
+	heap_mapping_insert(heap_chunk_size(&node->meta), &fl, &sl);
+	assert(fl < HEAP_FL_COUNT, "Internal heap error: chunk is too large for the heap bins");
+
+	Heap_Free_Node *head = heap_bins.free_lists[fl][sl];
+	node->next = head;
+	node->previous = 0;
+	if (head) head->previous = node;
+	heap_bins.free_lists[fl][sl] = node;
+
+	heap_bins.fl_bitmap |= 1ull << fl;
+	heap_bins.sl_bitmaps[fl] |= 1u << sl;
+
+	node->decommitted_size = decommitted_size;
+	if (decommitted_size) node->meta.size |=  HEAP_CHUNK_PURGED;
+	else                  node->meta.size &= ~HEAP_CHUNK_PURGED;
+	heap_stats.free_committed_bytes += heap_chunk_size(&node->meta) - decommitted_size;
+}
+// Returns how many bytes inside the chunk are decommitted. The pages stay that way, so
+// whoever reuses the chunk needs to heap_recommit_free_pages() what it's going to touch.
+u64 heap_remove_free_node(Heap_Free_Node *node) {
+	u32 fl, sl;
+	heap_mapping_insert(heap_chunk_size(&node->meta), &fl, &sl);
+
+	u64 decommitted_size = (node->meta.size & HEAP_CHUNK_PURGED) ? node->decommitted_size : 0;
+	heap_stats.free_committed_bytes -= heap_chunk_size(&node->meta) - decommitted_size;
+	node->meta.size &= ~HEAP_CHUNK_PURGED;
+
+	if (node->next)     node->next->previous = node->previous;
+	if (node->previous) node->previous->next = node->next;
+
+	if (heap_bins.free_lists[fl][sl] == node) {
+		heap_bins.free_lists[fl][sl] = node->next;
+		if (!node->next) {
+			heap_bins.sl_bitmaps[fl] &= ~(1u << sl);
+			if (!heap_bins.sl_bitmaps[fl]) heap_bins.fl_bitmap &= ~(1ull << fl);
+		}
+	}
+	node->next = 0;
+	node->previous = 0;
+
+	return decommitted_size;
+}
+
+// For a free chunk that was taken out of the lists & is now used up to used_end (allocated
+// memory and the header of any free chunk split off after it). inner & inner_size are the
+// chunk's heap_free_node_inner_pages() from before it was taken out.
+// Commits the purged pages before used_end and returns how many decommitted bytes are left,
+// which are all inside the inner pages of the free chunk that starts at used_end, if any.
+u64 heap_recommit_free_pages(void *inner, u64 inner_size, u64 decommitted_size, void *used_end) {
+	if (!decommitted_size) return 0;
+
+	u8 *end = (u8*)align_next(used_end, os.page_size);
+	end = min(end, (u8*)inner + inner_size);
+	if (end <= (u8*)inner) return decommitted_size;
+
+	u64 recommitted = heap_block_set_pages_committed(inner, (u64)(end-(u8*)inner), true);
+	assert(recommitted <= decommitted_size, "Internal heap error: heap stats are out of sync with committed pages");
+	return decommitted_size - recommitted;
+}
+
+// Finds the first non-empty list at or after (fl, sl). Returns 0 if there is none.
+Heap_Free_Node *heap_find_free_node(u32 fl, u32 sl) {
+	if (fl >= HEAP_FL_COUNT) return 0;
+
+	u64 sl_map = heap_bins.sl_bitmaps[fl] & (~0ull << sl);
+	if (!sl_map) {
+		u64 fl_map = heap_bins.fl_bitmap & (~0ull << (fl+1));
+		if (!fl_map) return 0;
+		fl = bit_scan_forward_64(fl_map);
+		sl_map = heap_bins.sl_bitmaps[fl];
+	}
+	assert(sl_map != 0, "Internal heap error: heap bitmaps are out of sync");
+	sl = bit_scan_forward_64(sl_map);
+
+	return heap_bins.free_lists[fl][sl];
+}
+
 // Meant for debug
-void sanity_check_block(Heap_Block *block) {
+// Returns bytes in free chunks that are not purged
+u64 sanity_check_block(Heap_Block *block) {
+	u64 total_free_committed = 0;
 #if CONFIGURATION == DEBUG
 	assert(is_pointer_in_program_memory(block), "Heap_Block pointer is corrupt");
 	assert(is_pointer_in_program_memory(block->start), "Heap_Block pointer is corrupt");
 	if(block->next) { assert(is_pointer_in_program_memory(block->next), "Heap_Block next pointer is corrupt"); }
 	assert(block->size < GB(256), "A heap block is corrupt.");
 	assert(block->size >= INITIAL_PROGRAM_MEMORY_SIZE, "A heap block is corrupt.");
-	assert((u64)block->start == (u64)block + sizeof(Heap_Block), "A heap block is corrupt.");
-	
+	assert((u64)block->start > (u64)block + sizeof(Heap_Block) && (u64)block->start % HEAP_ALIGNMENT == 0, "A heap block is corrupt.");
 
-	Heap_Free_Node *node = block->free_head;	
-	
+	// Walk all chunks in the block physically, up to the zero-sized sentinel at the end
+	Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)block->start;
+	Heap_Allocation_Metadata *previous = 0;
 	u64 total_free = 0;
-	while (node != 0) {
-		Heap_Free_Node *other_node = node->next;
-		
-		assert(node->size < GB(256), "Heap is corrupt");
-		assert(is_pointer_in_program_memory(node), "Heap is corrupt");
-		
-		while (other_node != 0) {
-			assert(is_pointer_in_program_memory(other_node), "Heap is corrupt");
-			assert(other_node != node, "Circular reference in heap free node tree. This is probably an internal error, or an extremely unlucky result from heap corruption.");
-			other_node = other_node->next;
+	u64 total_used = 0;
+	u64 total_decommitted = 0;
+	u64 *page_bits = heap_block_get_page_bits(block);
+	while (heap_chunk_size(meta) != 0) {
+		u64 size = heap_chunk_size(meta);
+
+		assert(is_pointer_in_program_memory(meta), "Heap is corrupt");
+		assert(meta->signature == HEAP_META_SIGNATURE, "Heap is corrupt");
+		assert(meta->block == block, "Heap is corrupt");
+		assert(meta->previous_physical == previous, "Heap is corrupt: previous_physical does not match");
+		assert(size >= HEAP_MIN_CHUNK_SIZE && size % HEAP_ALIGNMENT == 0, "Heap is corrupt");
+		assert(size < GB(256), "Heap is corrupt");
+
+		if (heap_chunk_is_free(meta)) {
+			assert(!previous || !heap_chunk_is_free(previous), "Two neighbouring free chunks were not merged. This is an internal error.");
+
+			// Make sure it's actually in the list it's supposed to be in
+			u32 fl, sl;
+			heap_mapping_insert(size, &fl, &sl);
+			assert(heap_bins.fl_bitmap & (1ull << fl), "Heap bitmaps are out of sync");
+			assert(heap_bins.sl_bitmaps[fl] & (1u << sl), "Heap bitmaps are out of sync");
+			Heap_Free_Node *node = heap_bins.free_lists[fl][sl];
+			u64 list_count = 0;
+			while (node && (Heap_Allocation_Metadata*)node != meta) {
+				if (node->next) { assert(node->next->previous == node, "Free list links are fucky wucky. This might be heap corruption, or possibly an internal error."); }
+				node = node->next;
+				list_count += 1;
+				assert(list_count < GB(1), "Circular reference in heap free list. This is probably an internal error, or an extremely unlucky result from heap corruption.");
+			}
+			assert(node != 0, "Free chunk is missing from its free list. This might be heap corruption, or possibly an internal error.");
+
+			// Only inner pages of free chunks can be decommitted, and the chunk must know how many are
+			Heap_Free_Node *free_node = (Heap_Free_Node*)meta;
+			u64 decommitted_size = (meta->size & HEAP_CHUNK_PURGED) ? free_node->decommitted_size : 0;
+			void *inner;
+			u64 inner_size = heap_free_node_inner_pages(free_node, &inner);
+			u64 first_page = ((u8*)inner - (u8*)block) / os.page_size;
+			u64 inner_decommitted = heap_block_count_decommitted_pages(page_bits, first_page, inner_size/os.page_size)*os.page_size;
+			assert(inner_decommitted == decommitted_size, "Purged chunk does not match the committed pages. This is an internal error.");
+			assert(!(meta->size & HEAP_CHUNK_PURGED) || decommitted_size > 0, "Heap is corrupt");
+			total_decommitted += decommitted_size;
+
+			total_free += size;
+			total_free_committed += size - decommitted_size;
+		} else {
+			total_used += size;
 		}
-		total_free += node->size;
-		assert(total_free <= block->size, "Free nodes are fucky wucky. This might be heap corruption, or possibly an internal error.");
-		node = node->next;
+
+		assert(total_free+total_used <= block->size, "Free nodes are fucky wucky. This might be heap corruption, or possibly an internal error.");
+
+		previous = meta;
+		meta = heap_chunk_next_physical(meta);
 	}
-	
-	u64 expected_size = get_heap_block_size_excluding_metadata(block);
-	assert(block->total_allocated+total_free == expected_size, "Heap is corrupt.")
+	assert(meta->previous_physical == previous, "Heap block sentinel is corrupt");
+
+	u64 block_decommitted = heap_block_count_decommitted_pages(page_bits, 0, block->size/os.page_size)*os.page_size;
+	assert(block_decommitted == total_decommitted, "Pages outside of free chunks are decommitted. This is an internal error.");
+
+	u64 expected_size = get_heap_block_size_excluding_metadata(block) - sizeof(Heap_Allocation_Metadata);
+	assert(total_used+total_free == expected_size, "Heap is corrupt.");
+	assert(block->total_allocated == total_used, "Heap is corrupt.");
+#endif
+	return total_free_committed;
+}
+void sanity_check_heap() {
+	Heap_Block *block = heap_head;
+	u64 total_free_committed = 0;
+	while (block != 0) {
+		total_free_committed += sanity_check_block(block);
+		block = block->next;
+	}
+#if CONFIGURATION == DEBUG
+	assert(total_free_committed == heap_stats.free_committed_bytes, "Heap stats are out of sync. This is an internal error.");
 #endif
 }
 inline void check_meta(Heap_Allocation_Metadata *meta) {
 #if CONFIGURATION == DEBUG
 	assert(meta->signature == HEAP_META_SIGNATURE, "Heap error. Either 1) You passed a bad pointer to dealloc or 2) You corrupted the heap.");
+	if (!(meta->size & HEAP_CHUNK_LARGE)) {
+		assert(is_pointer_in_program_memory(meta->block), "Heap error. Either 1) You passed a bad pointer to dealloc or 2) You corrupted the heap.");
+		assert((u64)meta >= (u64)meta->block->start && (u64)meta < (u64)meta->block->start+meta->block->size, "Heap error: Pointer is not in it's metadata block. This could be heap corruption but it's more likely an internal error. That's not good.");
+	}
 #endif
 // If > 256GB then prolly not legit lol
-	assert(meta->size < 1024ULL*1024ULL*1024ULL*256ULL, "Heap error. Either 1) You passed a bad pointer to dealloc or 2) You corrupted the heap.");	
-	assert(is_pointer_in_program_memory(meta->block), "Heap error. Either 1) You passed a bad pointer to dealloc or 2) You corrupted the heap."); 
-
-	assert((u64)meta >= (u64)meta->block->start && (u64)meta < (u64)meta->block->start+meta->block->size, "Heap error: Pointer is not in it's metadata block. This could be heap corruption but it's more likely an internal error. That's not good.");
-}
-
-typedef struct {
-	Heap_Free_Node *best_fit;
-	Heap_Free_Node *previous;
-	u64 delta;
-} Heap_Search_Result;
-Heap_Search_Result search_heap_block(Heap_Block *block, u64 size) {
-	
-	if (block->free_head == 0)  return (Heap_Search_Result){0, 0, 0};
-		
-	Heap_Free_Node *node = block->free_head;
-	Heap_Free_Node *previous = 0;
-	
-	Heap_Free_Node *best_fit = 0;
-	Heap_Free_Node *before_best_fit = 0;
-	u64 best_fit_delta = 0;
-	
-	while (node != 0) {
-		
-		if (node->size == size) {
-			Heap_Search_Result result;
-			result.best_fit = node;
-			result.previous = previous;
-			result.delta = 0;
-			assert(result.previous != result.best_fit, "Internal goof");
-			return result;
-		}
-		
-		if (node->size >= size) {
-			u64 delta = node->size - size;
-			
-			if (delta < best_fit_delta || !best_fit) {
-				before_best_fit = previous;
-				best_fit = node;
-				best_fit_delta = delta;
-			}
-		}
-		
-		if (node->next) previous = node;
-		node = node->next;
-	}
-	
-	if (!best_fit)  return (Heap_Search_Result){0, 0, 0};
-
-	Heap_Search_Result result;
-	result.best_fit = best_fit;
-	result.previous = before_best_fit;
-	result.delta = best_fit_delta;
-	assert(result.previous != result.best_fit, "Internal goof");
-	return result;
+	assert(heap_chunk_size(meta) < 1024ULL*1024ULL*1024ULL*256ULL, "Heap error. Either 1) You passed a bad pointer to dealloc or 2) You corrupted the heap.");
+	assert(!heap_chunk_is_free(meta), "Heap error. Either 1) You deallocated the same pointer twice or 2) You corrupted the heap.");
 }
 
 Heap_Block *make_heap_block(Heap_Block *parent, u64 size) {
 
-	size += sizeof(Heap_Block);
+	// Room for the block header and the sentinel chunk at the end
+	size += sizeof(Heap_Block) + sizeof(Heap_Allocation_Metadata);
 
-	size = align_next(size, os.page_size);
+	// And the page bitmap, which needs more room the bigger the block gets
+	u64 page_bits_size = 0;
+	while (true) {
+		u64 page_count = align_next(size + page_bits_size, os.page_size) / os.page_size;
+		u64 needed = align_next(align_next(page_count, 64) / 8, HEAP_ALIGNMENT);
+		if (needed <= page_bits_size) break;
+		page_bits_size = needed;
+	}
+	size = align_next(size + page_bits_size, os.page_size);
 
 	Heap_Block *block = (Heap_Block*)os_reserve_next_memory_pages(size);
-		
+
 	assert((u64)block % os.page_size == 0, "Heap block not aligned to page size");
-	
-	if (parent) parent->next = block;
+
 	os_unlock_program_memory_pages(block, size);
-	
+	heap_stats.committed_bytes += size;
+
 #if CONFIGURATION == DEBUG
 	block->total_allocated = 0;
 #endif
-	
-	block->start = ((u8*)block)+sizeof(Heap_Block);
+
+	// Every page starts out committed
+	memset(heap_block_get_page_bits(block), 0xFF, page_bits_size);
+
+	block->start = ((u8*)block)+sizeof(Heap_Block)+page_bits_size;
 	block->size = size;
 	block->next = 0;
-	block->free_head = (Heap_Free_Node*)block->start;
-	block->free_head->size = get_heap_block_size_excluding_metadata(block);
-	block->free_head->next = 0;
-	
+	if (parent) {
+		block->next = parent->next;
+		parent->next = block;
+	}
+
+	// One free chunk spanning the whole block, followed by a zero-sized used chunk so we
+	// never try to merge past the end of the block.
+	Heap_Free_Node *node = (Heap_Free_Node*)block->start;
+	node->meta.size = (get_heap_block_size_excluding_metadata(block) - sizeof(Heap_Allocation_Metadata)) | HEAP_CHUNK_FREE;
+	node->meta.previous_physical = 0;
+
+	Heap_Allocation_Metadata *sentinel = heap_chunk_next_physical(&node->meta);
+	sentinel->size = 0;
+	sentinel->previous_physical = &node->meta;
+
+#if CONFIGURATION == DEBUG
+	node->meta.block = block;
+	node->meta.signature = HEAP_META_SIGNATURE;
+	sentinel->block = block;
+	sentinel->signature = HEAP_META_SIGNATURE;
+#endif
+
+	heap_insert_free_node(node, 0);
+
 	return block;
 }
 
 void heap_init() {
 	if (heap_initted) return;
-	assert(HEAP_ALIGNMENT == 16);
 	assert(sizeof(Heap_Allocation_Metadata) % HEAP_ALIGNMENT == 0);
+	assert(sizeof(Heap_Block) % HEAP_ALIGNMENT == 0);
 	heap_initted = true;
+	memset(&heap_bins, 0, sizeof(Heap_Bins));
 	heap_head = make_heap_block(0, DEFAULT_HEAP_BLOCK_SIZE);
 	spinlock_init(&heap_lock);
 }
 
-void *heap_alloc(u64 size) {
-
-	if (!heap_initted) heap_init();
+// Caller must hold heap_lock
+void *_heap_alloc(u64 size) {
 
-	// #Sync #Speed oof
-	spinlock_acquire_or_wait(&heap_lock);
-	
+	size += sizeof(Heap_Allocation_Metadata);
 
+	size = align_next(size, HEAP_ALIGNMENT);
+	size = max(size, HEAP_MIN_CHUNK_SIZE);
 
+	assert(size < MAX_HEAP_BLOCK_SIZE, "Internal heap error: large allocations should go through heap_large_alloc");
 
-	
-	size += sizeof(Heap_Allocation_Metadata);
-	
-	size = (size+HEAP_ALIGNMENT) & ~(HEAP_ALIGNMENT-1);
-	
-	assert(size < MAX_HEAP_BLOCK_SIZE, "Past Charlie has been lazy and did not handle large allocations like this. I apologize on behalf of past Charlie. A quick fix could be to increase the heap block size for now. #Incomplete #Limitation");
-	
-	
 #if VERY_DEBUG
-	{
-		Heap_Block *block = heap_head;
-		
-		while (block != 0) {
-			sanity_check_block(block);
-			block = block->next;
-		}
-	}
+	sanity_check_heap();
 #endif
-	
-	Heap_Block *block = heap_head;
-	Heap_Block *last_block = 0;
-	Heap_Free_Node *best_fit = 0;
-	Heap_Block *best_fit_block = 0;
-	Heap_Free_Node *previous = 0;
-	u64 best_fit_delta = 0;
-	// #Speed
-	// Maybe instead of going through EVERY free node to find best fit we do a good-enough fit
-	while (block != 0) {
 
-		if (get_heap_block_size_excluding_metadata(block) < size) {
-			last_block = block;
-			block = block->next;
-			continue;
-		}
-	
-		Heap_Search_Result result = search_heap_block(block, size);
-		Heap_Free_Node *node = result.best_fit;
-		if (node) {
-			if (node->size < size) continue;
-			if (node->size == size) {
-				best_fit = node;
-				best_fit_block = block;
-				previous = result.previous;
-				best_fit_delta = 0;
-				break;
-			}
-			
-			u64 delta = node->size-size;
-			if (delta < best_fit_delta || !best_fit) {
-				best_fit = node;
-				best_fit_block = block;
-				previous = result.previous;
-				best_fit_delta = delta;
-			}
-		}
-		
-		last_block = block;
-		block = block->next;
-	}
-	
+	u32 fl, sl;
+	heap_mapping_search(size, &fl, &sl);
+	Heap_Free_Node *best_fit = heap_find_free_node(fl, sl);
+
 	if (!best_fit) {
-		block = make_heap_block(last_block, max(DEFAULT_HEAP_BLOCK_SIZE, size));
-		previous = 0;
-		best_fit = block->free_head;
-		best_fit_block = block;
+		// Make sure the new block has a chunk that's big enough for any size in that list
+		u64 block_size = max(DEFAULT_HEAP_BLOCK_SIZE, size + (size >> HEAP_SL_COUNT_LOG2));
+		make_heap_block(heap_head, block_size);
+		best_fit = heap_find_free_node(fl, sl);
 	}
-		
-	
+
 	assert(best_fit != 0, "Internal heap error");
-	
-	// Unlock best fit
-	
-	// #Copypaste
-	void *free_tail = (u8*)best_fit + best_fit->size;
-	void *first_page = (void*)align_previous(best_fit, os.page_size);
-	void *last_page_end = (void*)align_previous(free_tail, os.page_size);
-	if ((u8*)last_page_end > (u8*)first_page) {
-		os_unlock_program_memory_pages(first_page, (u64)last_page_end-(u64)first_page);
-	}
-	
-	Heap_Free_Node *new_free_node = 0;
-	if (size != best_fit->size) {
-		u64 remainder = best_fit->size - size;
-		new_free_node = (Heap_Free_Node*)(((u8*)best_fit)+size);
-		new_free_node->size = remainder;
-		new_free_node->next = best_fit->next;
-		
-		// Lock remaining free node
-		// #Copypaste
-		void *free_tail = (u8*)new_free_node + new_free_node->size;
-		void *next_page = (void*)align_next(new_free_node, os.page_size);
-		void *last_page_end = (void*)align_previous(free_tail, os.page_size);
-		if ((u8*)last_page_end > (u8*)next_page) {
-			os_lock_program_memory_pages(next_page, (u64)last_page_end-(u64)next_page);
-		}
-	}
-	
-	
-	if (previous && new_free_node) {
-		assert(previous->next == best_fit, "Internal heap error");
-		previous->next = new_free_node;
-	} else if (previous) {
-		assert(previous->next == best_fit, "Internal heap error");
-		previous->next = best_fit->next;
-	}
-	
-	if (best_fit_block->free_head == best_fit) {
-		// If we allocated the first free node then replace with new free node or just
-		// remove it if perfect fit.
-		if (new_free_node) {
-			new_free_node->next = best_fit_block->free_head->next;
-			best_fit_block->free_head = new_free_node;
-		} else best_fit_block->free_head = best_fit_block->free_head->next;
+	assert(heap_chunk_size(&best_fit->meta) >= size, "Internal heap error");
+
+	void *inner;
+	u64 inner_size = heap_free_node_inner_pages(best_fit, &inner);
+	u64 decommitted_size = heap_remove_free_node(best_fit);
+
+	Heap_Allocation_Metadata *meta = &best_fit->meta;
+	u64 chunk_size = heap_chunk_size(meta);
+
+	if (chunk_size - size >= HEAP_MIN_CHUNK_SIZE) {
+		// Split off the remainder as a new free chunk, which keeps the purged pages we don't use
+		Heap_Free_Node *remainder = (Heap_Free_Node*)((u8*)meta + size);
+		decommitted_size = heap_recommit_free_pages(inner, inner_size, decommitted_size, (u8*)remainder + sizeof(Heap_Free_Node));
+		remainder->meta.size = (chunk_size - size) | HEAP_CHUNK_FREE;
+		remainder->meta.previous_physical = meta;
+#if CONFIGURATION == DEBUG
+		remainder->meta.block = meta->block;
+		remainder->meta.signature = HEAP_META_SIGNATURE;
+#endif
+		heap_chunk_next_physical(&remainder->meta)->previous_physical = &remainder->meta;
+
+		heap_insert_free_node(remainder, decommitted_size);
+
+		chunk_size = size;
+	} else {
+		heap_recommit_free_pages(inner, inner_size, decommitted_size, (u8*)meta + chunk_size);
 	}
-	
-	Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)best_fit;
-	meta->size = size;
-	meta->block = best_fit_block;
+
+	meta->size = chunk_size;
+	heap_stats.in_use_bytes += chunk_size;
 #if CONFIGURATION == DEBUG
-	meta->signature = HEAP_META_SIGNATURE;
-	meta->block->total_allocated += size;
+	meta->block->total_allocated += chunk_size;
 #endif
 
 	check_meta(meta);
 
 #if VERY_DEBUG
-	sanity_check_block(meta->block);
+	sanity_check_heap();
 #endif
-	
-	// #Sync #Speed oof
-	spinlock_release(&heap_lock);
-	
-	
+
 	void *p = ((u8*)meta)+sizeof(Heap_Allocation_Metadata);
 	assert((u64)p % HEAP_ALIGNMENT == 0, "Internal heap error. Result pointer is not aligned to HEAP_ALIGNMENT");
 	return p;
 }
-void heap_dealloc(void *p) {
-	// #Sync #Speed oof
-	
-	if (!heap_initted) heap_init();
+// Caller must hold heap_lock
+void _heap_dealloc(Heap_Allocation_Metadata *meta) {
+	void *p = (u8*)meta+sizeof(Heap_Allocation_Metadata);
 
-	spinlock_acquire_or_wait(&heap_lock);
-	
-	assert(is_pointer_in_program_memory(p), "A bad pointer was passed tp heap_dealloc: it is out of program memory bounds!"); 
-	p = (u8*)p-sizeof(Heap_Allocation_Metadata);
-	Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)(p);
-	check_meta(meta);
-	
-	// Yoink meta data before we start overwriting it
-	Heap_Block *block = meta->block;
-	u64 size = meta->size;
-	
+	u64 size = heap_chunk_size(meta);
+
+	heap_stats.in_use_bytes -= size;
 #if CONFIGURATION == DEBUG
-	memset(p, 0x69696969, size);
+	memset(p, 0x69696969, size-sizeof(Heap_Allocation_Metadata));
+	meta->block->total_allocated -= size;
 #endif
-	
-	#if VERY_DEBUG
-		sanity_check_block(block);
-	#endif
-	
-	Heap_Free_Node *new_node = cast(Heap_Free_Node*)p;
-	new_node->size = size;
-	
-	if (new_node < block->free_head) {
-		// #Copypaste
-		void *free_tail = (u8*)new_node + new_node->size;
-		void *next_page = (void*)align_next(new_node, os.page_size);
-		void *last_page_end = (void*)align_previous(free_tail, os.page_size);
-		if ((u8*)last_page_end > (u8*)next_page) {
-			os_lock_program_memory_pages(next_page, (u64)last_page_end-(u64)next_page);
-		}
-		
-		if ((u8*)new_node+size == (u8*)block->free_head) {
-			new_node->size = size + block->free_head->size;
-			new_node->next = block->free_head->next;
-			block->free_head = new_node;
-		} else {
-			new_node->next = block->free_head;
-			block->free_head = new_node;
-		}
-		
-	} else {
-	
-		if (!block->free_head) {
-			block->free_head = new_node;
-			new_node->next = 0;
-			
-			// #Copypaste
-			void *free_tail = (u8*)new_node + new_node->size;
-			void *next_page = (void*)align_next(new_node, os.page_size);
-			void *last_page_end = (void*)align_previous(free_tail, os.page_size);
-			if ((u8*)last_page_end > (u8*)next_page) {
-				os_lock_program_memory_pages(next_page, (u64)last_page_end-(u64)next_page);
-			}
-			
-		} else {
-			Heap_Free_Node *node = block->free_head;
-		
-			while (true) {
-			
-				assert(node != 0, "We didn't find where the free node should be! This is likely heap corruption (or, hopefully not, an internal error)");
-				
-				// In retrospect, I don't remember a good reason to care about where the
-				// free nodes are... maybe I'm just dumb right now? #Speed #Memory
-				// ... ACtually, it's probably to easily know when to merge free nodes.
-				// BUT. Maybe it's not worth the performance hit? Then again, if the heap
-				// allocator slows down your program you should rethink your memory management
-				// anyways...
-				
-				if (new_node >= node) {
-					u8* node_tail = (u8*)node + node->size;
-					if (cast(u8*)new_node == node_tail) {
-						
-						// We need to account for the cases where we coalesce free blocks with start/end in the middle
-						// of a page.
-						
-						u64 new_node_size = new_node->size;
-						
-						// #Copypaste
-						void *free_tail = (u8*)new_node + new_node->size;
-						void *next_page = (void*)align_previous(node_tail, os.page_size);
-						void *last_page_end = (void*)align_previous(free_tail, os.page_size);
-
-						if ((u8*)next_page < (u8*)node) next_page = (u8*)next_page + os.page_size;
-						
-						if ((u8*)last_page_end > (u8*)next_page) {
-							os_lock_program_memory_pages(next_page, (u64)last_page_end-(u64)next_page);
-						}
-						
-						node->size += new_node_size;
-						
-						break;
-					} else {
-						new_node->next = node->next;
-						node->next = new_node;
-						
-						u8* new_node_tail = (u8*)new_node + new_node->size;
-						if (new_node->next && (u8*)new_node->next == new_node_tail) {
-							new_node->size += new_node->next->size;
-							new_node->next = new_node->next->next;
-						}
-						
-						// #Copypaste
-						void *free_tail = (u8*)new_node + new_node->size;
-						void *next_page = (void*)align_next(new_node, os.page_size);
-						void *last_page_end = (void*)align_previous(free_tail, os.page_size);
-						if ((u8*)last_page_end > (u8*)next_page) {
-							os_lock_program_memory_pages(next_page, (u64)last_page_end-(u64)next_page);
-						}
-						
-						break;
-					}
-				}
-				
-				node = node->next;
-			}
-		}
+
+	// Merge with next chunk if it's free. Purged pages stay purged, they are inside the inner
+	// pages of the merged chunk too.
+	u64 decommitted_size = 0;
+	Heap_Allocation_Metadata *next = heap_chunk_next_physical(meta);
+	if (heap_chunk_is_free(next)) {
+		decommitted_size += heap_remove_free_node((Heap_Free_Node*)next);
+		size += heap_chunk_size(next);
 	}
-	
 
-#if CONFIGURATION == DEBUG
-	block->total_allocated -= size;
-#endif
+	// Merge with previous chunk if it's free
+	Heap_Allocation_Metadata *previous = meta->previous_physical;
+	if (previous && heap_chunk_is_free(previous)) {
+		decommitted_size += heap_remove_free_node((Heap_Free_Node*)previous);
+		size += heap_chunk_size(previous);
+		meta = previous;
+	}
+
+	meta->size = size | HEAP_CHUNK_FREE;
+	heap_chunk_next_physical(meta)->previous_physical = meta;
+
+	Heap_Free_Node *new_node = (Heap_Free_Node*)meta;
+	heap_insert_free_node(new_node, decommitted_size);
 
 #if VERY_DEBUG
-	sanity_check_block(block);
+	sanity_check_heap();
 #endif
-	// #Sync #Speed oof
-	spinlock_release(&heap_lock);
 }
 
-void* heap_allocator_proc(u64 size, void *p, Allocator_Message message, void* data) {
-	switch (message) {
-		case ALLOCATOR_ALLOCATE: {
-			return heap_alloc(size);
-			break;
-		}
-		case ALLOCATOR_DEALLOCATE: {
-			heap_dealloc(p);
-			return 0;
-		}
-		case ALLOCATOR_REALLOCATE: {
-			if (!p) {
-				return heap_alloc(size);
-			}
-			assert(is_pointer_valid(p), "Invalid pointer passed to heap allocator reallocate");
-			Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)(((u64)p)-sizeof(Heap_Allocation_Metadata));
+// Caller must hold heap_lock
+// Grows or shrinks the chunk without moving it, by taking from or giving back to the next
+// chunk if that's free. Returns false if there isn't enough room to grow.
+bool _heap_resize(Heap_Allocation_Metadata *meta, u64 size) {
+
+	size += sizeof(Heap_Allocation_Metadata);
+
+	size = align_next(size, HEAP_ALIGNMENT);
+	size = max(size, HEAP_MIN_CHUNK_SIZE);
+
+	u64 old_chunk_size = heap_chunk_size(meta);
+	u64 chunk_size = old_chunk_size;
+
+	Heap_Allocation_Metadata *next = heap_chunk_next_physical(meta);
+	bool next_is_free = heap_chunk_is_free(next);
+
+	if (size > chunk_size + (next_is_free ? heap_chunk_size(next) : 0)) return false;
+
+	if (size <= chunk_size && chunk_size - size < HEAP_MIN_CHUNK_SIZE) return true;
+
+#if VERY_DEBUG
+	sanity_check_heap();
+#endif
+
+	// Swallow the next chunk, whatever we don't need is split back off below
+	void *next_inner = 0;
+	u64 next_inner_size = 0;
+	u64 decommitted_size = 0;
+	if (next_is_free) {
+		next_inner_size = heap_free_node_inner_pages((Heap_Free_Node*)next, &next_inner);
+		decommitted_size = heap_remove_free_node((Heap_Free_Node*)next);
+		chunk_size += heap_chunk_size(next);
+	}
+
+	if (chunk_size - size >= HEAP_MIN_CHUNK_SIZE) {
+		Heap_Free_Node *remainder = (Heap_Free_Node*)((u8*)meta + size);
+		decommitted_size = heap_recommit_free_pages(next_inner, next_inner_size, decommitted_size, (u8*)remainder + sizeof(Heap_Free_Node));
+		remainder->meta.size = (chunk_size - size) | HEAP_CHUNK_FREE;
+		remainder->meta.previous_physical = meta;
+#if CONFIGURATION == DEBUG
+		remainder->meta.block = meta->block;
+		remainder->meta.signature = HEAP_META_SIGNATURE;
+#endif
+		heap_chunk_next_physical(&remainder->meta)->previous_physical = &remainder->meta;
+
+		heap_insert_free_node(remainder, decommitted_size);
+
+		chunk_size = size;
+	} else {
+		heap_recommit_free_pages(next_inner, next_inner_size, decommitted_size, (u8*)meta + chunk_size);
+		// meta->size is still the old size here
+		((Heap_Allocation_Metadata*)((u8*)meta + chunk_size))->previous_physical = meta;
+	}
+
+	meta->size = chunk_size;
+	heap_stats.in_use_bytes += chunk_size;
+	heap_stats.in_use_bytes -= old_chunk_size;
+#if CONFIGURATION == DEBUG
+	meta->block->total_allocated += chunk_size;
+	meta->block->total_allocated -= old_chunk_size;
+#endif
+
+#if VERY_DEBUG
+	sanity_check_heap();
+#endif
+
+	return true;
+}
+// Caller must hold heap_lock
+// Allocates with room to spare, then gives the chunk a new start where the user pointer is
+// aligned and frees the bytes in front of it. The tail is given back with _heap_resize.
+void *_heap_alloc_aligned(u64 size, u64 alignment) {
+	if (alignment <= HEAP_ALIGNMENT) return _heap_alloc(size);
+	
+	u8 *p = (u8*)_heap_alloc(size + alignment + HEAP_MIN_CHUNK_SIZE);
+	Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)(p-sizeof(Heap_Allocation_Metadata));
+	
+	u8 *aligned = (u8*)align_next((u64)p, alignment);
+	if (aligned == p) {
+		_heap_resize(meta, size);
+		return p;
+	}
+	// Front needs to be big enough to be a chunk of its own
+	while ((u64)(aligned-p) < HEAP_MIN_CHUNK_SIZE) aligned += alignment;
+	
+	Heap_Allocation_Metadata *aligned_meta = (Heap_Allocation_Metadata*)(aligned-sizeof(Heap_Allocation_Metadata));
+	u64 front_size = (u8*)aligned_meta-(u8*)meta;
+	u64 chunk_size = heap_chunk_size(meta);
+	
+	aligned_meta->size = chunk_size-front_size;
+	aligned_meta->previous_physical = meta;
+#if CONFIGURATION == DEBUG
+	aligned_meta->block = meta->block;
+	aligned_meta->signature = HEAP_META_SIGNATURE;
+#endif
+	heap_chunk_next_physical(aligned_meta)->previous_physical = aligned_meta;
+	
+	// _heap_dealloc takes the whole front out of the stats, so that leaves the aligned chunk
+	meta->size = front_size;
+	_heap_dealloc(meta);
+	
+	_heap_resize(aligned_meta, size);
+	
+	check_meta(aligned_meta);
+	
+	return aligned;
+}
+
+// Decommits the inside of free chunks, biggest first, if there's more than
+// heap_retained_free_bytes of them. Goes down to half of that so we don't end up purging
+// a little bit every time.
+void heap_purge() {
+	if (!heap_initted) return;
+
+	spinlock_acquire_or_wait(&heap_lock);
+
+	if (heap_stats.free_committed_bytes > heap_retained_free_bytes) {
+		u64 target = heap_retained_free_bytes/2;
+		for (s64 fl = HEAP_FL_COUNT-1; fl >= 0 && heap_stats.free_committed_bytes > target; fl--) {
+			if (!(heap_bins.fl_bitmap & (1ull << fl))) continue;
+			for (s64 sl = HEAP_SL_COUNT-1; sl >= 0 && heap_stats.free_committed_bytes > target; sl--) {
+				Heap_Free_Node *node = heap_bins.free_lists[fl][sl];
+				while (node && heap_stats.free_committed_bytes > target) {
+					void *inner;
+					u64 inner_size = heap_free_node_inner_pages(node, &inner);
+					u64 decommitted_size = (node->meta.size & HEAP_CHUNK_PURGED) ? node->decommitted_size : 0;
+					if (decommitted_size < inner_size) {
+						u64 decommitted = heap_block_set_pages_committed(inner, inner_size, false);
+						assert(decommitted == inner_size-decommitted_size, "Internal heap error: heap stats are out of sync with committed pages");
+						heap_stats.free_committed_bytes -= decommitted;
+						node->decommitted_size = inner_size;
+						node->meta.size |= HEAP_CHUNK_PURGED;
+					}
+					node = node->next;
+				}
+			}
+		}
+	}
+
+#if VERY_DEBUG
+	sanity_check_heap();
+#endif
+
+	spinlock_release(&heap_lock);
+}
+
+Heap_Stats get_heap_stats() {
+	spinlock_acquire_or_wait(&heap_lock);
+	Heap_Stats stats = heap_stats;
+	spinlock_release(&heap_lock);
+	return stats;
+}
+
+///
+// Thread caches
+///
+// Small allocations are served from a per-thread cache so threads don't need to fight over
+// heap_lock for them. Each cache carves fixed-size slots for a size class out of spans, which
+// are regular allocations from the shared heap, so heap_lock is only taken once per span.
+// Each span keeps its own list of free slots, and the cache keeps a list per class of the
+// spans that have any. Freeing a slot on the thread that owns it just pushes it on its span.
+// Freeing it on another thread pushes it on the owner's remote free stack with a
+// compare-and-swap, and the owner takes those back once it runs out of slots in a class.
+// Once all slots in a span are free again and the class has other spans with free slots, the
+// span goes back to the heap so the memory can be used for other sizes.
+// When a thread exits, its cache gives back all its unused spans and is parked (with the spans
+// that are still in use) to be handed to the next thread that needs one, so remote frees
+// always have somewhere to go. #Memory
+
+#define HEAP_CACHE_CLASS_STEP  16
+#define HEAP_CACHE_CLASS_COUNT 16
+#define HEAP_CACHE_MAX_SIZE (HEAP_CACHE_CLASS_STEP*HEAP_CACHE_CLASS_COUNT)
+#define HEAP_CACHE_SPAN_SIZE KB(32)
+
+typedef struct Heap_Cache_Span {
+	Heap_Thread_Cache *owner;
+	// In the owner's list of spans with free slots for this class, if there are any
+	Heap_Cache_Span *next;
+	Heap_Cache_Span *previous;
+	Heap_Cache_Slot *free_slots;
+	u32 free_count;
+	u32 slot_count;
+	u64 class_index;
+} Heap_Cache_Span;
+
+typedef struct Heap_Cache_Slot {
+	Heap_Allocation_Metadata meta; // size is slot size | HEAP_CHUNK_CACHED
+	Heap_Cache_Slot *next;
+} Heap_Cache_Slot;
+
+typedef struct Heap_Thread_Cache {
+	// Spans with free slots. Full spans aren't in any list until one of their slots is freed.
+	Heap_Cache_Span *spans[HEAP_CACHE_CLASS_COUNT];
+	// Heap_Cache_Slot*, pushed by other threads with compare_and_swap_64
+	volatile u64 remote_free_head;
+	Heap_Thread_Cache *next_parked;
+} Heap_Thread_Cache;
+
+// #Global
+ogb_instance Heap_Thread_Cache *heap_parked_thread_caches;
+// Only affects new allocations, slots are always freed back to their cache.
+ogb_instance bool heap_use_thread_caches;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Heap_Thread_Cache *heap_parked_thread_caches = 0;
+bool heap_use_thread_caches = true;
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+thread_local Heap_Thread_Cache *heap_thread_cache = 0;
+
+inline u64 heap_cache_class_index(u64 size) {
+	return size ? (size-1) / HEAP_CACHE_CLASS_STEP : 0;
+}
+inline u64 heap_cache_slot_size(u64 class_index) {
+	return (class_index+1)*HEAP_CACHE_CLASS_STEP + sizeof(Heap_Allocation_Metadata);
+}
+
+Heap_Thread_Cache *heap_get_thread_cache() {
+	if (heap_thread_cache) return heap_thread_cache;
+
+	spinlock_acquire_or_wait(&heap_lock);
+	Heap_Thread_Cache *cache = heap_parked_thread_caches;
+	if (cache) {
+		heap_parked_thread_caches = cache->next_parked;
+	} else {
+		cache = (Heap_Thread_Cache*)_heap_alloc(sizeof(Heap_Thread_Cache));
+		memset(cache, 0, sizeof(Heap_Thread_Cache));
+	}
+	spinlock_release(&heap_lock);
+
+	cache->next_parked = 0;
+	heap_thread_cache = cache;
+	return cache;
+}
+
+void heap_cache_link_span(Heap_Thread_Cache *cache, Heap_Cache_Span *span) {
+	span->previous = 0;
+	span->next = cache->spans[span->class_index];
+	if (span->next) span->next->previous = span;
+	cache->spans[span->class_index] = span;
+}
+void heap_cache_unlink_span(Heap_Thread_Cache *cache, Heap_Cache_Span *span) {
+	if (span->next)     span->next->previous = span->previous;
+	if (span->previous) span->previous->next = span->next;
+	else                cache->spans[span->class_index] = span->next;
+	span->next = 0;
+	span->previous = 0;
+}
+
+// Caller must hold heap_lock
+void _heap_cache_release_span(Heap_Cache_Span *span) {
+	assert(span->free_count == span->slot_count, "Released a thread cache span that is still in use");
+	_heap_dealloc((Heap_Allocation_Metadata*)((u8*)span-sizeof(Heap_Allocation_Metadata)));
+}
+
+Heap_Cache_Span *heap_cache_make_span(Heap_Thread_Cache *cache, u64 class_index) {
+	spinlock_acquire_or_wait(&heap_lock);
+	Heap_Cache_Span *span = (Heap_Cache_Span*)_heap_alloc(HEAP_CACHE_SPAN_SIZE);
+	spinlock_release(&heap_lock);
+
+	u64 slot_size = heap_cache_slot_size(class_index);
+	u64 slot_count = (HEAP_CACHE_SPAN_SIZE-sizeof(Heap_Cache_Span)) / slot_size;
+	u8 *first_slot = (u8*)span + sizeof(Heap_Cache_Span);
+
+	span->owner = cache;
+	span->free_slots = 0;
+	span->free_count = (u32)slot_count;
+	span->slot_count = (u32)slot_count;
+	span->class_index = class_index;
+
+	// Push in reverse so slots are handed out in address order
+	for (s64 i = slot_count-1; i >= 0; i -= 1) {
+		Heap_Cache_Slot *slot = (Heap_Cache_Slot*)(first_slot + i*slot_size);
+		slot->meta.size = slot_size | HEAP_CHUNK_CACHED | HEAP_CHUNK_FREE;
+		slot->meta.span = span;
+#if CONFIGURATION == DEBUG
+		Heap_Allocation_Metadata *span_meta = (Heap_Allocation_Metadata*)((u8*)span-sizeof(Heap_Allocation_Metadata));
+		slot->meta.block = span_meta->block;
+		slot->meta.signature = HEAP_META_SIGNATURE;
+#endif
+		slot->next = span->free_slots;
+		span->free_slots = slot;
+	}
+
+	heap_cache_link_span(cache, span);
+
+	return span;
+}
+
+// Gives a free slot back to its span, and the span back to the heap if nothing in it is used
+// anymore and there are other spans to allocate from in its class.
+void heap_cache_push_slot(Heap_Thread_Cache *cache, Heap_Cache_Slot *slot) {
+	Heap_Cache_Span *span = slot->meta.span;
+
+	slot->next = span->free_slots;
+	span->free_slots = slot;
+	span->free_count += 1;
+
+	if (span->free_count == 1) heap_cache_link_span(cache, span);
+
+	if (span->free_count == span->slot_count && (span->next || span->previous)) {
+		heap_cache_unlink_span(cache, span);
+		spinlock_acquire_or_wait(&heap_lock);
+		_heap_cache_release_span(span);
+		spinlock_release(&heap_lock);
+	}
+}
+
+// Takes back everything other threads have freed to this cache
+void heap_cache_collect_remote_frees(Heap_Thread_Cache *cache) {
+	u64 head;
+	do {
+		head = cache->remote_free_head;
+	} while (head && !compare_and_swap_64(&cache->remote_free_head, 0, head));
+
+	Heap_Cache_Slot *slot = (Heap_Cache_Slot*)head;
+	while (slot) {
+		Heap_Cache_Slot *next = slot->next;
+		heap_cache_push_slot(cache, slot);
+		slot = next;
+	}
+}
+
+// Called when a thread exits
+void heap_thread_cache_release() {
+	Heap_Thread_Cache *cache = heap_thread_cache;
+	if (!cache) return;
+
+	heap_cache_collect_remote_frees(cache);
+
+	spinlock_acquire_or_wait(&heap_lock);
+
+	// Nobody allocates from a parked cache, so none of the unused spans need to stay
+	for (u64 class_index = 0; class_index < HEAP_CACHE_CLASS_COUNT; class_index += 1) {
+		Heap_Cache_Span *span = cache->spans[class_index];
+		while (span) {
+			Heap_Cache_Span *next = span->next;
+			if (span->free_count == span->slot_count) {
+				heap_cache_unlink_span(cache, span);
+				_heap_cache_release_span(span);
+			}
+			span = next;
+		}
+	}
+
+	cache->next_parked = heap_parked_thread_caches;
+	heap_parked_thread_caches = cache;
+	spinlock_release(&heap_lock);
+
+	heap_thread_cache = 0;
+}
+
+void *heap_cache_alloc(u64 size) {
+	Heap_Thread_Cache *cache = heap_get_thread_cache();
+	u64 class_index = heap_cache_class_index(size);
+
+	if (!cache->spans[class_index]) heap_cache_collect_remote_frees(cache);
+
+	Heap_Cache_Span *span = cache->spans[class_index];
+	if (!span) span = heap_cache_make_span(cache, class_index);
+
+	Heap_Cache_Slot *slot = span->free_slots;
+	span->free_slots = slot->next;
+	span->free_count -= 1;
+	if (!span->free_slots) heap_cache_unlink_span(cache, span);
+
+	assert(heap_chunk_is_free(&slot->meta), "Heap thread cache is corrupt");
+	slot->meta.size &= ~HEAP_CHUNK_FREE;
+
+	return (u8*)slot+sizeof(Heap_Allocation_Metadata);
+}
+
+void heap_cache_dealloc(Heap_Allocation_Metadata *meta) {
+	Heap_Cache_Slot *slot = (Heap_Cache_Slot*)meta;
+
+#if CONFIGURATION == DEBUG
+	memset((u8*)slot+sizeof(Heap_Allocation_Metadata), 0x69696969, heap_chunk_size(meta)-sizeof(Heap_Allocation_Metadata));
+#endif
+
+	meta->size |= HEAP_CHUNK_FREE;
+
+	Heap_Thread_Cache *owner = meta->span->owner;
+	if (owner == heap_thread_cache) {
+		heap_cache_push_slot(owner, slot);
+	} else {
+		u64 head;
+		do {
+			head = owner->remote_free_head;
+			slot->next = (Heap_Cache_Slot*)head;
+		} while (!compare_and_swap_64(&owner->remote_free_head, (u64)slot, head));
+	}
+}
+
+///
+// Large allocations
+///
+// Allocations of HEAP_LARGE_ALLOCATION_SIZE or more don't go in heap blocks. Each one gets its
+// own range of program memory pages, with the Heap_Large_Allocation header at the start of the
+// range. For alignments bigger than a cache line, the header is moved further into the range so
+// the memory after it is aligned, and moved back when it's freed. Only the pages in use are
+// committed, the rest of the range is headroom so realloc can grow in place by committing more
+// pages (and shrink by decommitting) instead of copying.
+// On free, everything but the header page is decommitted so the physical memory goes back to
+// the OS, and the address range is kept to be reused by later large allocations.
+// Program memory can't give address ranges back, but it's virtual so that's fine. #Memory
+//
+// Free ranges are kept in a treap ordered by address, where each node also knows the biggest
+// range in its subtree. That way finding the lowest range that fits, and finding the free
+// neighbours of a range to merge with, are all O(log n). Neighbouring free ranges are always
+// merged, and a range that's a lot bigger than needed is split.
+
+#ifndef HEAP_LARGE_ALLOCATION_SIZE
+	#define HEAP_LARGE_ALLOCATION_SIZE MB(1)
+#endif
+
+typedef struct Heap_Large_Allocation {
+	u64 reserved_size;  // Whole page range
+	u64 committed_size; // Committed pages from the start of the range
+	// While in heap_large_free_tree
+	Heap_Large_Allocation *left;
+	Heap_Large_Allocation *right;
+	u64 max_reserved_size_in_subtree;
+	// From the start of the range to this header. Always 0 while in heap_large_free_tree.
+	u64 range_offset;
+	// So the user memory starts on a cache line
+#if CONFIGURATION == DEBUG
+	u64 padding[6];
+#endif
+	Heap_Allocation_Metadata meta; // size is from meta to the end of committed pages | HEAP_CHUNK_LARGE
+} Heap_Large_Allocation;
+
+// #Global
+ogb_instance Heap_Large_Allocation *heap_large_free_tree;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Heap_Large_Allocation *heap_large_free_tree = 0;
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+inline Heap_Large_Allocation *heap_large_from_meta(Heap_Allocation_Metadata *meta) {
+	return (Heap_Large_Allocation*)((u8*)meta - offsetof(Heap_Large_Allocation, meta));
+}
+inline u8 *heap_large_range_start(Heap_Large_Allocation *large) {
+	return (u8*)large - large->range_offset;
+}
+inline u64 heap_large_committed_size(u64 size) {
+	return align_next(sizeof(Heap_Large_Allocation) + size, os.page_size);
+}
+inline u64 heap_large_reserved_size(u64 committed_size) {
+	return align_next(get_next_power_of_two(committed_size), os.page_size);
+}
+
+///
+// Free range treap, caller must hold heap_lock for all of these
+
+// The heap order comes from the address, so we don't need to store a random priority
+inline u64 heap_large_tree_priority(Heap_Large_Allocation *node) {
+	u64 x = (u64)node;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	return x;
+}
+inline void heap_large_tree_update(Heap_Large_Allocation *node) {
+	u64 m = node->reserved_size;
+	if (node->left)  m = max(m, node->left->max_reserved_size_in_subtree);
+	if (node->right) m = max(m, node->right->max_reserved_size_in_subtree);
+	node->max_reserved_size_in_subtree = m;
+}
+// Every node in a must have a lower address than every node in b
+Heap_Large_Allocation *heap_large_tree_join(Heap_Large_Allocation *a, Heap_Large_Allocation *b) {
+	if (!a) return b;
+	if (!b) return a;
+	if (heap_large_tree_priority(a) > heap_large_tree_priority(b)) {
+		a->right = heap_large_tree_join(a->right, b);
+		heap_large_tree_update(a);
+		return a;
+	} else {
+		b->left = heap_large_tree_join(a, b->left);
+		heap_large_tree_update(b);
+		return b;
+	}
+}
+// Nodes below address go in *below, the rest in *rest
+void heap_large_tree_split(Heap_Large_Allocation *node, void *address, Heap_Large_Allocation **below, Heap_Large_Allocation **rest) {
+	if (!node) {
+		*below = 0;
+		*rest = 0;
+	} else if ((u64)node < (u64)address) {
+		heap_large_tree_split(node->right, address, &node->right, rest);
+		heap_large_tree_update(node);
+		*below = node;
+	} else {
+		heap_large_tree_split(node->left, address, below, &node->left);
+		heap_large_tree_update(node);
+		*rest = node;
+	}
+}
+Heap_Large_Allocation *heap_large_tree_pop_lowest(Heap_Large_Allocation **root) {
+	Heap_Large_Allocation *node = *root;
+	if (!node->left) {
+		*root = node->right;
+		return node;
+	}
+	Heap_Large_Allocation *lowest = heap_large_tree_pop_lowest(&node->left);
+	heap_large_tree_update(node);
+	return lowest;
+}
+Heap_Large_Allocation *heap_large_tree_pop_highest(Heap_Large_Allocation **root) {
+	Heap_Large_Allocation *node = *root;
+	if (!node->right) {
+		*root = node->left;
+		return node;
+	}
+	Heap_Large_Allocation *highest = heap_large_tree_pop_highest(&node->right);
+	heap_large_tree_update(node);
+	return highest;
+}
+inline Heap_Large_Allocation *heap_large_tree_lowest(Heap_Large_Allocation *node) {
+	while (node && node->left) node = node->left;
+	return node;
+}
+inline Heap_Large_Allocation *heap_large_tree_highest(Heap_Large_Allocation *node) {
+	while (node && node->right) node = node->right;
+	return node;
+}
+// Lowest address range with at least reserved_size
+Heap_Large_Allocation *heap_large_tree_find_fit(u64 reserved_size) {
+	Heap_Large_Allocation *node = heap_large_free_tree;
+	if (!node || node->max_reserved_size_in_subtree < reserved_size) return 0;
+	while (true) {
+		if (node->left && node->left->max_reserved_size_in_subtree >= reserved_size) {
+			node = node->left;
+		} else if (node->reserved_size >= reserved_size) {
+			return node;
+		} else {
+			node = node->right;
+		}
+	}
+}
+void heap_large_tree_remove(Heap_Large_Allocation *node) {
+	Heap_Large_Allocation *below, *rest, *after;
+	heap_large_tree_split(heap_large_free_tree, node, &below, &rest);
+	Heap_Large_Allocation *removed = heap_large_tree_pop_lowest(&rest);
+	assert(removed == node, "Internal heap error: large range was not in the free tree");
+	after = rest;
+	heap_large_free_tree = heap_large_tree_join(below, after);
+}
+// Merges with free neighbours
+void heap_large_tree_insert(Heap_Large_Allocation *node) {
+	Heap_Large_Allocation *below, *rest;
+	heap_large_tree_split(heap_large_free_tree, node, &below, &rest);
+
+	Heap_Large_Allocation *next = heap_large_tree_lowest(rest);
+	if (next && (u8*)node + node->reserved_size == (u8*)next) {
+		heap_large_tree_pop_lowest(&rest);
+		node->reserved_size += next->reserved_size;
+		heap_decommit_pages(next, next->committed_size);
+	}
+	Heap_Large_Allocation *previous = heap_large_tree_highest(below);
+	if (previous && (u8*)previous + previous->reserved_size == (u8*)node) {
+		heap_large_tree_pop_highest(&below);
+		previous->reserved_size += node->reserved_size;
+		heap_decommit_pages(node, node->committed_size);
+		node = previous;
+	}
+
+	node->left = 0;
+	node->right = 0;
+	heap_large_tree_update(node);
+	heap_large_free_tree = heap_large_tree_join(heap_large_tree_join(below, node), rest);
+}
+
+#if VERY_DEBUG
+u64 sanity_check_large_free_tree(Heap_Large_Allocation *node, Heap_Large_Allocation *low, Heap_Large_Allocation *high) {
+	if (!node) return 0;
+	assert(is_pointer_in_program_memory(node), "Heap large free tree is corrupt");
+	assert(node->meta.size & HEAP_CHUNK_FREE, "Heap large free tree has a range that is not free");
+	assert(node->committed_size == os.page_size, "Free large range is committed");
+	assert(node->range_offset == 0, "Free large range header is not at the start of the range");
+	assert(!low  || (u64)low  + low->reserved_size  <  (u64)node, "Heap large free tree is out of order, or neighbours weren't merged");
+	assert(!high || (u64)node + node->reserved_size <  (u64)high, "Heap large free tree is out of order, or neighbours weren't merged");
+	if (node->left)  assert(heap_large_tree_priority(node->left)  <= heap_large_tree_priority(node), "Heap large free tree priorities are wrong");
+	if (node->right) assert(heap_large_tree_priority(node->right) <= heap_large_tree_priority(node), "Heap large free tree priorities are wrong");
+	u64 m = node->reserved_size;
+	m = max(m, sanity_check_large_free_tree(node->left, low, node));
+	m = max(m, sanity_check_large_free_tree(node->right, node, high));
+	assert(m == node->max_reserved_size_in_subtree, "Heap large free tree max size is wrong");
+	return m;
+}
+#endif
+
+///
+
+// Caller must hold heap_lock
+void heap_large_commit(Heap_Large_Allocation *large, u64 committed_size) {
+	u8 *first = heap_large_range_start(large);
+	if (committed_size > large->committed_size) {
+		heap_commit_pages(first+large->committed_size, committed_size-large->committed_size);
+	} else if (committed_size < large->committed_size) {
+		heap_decommit_pages(first+committed_size, large->committed_size-committed_size);
+	}
+	large->committed_size = committed_size;
+	large->meta.size = (committed_size - large->range_offset - offsetof(Heap_Large_Allocation, meta)) | HEAP_CHUNK_LARGE;
+}
+
+// Caller must hold heap_lock
+// Moves the header to range_offset bytes into the range, which must be committed that far.
+Heap_Large_Allocation *heap_large_move_header(Heap_Large_Allocation *large, u64 range_offset) {
+	Heap_Large_Allocation *moved = (Heap_Large_Allocation*)(heap_large_range_start(large) + range_offset);
+	if (moved == large) return large;
+
+	assert(range_offset + sizeof(Heap_Large_Allocation) <= large->committed_size, "Internal heap error: large allocation header moved past the committed pages");
+	memmove(moved, large, sizeof(Heap_Large_Allocation));
+	moved->range_offset = range_offset;
+	moved->meta.size = (moved->committed_size - range_offset - offsetof(Heap_Large_Allocation, meta)) | (moved->meta.size & HEAP_CHUNK_FLAGS);
+	return moved;
+}
+
+// Caller must hold heap_lock
+// Gives the end of the range back as a free range if it's at least reserved_size
+void heap_large_split_off_tail(Heap_Large_Allocation *large, u64 reserved_size) {
+	if (large->reserved_size < reserved_size + HEAP_LARGE_ALLOCATION_SIZE) return;
+
+	Heap_Large_Allocation *tail = (Heap_Large_Allocation*)(heap_large_range_start(large) + reserved_size);
+	heap_commit_pages(tail, os.page_size);
+	tail->reserved_size = large->reserved_size - reserved_size;
+	tail->committed_size = os.page_size;
+	tail->range_offset = 0;
+	tail->meta.size = (os.page_size - offsetof(Heap_Large_Allocation, meta)) | HEAP_CHUNK_LARGE | HEAP_CHUNK_FREE;
+	tail->meta.previous_physical = 0;
+#if CONFIGURATION == DEBUG
+	tail->meta.block = 0;
+	tail->meta.signature = HEAP_META_SIGNATURE;
+#endif
+	large->reserved_size = reserved_size;
+
+	heap_large_tree_insert(tail);
+}
+
+// Caller must hold heap_lock
+// Ranges start on a page, so for alignments up to a page we know exactly how far in the header
+// needs to go. Bigger alignments depend on where the range ends up, so reserve for the worst case.
+Heap_Allocation_Metadata *heap_large_alloc_aligned(u64 size, u64 alignment) {
+	assert(sizeof(Heap_Large_Allocation) % CACHE_LINE_SIZE == 0, "Internal heap error: large allocations should start on a cache line");
+	u64 max_range_offset = align_next(sizeof(Heap_Large_Allocation), alignment) - sizeof(Heap_Large_Allocation);
+	u64 committed_size = heap_large_committed_size(size + max_range_offset);
+	u64 reserved_size = heap_large_reserved_size(committed_size);
+
+	Heap_Large_Allocation *large = heap_large_tree_find_fit(committed_size);
+
+	if (large) {
+		heap_large_tree_remove(large);
+		heap_large_split_off_tail(large, reserved_size);
+	} else {
+		large = (Heap_Large_Allocation*)os_reserve_next_memory_pages_uncommitted(reserved_size);
+		assert((u64)large % os.page_size == 0, "Large allocation not aligned to page size");
+		heap_commit_pages(large, os.page_size);
+		large->reserved_size = reserved_size;
+		large->committed_size = os.page_size;
+	}
+	large->range_offset = 0;
+
+	heap_large_commit(large, committed_size);
+	u64 range_offset = align_next((u64)large + sizeof(Heap_Large_Allocation), alignment) - sizeof(Heap_Large_Allocation) - (u64)large;
+	assert(range_offset <= max_range_offset, "Internal heap error");
+	large = heap_large_move_header(large, range_offset);
+	heap_stats.in_use_bytes += committed_size;
+	large->left = 0;
+	large->right = 0;
+	large->meta.previous_physical = 0;
+#if CONFIGURATION == DEBUG
+	large->meta.block = 0;
+	large->meta.signature = HEAP_META_SIGNATURE;
+#endif
+
+#if VERY_DEBUG
+	sanity_check_large_free_tree(heap_large_free_tree, 0, 0);
+#endif
+
+	return &large->meta;
+}
+// Caller must hold heap_lock
+Heap_Allocation_Metadata *heap_large_alloc(u64 size) {
+	return heap_large_alloc_aligned(size, CACHE_LINE_SIZE);
+}
+
+// Caller must hold heap_lock
+void heap_large_dealloc(Heap_Allocation_Metadata *meta) {
+	Heap_Large_Allocation *large = heap_large_from_meta(meta);
+
+	heap_stats.in_use_bytes -= large->committed_size;
+
+	// Keep the header page so we can keep track of the range
+	large = heap_large_move_header(large, 0);
+	heap_large_commit(large, os.page_size);
+	large->meta.size |= HEAP_CHUNK_FREE;
+
+	heap_large_tree_insert(large);
+
+#if VERY_DEBUG
+	sanity_check_large_free_tree(heap_large_free_tree, 0, 0);
+#endif
+}
+
+// Caller must hold heap_lock
+// Returns false if it can't be resized in place
+bool heap_large_resize(Heap_Allocation_Metadata *meta, u64 size) {
+	Heap_Large_Allocation *large = heap_large_from_meta(meta);
+	u64 committed_size = heap_large_committed_size(size + large->range_offset);
+
+	if (committed_size > large->reserved_size) {
+		u8 *range_end = heap_large_range_start(large) + large->reserved_size;
+
+		// Take the free range right after if it's enough
+		Heap_Large_Allocation *below, *rest;
+		heap_large_tree_split(heap_large_free_tree, range_end, &below, &rest);
+		Heap_Large_Allocation *next = heap_large_tree_lowest(rest);
+		bool can_take_next = next && (u8*)next == range_end && large->reserved_size + next->reserved_size >= committed_size;
+		if (can_take_next) heap_large_tree_pop_lowest(&rest);
+		heap_large_free_tree = heap_large_tree_join(below, rest);
+
+		if (can_take_next) {
+			large->reserved_size += next->reserved_size;
+			heap_decommit_pages(next, next->committed_size);
+			heap_large_split_off_tail(large, heap_large_reserved_size(committed_size));
+		} else if (range_end == program_memory_next) {
+			// Nothing has been reserved after this range yet, so we can just extend it
+			u64 extra_size = heap_large_reserved_size(committed_size) - large->reserved_size;
+			void *extra = os_reserve_next_memory_pages_uncommitted(extra_size);
+			assert(extra == range_end, "Internal heap error");
+			large->reserved_size += extra_size;
+		} else {
+			return false;
+		}
+	}
+
+	heap_stats.in_use_bytes += committed_size;
+	heap_stats.in_use_bytes -= large->committed_size;
+	heap_large_commit(large, committed_size);
+
+#if VERY_DEBUG
+	sanity_check_large_free_tree(heap_large_free_tree, 0, 0);
+#endif
+
+	return true;
+}
+
+void *heap_alloc(u64 size) {
+
+	if (!heap_initted) heap_init();
+
+	if (size <= HEAP_CACHE_MAX_SIZE && heap_use_thread_caches) {
+		return heap_cache_alloc(size);
+	}
+
+	// #Sync #Speed oof
+	spinlock_acquire_or_wait(&heap_lock);
+	void *p;
+	if (size >= HEAP_LARGE_ALLOCATION_SIZE) {
+		p = (u8*)heap_large_alloc(size) + sizeof(Heap_Allocation_Metadata);
+	} else {
+		p = _heap_alloc(size);
+	}
+	spinlock_release(&heap_lock);
+
+	return p;
+}
+// Large allocations are aligned to CACHE_LINE_SIZE as is, bigger alignments move the header
+// further into the range.
+void *heap_alloc_aligned(u64 size, u64 alignment) {
+
+	if (!heap_initted) heap_init();
+
+	assert(alignment > 0 && (alignment & (alignment-1)) == 0, "Alignment must be a power of 2, got %llu", alignment);
+
+	if (alignment <= HEAP_ALIGNMENT) return heap_alloc(size);
+
+	// #Sync #Speed oof
+	spinlock_acquire_or_wait(&heap_lock);
+	void *p;
+	if (size >= HEAP_LARGE_ALLOCATION_SIZE) {
+		p = (u8*)heap_large_alloc_aligned(size, alignment) + sizeof(Heap_Allocation_Metadata);
+	} else {
+		p = _heap_alloc_aligned(size, alignment);
+	}
+	spinlock_release(&heap_lock);
+
+	assert((u64)p % alignment == 0, "Internal heap error. Result pointer is not aligned to %llu", alignment);
+	return p;
+}
+// Large allocations only have the header page committed while they're free, so everything after
+// that page comes straight from the OS and is already zero.
+void *heap_alloc_zeroed(u64 size) {
+
+	if (!heap_initted) heap_init();
+
+	if (size < HEAP_LARGE_ALLOCATION_SIZE) {
+		void *p = heap_alloc(size);
+		zero_memory_streaming(p, size);
+		return p;
+	}
+
+	// #Sync #Speed oof
+	spinlock_acquire_or_wait(&heap_lock);
+	u8 *p = (u8*)heap_large_alloc(size) + sizeof(Heap_Allocation_Metadata);
+	spinlock_release(&heap_lock);
+
+	u8 *header_page_end = (u8*)align_next((u64)p, os.page_size);
+	memset(p, 0, min(size, (u64)(header_page_end-p)));
+
+#if VERY_DEBUG
+	for (u64 i = 0; i < size; i += os.page_size) {
+		assert(p[i] == 0, "Internal heap error: large allocation pages were not zero");
+	}
+#endif
+
+	return p;
+}
+void heap_dealloc(void *p) {
+
+	if (!heap_initted) heap_init();
+
+	assert(is_pointer_in_program_memory(p), "A bad pointer was passed tp heap_dealloc: it is out of program memory bounds!");
+	Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)((u8*)p-sizeof(Heap_Allocation_Metadata));
+	check_meta(meta);
+
+	if (meta->size & HEAP_CHUNK_CACHED) {
+		heap_cache_dealloc(meta);
+		return;
+	}
+
+	// #Sync #Speed oof
+	spinlock_acquire_or_wait(&heap_lock);
+	if (meta->size & HEAP_CHUNK_LARGE) {
+		heap_large_dealloc(meta);
+	} else {
+		_heap_dealloc(meta);
+	}
+	spinlock_release(&heap_lock);
+}
+
+// Resizes the allocation at p without moving it, if there's room.
+// Returns false if it has to move, in which case the allocation is left as it was.
+bool heap_try_expand(void *p, u64 size) {
+
+	if (!heap_initted) heap_init();
+
+	assert(is_pointer_in_program_memory(p), "A bad pointer was passed tp heap_try_expand: it is out of program memory bounds!");
+	Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)((u8*)p-sizeof(Heap_Allocation_Metadata));
+	check_meta(meta);
+
+	if (meta->size & HEAP_CHUNK_CACHED) {
+		// Slots have a fixed size, but there might be room left in it
+		return size <= heap_chunk_size(meta)-sizeof(Heap_Allocation_Metadata);
+	}
+
+	// #Sync #Speed oof
+	spinlock_acquire_or_wait(&heap_lock);
+	bool resized;
+	if (meta->size & HEAP_CHUNK_LARGE) {
+		resized = heap_large_resize(meta, size);
+	} else {
+		resized = _heap_resize(meta, size);
+	}
+	spinlock_release(&heap_lock);
+
+	return resized;
+}
+
+void* heap_allocator_proc(u64 size, void *p, Allocator_Message message, void* data) {
+	switch (message) {
+		case ALLOCATOR_ALLOCATE: {
+			return heap_alloc(size);
+			break;
+		}
+		case ALLOCATOR_DEALLOCATE: {
+			heap_dealloc(p);
+			return 0;
+		}
+		case ALLOCATOR_REALLOCATE: {
+			if (!p) {
+				return heap_alloc(size);
+			}
+			assert(is_pointer_valid(p), "Invalid pointer passed to heap allocator reallocate");
+			Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)(((u64)p)-sizeof(Heap_Allocation_Metadata));
 			check_meta(meta);
+			// Large allocations that end up small should move back into the heap blocks
+			bool large_to_small = (meta->size & HEAP_CHUNK_LARGE) && size < HEAP_LARGE_ALLOCATION_SIZE;
+			if (!large_to_small && heap_try_expand(p, size)) {
+				return p;
+			}
+			u64 old_size = heap_chunk_size(meta)-sizeof(Heap_Allocation_Metadata);
 			void *new = heap_alloc(size);
-			memcpy(new, p, min(size, meta->size));
+			memcpy(new, p, min(size, old_size));
 			heap_dealloc(p);
 			return new;
 		}
+		case ALLOCATOR_TRY_EXPAND: {
+			return heap_try_expand(p, size) ? p : 0;
+		}
+		case ALLOCATOR_ALLOCATE_ALIGNED: {
+			return heap_alloc_aligned(size, (u64)p);
+		}
+		case ALLOCATOR_ALLOCATE_ZEROED: {
+			return heap_alloc_zeroed(size);
+		}
 	}
 	return 0;
 }
 
 Allocator get_heap_allocator() {
 	Allocator heap_allocator;
-	
+
 	heap_allocator.proc = heap_allocator_proc;
 	heap_allocator.data = 0;
-	
+
 	return heap_allocator;
 }
 
@@ -571,20 +1609,43 @@ Allocator get_heap_allocator() {
 // Temporary storage
 ///
 
+// Each thread has a temporary storage block from the heap, which talloc() bumps through.
+// If that runs out, we either chain on extra chunks from the heap until the next
+// reset_temporary_storage() (default), or wrap around to the start and risk overwriting live
+// temporary memory (temporary_storage_chain_on_overflow = false).
+// Reset also keeps track of the peak usage, and if we chained then the block is grown to fit
+// that peak so the next frame doesn't need to. #Memory
+
 #ifndef TEMPORARY_STORAGE_SIZE
 	#define TEMPORARY_STORAGE_SIZE (1024ULL*1024ULL*2ULL) // 2mb
 #endif
 
+typedef struct Temporary_Storage_Chunk Temporary_Storage_Chunk;
+typedef struct Temporary_Storage_Chunk {
+	Temporary_Storage_Chunk *next;
+	u64 padding; // Keep memory after chunk header 16-byte aligned
+} Temporary_Storage_Chunk;
+
 ogb_instance void* talloc(u64);
+ogb_instance void* talloc_aligned(u64, u64);
 ogb_instance void* temp_allocator_proc(u64 size, void *p, Allocator_Message message, void*);
 
 // #Global
 ogb_instance Allocator 
 get_temporary_allocator();
 
+ogb_instance bool temporary_storage_chain_on_overflow;
+
 #if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+bool temporary_storage_chain_on_overflow = true;
+
 thread_local void * temporary_storage = 0;
 thread_local void * temporary_storage_pointer = 0;
+thread_local void * temporary_storage_end = 0; // End of the block or chunk we're bumping in
+thread_local u64    temporary_storage_size = 0;
+thread_local Temporary_Storage_Chunk * temporary_storage_chunks = 0; // Newest first
+thread_local u64    temporary_storage_used = 0; // Since last reset
+thread_local u64    temporary_storage_peak = 0;
 thread_local bool   has_warned_temporary_storage_overflow = false;
 thread_local Allocator temp_allocator;
 
@@ -601,12 +1662,22 @@ temp_allocator_proc(u64 size, void *p, Allocator_Message message, void* data);
 ogb_instance void 
 temporary_storage_init(u64 arena_size);
 
+ogb_instance void 
+temporary_storage_deinit();
+
 ogb_instance void* 
 talloc(u64 size);
 
+ogb_instance void* 
+talloc_aligned(u64 size, u64 alignment);
+
 ogb_instance void 
 reset_temporary_storage();
 
+// Most bytes talloc'd on this thread between two resets
+ogb_instance u64 
+get_temporary_storage_peak();
+
 
 #if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
 void* temp_allocator_proc(u64 size, void *p, Allocator_Message message, void* data) {
@@ -622,6 +1693,9 @@ void* temp_allocator_proc(u64 size, void *p, Allocator_Message message, void* da
 			panic("Temporary allocator cannot 'reallocate'");
 			return 0;
 		}
+		case ALLOCATOR_ALLOCATE_ALIGNED: {
+			return talloc_aligned(size, (u64)p);
+		}
 	}
 	return 0;
 }
@@ -631,6 +1705,11 @@ void temporary_storage_init(u64 arena_size) {
 	temporary_storage = heap_alloc(arena_size);
 	assert(temporary_storage, "Failed allocating temporary storage");
 	temporary_storage_pointer = temporary_storage;
+	temporary_storage_end = (u8*)temporary_storage + arena_size;
+	temporary_storage_size = arena_size;
+	temporary_storage_chunks = 0;
+	temporary_storage_used = 0;
+	temporary_storage_peak = 0;
 
 	temp_allocator.proc = temp_allocator_proc;
 	temp_allocator.data = 0;
@@ -638,15 +1717,45 @@ void temporary_storage_init(u64 arena_size) {
 	temp_allocator.proc = temp_allocator_proc;
 }
 
+void temporary_storage_free_chunks() {
+	Temporary_Storage_Chunk *chunk = temporary_storage_chunks;
+	while (chunk) {
+		Temporary_Storage_Chunk *next = chunk->next;
+		heap_dealloc(chunk);
+		chunk = next;
+	}
+	temporary_storage_chunks = 0;
+}
+
+void temporary_storage_deinit() {
+	temporary_storage_free_chunks();
+	heap_dealloc(temporary_storage);
+	temporary_storage = 0;
+	temporary_storage_pointer = 0;
+	temporary_storage_end = 0;
+}
+
 void* talloc(u64 size) {
 	
-	assert(size < TEMPORARY_STORAGE_SIZE, "Bruddah this is too large for temp allocator");
-	
 	void* p = temporary_storage_pointer;
 	
 	temporary_storage_pointer = (u8*)temporary_storage_pointer + size;
 	
-	if ((u8*)temporary_storage_pointer >= (u8*)temporary_storage+TEMPORARY_STORAGE_SIZE) {
+	if ((u8*)temporary_storage_pointer > (u8*)temporary_storage_end) {
+		
+		if (temporary_storage_chain_on_overflow) {
+			u64 chunk_size = max(temporary_storage_size, size) + sizeof(Temporary_Storage_Chunk);
+			Temporary_Storage_Chunk *chunk = (Temporary_Storage_Chunk*)heap_alloc(chunk_size);
+			chunk->next = temporary_storage_chunks;
+			temporary_storage_chunks = chunk;
+			
+			temporary_storage_pointer = chunk+1;
+			temporary_storage_end = (u8*)chunk + chunk_size;
+			return talloc(size);
+		}
+		
+		assert(size < temporary_storage_size, "Bruddah this is too large for temp allocator");
+		
 		if (!has_warned_temporary_storage_overflow) {
 			os_write_string_to_stdout(STR("WARNING: temporary storage was overflown, we wrap around at the start.\n"));
 			has_warned_temporary_storage_overflow = true;
@@ -655,44 +1764,183 @@ void* talloc(u64 size) {
 		return talloc(size);;
 	}
 	
+	temporary_storage_used += size;
+	
 	return p;
 }
 
+void* talloc_aligned(u64 size, u64 alignment) {
+	u64 padding = align_next((u64)temporary_storage_pointer, alignment) - (u64)temporary_storage_pointer;
+	
+	if ((u8*)temporary_storage_pointer + padding + size <= (u8*)temporary_storage_end) {
+		return (u8*)talloc(padding + size) + padding;
+	}
+	
+	// We're going to a new chunk or wrapping around, so we don't know the padding up front
+	return (void*)align_next((u64)talloc(size + alignment-1), alignment);
+}
+
 void reset_temporary_storage() {
+	
+	temporary_storage_peak = max(temporary_storage_peak, temporary_storage_used);
+	
+	if (temporary_storage_chunks) {
+		// We had to chain this time, so make the block big enough for it next time
+		temporary_storage_free_chunks();
+		heap_dealloc(temporary_storage);
+		temporary_storage_size = get_next_power_of_two(temporary_storage_used + temporary_storage_used/4);
+		temporary_storage = heap_alloc(temporary_storage_size);
+		assert(temporary_storage, "Failed allocating temporary storage");
+	}
+	
 	temporary_storage_pointer = temporary_storage;	
+	temporary_storage_end = (u8*)temporary_storage + temporary_storage_size;
+	temporary_storage_used = 0;
 	has_warned_temporary_storage_overflow = false;
 }
 
+u64 get_temporary_storage_peak() {
+	return max(temporary_storage_peak, temporary_storage_used);
+}
+
 #endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
 
 
+///
+///
+// Arena
+///
+// Arenas made with make_arena() take a fixed block from the heap.
+// Virtual arenas (make_virtual_arena()) reserve a big range of program memory and only commit
+// pages as they are pushed into, so you can reserve for the worst case, never copy, and only
+// pay for what's actually used. #Memory
+
+#ifndef ARENA_COMMIT_SIZE
+	#define ARENA_COMMIT_SIZE KB(64)
+#endif
+
 typedef struct Arena {
 	void *start;
 	void *next;
 	u64 size;
+	// Bytes from start that are committed. Same as size unless is_virtual.
+	u64 committed;
+	// Most bytes that have been in use at once
+	u64 high_water;
+	// Bytes from start that may have been written to. Committed memory past this is still zero.
+	u64 touched;
+	bool is_virtual;
+	// Give committed pages back to the OS in arena_reset(). Only for virtual arenas.
+	bool decommit_on_reset;
 } Arena;
 
-
+typedef struct Arena_Mark {
+	void *next;
+} Arena_Mark;
 
 // Allocates arena from heap
 Arena make_arena(u64 size) {
 	size = align_next(size, 8);
 	Arena arena;
 	
-	arena.start = alloc(get_heap_allocator(), size);
-	arena.next = arena.start;
-	arena.size = size;
+	arena.start = alloc(get_heap_allocator(), size);
+	arena.next = arena.start;
+	arena.size = size;
+	arena.committed = size;
+	arena.high_water = 0;
+	arena.touched = DO_ZERO_INITIALIZATION ? 0 : size;
+	arena.is_virtual = false;
+	arena.decommit_on_reset = false;
+	
+	return arena;
+}
+
+// Reserves reserve_size bytes of program memory but doesn't commit any of it yet.
+// The address range is never given back, but destroy_virtual_arena() gives back the memory.
+Arena make_virtual_arena(u64 reserve_size) {
+	if (!heap_initted) heap_init();
+	
+	reserve_size = align_next(reserve_size, os.page_size);
+	
+	// os_reserve_next_memory_pages is not thread safe, the heap uses it too
+	spinlock_acquire_or_wait(&heap_lock);
+	void *start = os_reserve_next_memory_pages_uncommitted(reserve_size);
+	spinlock_release(&heap_lock);
+	
+	Arena arena;
+	arena.start = start;
+	arena.next = start;
+	arena.size = reserve_size;
+	arena.committed = 0;
+	arena.high_water = 0;
+	arena.touched = 0;
+	arena.is_virtual = true;
+	arena.decommit_on_reset = false;
 	
 	return arena;
 }
+void destroy_virtual_arena(Arena *arena) {
+	assert(arena->is_virtual, "destroy_virtual_arena() was called on an arena that is not virtual");
+	os_decommit_program_memory_pages(arena->start, arena->committed);
+	arena->next = arena->start;
+	arena->committed = 0;
+	arena->touched = 0;
+}
+
+void arena_commit(Arena *arena, u64 used) {
+	assert(arena->is_virtual, "Internal error: non-virtual arenas are always committed");
+	u64 committed = min(align_next(used, ARENA_COMMIT_SIZE), arena->size);
+	committed = align_next(committed, os.page_size);
+	bool ok = os_commit_program_memory_pages((u8*)arena->start+arena->committed, committed-arena->committed);
+	assert(ok, "Out of memory: failed committing arena pages");
+	arena->committed = committed;
+}
 
 void *arena_push(Arena *arena, u64 size) {
 	void *p = arena->next;
+	u64 used = ((u8*)arena->next - (u8*)arena->start) + size;
+	assert(used <= arena->size, "Arena is out of space. It's %llu bytes, %llu are used and %llu more were pushed.", arena->size, used-size, size);
+	if (used > arena->committed) arena_commit(arena, used);
 	arena->next = (u8*)arena->next + size;
+	arena->high_water = max(arena->high_water, used);
+	arena->touched = max(arena->touched, used);
 	return p;
 }
 #define arena_push_struct(parena, type) arena_push((parena), sizeof(type))
 
+// Only clears what has been used before, pages committed after that are already zero
+void *arena_push_zeroed(Arena *arena, u64 size) {
+	u64 offset = (u8*)arena->next - (u8*)arena->start;
+	u64 touched = arena->touched;
+	void *p = arena_push(arena, size);
+	if (offset < touched) zero_memory_streaming(p, min(size, touched-offset));
+	return p;
+}
+
+void *arena_push_aligned(Arena *arena, u64 size, u64 alignment) {
+	u64 padding = align_next((u64)arena->next, alignment) - (u64)arena->next;
+	return (u8*)arena_push(arena, padding + size) + padding;
+}
+
+Arena_Mark arena_get_mark(Arena *arena) {
+	Arena_Mark mark;
+	mark.next = arena->next;
+	return mark;
+}
+// Everything pushed after the mark was taken is gone
+void arena_rewind(Arena *arena, Arena_Mark mark) {
+	assert((u64)mark.next >= (u64)arena->start && (u64)mark.next <= (u64)arena->next, "Invalid arena mark. It's either from a different arena, or it's from after the arena was rewound past it.");
+	arena->next = mark.next;
+}
+void arena_reset(Arena *arena) {
+	arena->next = arena->start;
+	if (arena->is_virtual && arena->decommit_on_reset) {
+		os_decommit_program_memory_pages(arena->start, arena->committed);
+		arena->committed = 0;
+		arena->touched = 0;
+	}
+}
+
 void* arena_allocator_proc(u64 size, void *p, Allocator_Message message, void* data) {
 	if (size > 8) size = align_next(size, 8);
 	Arena *arena = (Arena*)data;
@@ -707,6 +1955,12 @@ void* arena_allocator_proc(u64 size, void *p, Allocator_Message message, void* d
 			panic("Arena allocator cannot 'reallocate'");
 			return 0;
 		}
+		case ALLOCATOR_ALLOCATE_ALIGNED: {
+			return arena_push_aligned(arena, size, (u64)p);
+		}
+		case ALLOCATOR_ALLOCATE_ZEROED: {
+			return arena_push_zeroed(arena, size);
+		}
 	}
 	return 0;
 }
@@ -720,6 +1974,11 @@ Allocator make_arena_allocator(u64 size) {
 	arena->start = (u8*)mem + sizeof(Arena);
 	arena->next = arena->start;
 	arena->size = size;
+	arena->committed = size;
+	arena->high_water = 0;
+	arena->touched = DO_ZERO_INITIALIZATION ? 0 : size;
+	arena->is_virtual = false;
+	arena->decommit_on_reset = false;
 	
 	Allocator allocator;
 	allocator.data = arena;
@@ -735,6 +1994,21 @@ Allocator make_arena_allocator_with_memory(u64 size, void *p) {
 	arena->start = p;
 	arena->next = arena->start;
 	arena->size = size;
+	arena->committed = size;
+	arena->high_water = 0;
+	arena->touched = size;
+	arena->is_virtual = false;
+	arena->decommit_on_reset = false;
+	
+	Allocator allocator;
+	allocator.data = arena;
+	allocator.proc = arena_allocator_proc;
+	
+	return allocator;
+}
+Allocator make_virtual_arena_allocator(u64 reserve_size) {
+	Arena *arena = (Arena*)alloc(get_heap_allocator(), sizeof(Arena));
+	*arena = make_virtual_arena(reserve_size);
 	
 	Allocator allocator;
 	allocator.data = arena;
@@ -749,3 +2023,712 @@ Allocator make_arena_allocator_from_arena(Arena *arena) {
 	
 	return allocator;
 }
+
+///
+///
+// Scratch arenas
+///
+// Each thread has SCRATCH_ARENA_COUNT virtual arenas for temporary work that shouldn't live
+// until reset_temporary_storage(), like the inside of a long running loop:
+//
+//     Scratch scratch = scratch_begin();
+//     string s = sprint(scratch.allocator, STR("%d"), 69);
+//     ...
+//     scratch_end(scratch); // Everything allocated since scratch_begin() is gone
+//
+// Begin/end nest. If a function gets an allocator that might itself be a scratch arena and
+// also needs temporaries, use scratch_begin_avoiding(that_allocator) so the temporaries don't
+// end up in the same arena and get freed out from under the caller (or the other way around).
+// When a thread exits its scratch arenas are decommitted and parked for the next thread.
+
+#define SCRATCH_ARENA_COUNT 2
+#ifndef SCRATCH_ARENA_SIZE
+	#define SCRATCH_ARENA_SIZE MB(64) // Reserved, only what's used is committed
+#endif
+
+typedef struct Scratch_Arenas Scratch_Arenas;
+typedef struct Scratch_Arenas {
+	Arena arenas[SCRATCH_ARENA_COUNT];
+	Scratch_Arenas *next_parked;
+} Scratch_Arenas;
+
+typedef struct Scratch {
+	Arena *arena;
+	Allocator allocator; // Allocates in arena
+	Arena_Mark mark;
+} Scratch;
+
+// #Global
+ogb_instance Scratch_Arenas *parked_scratch_arenas;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Scratch_Arenas *parked_scratch_arenas = 0;
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+thread_local Scratch_Arenas *scratch_arenas = 0;
+
+Scratch_Arenas *get_scratch_arenas() {
+	if (scratch_arenas) return scratch_arenas;
+
+	if (!heap_initted) heap_init();
+
+	spinlock_acquire_or_wait(&heap_lock);
+	Scratch_Arenas *arenas = parked_scratch_arenas;
+	if (arenas) parked_scratch_arenas = arenas->next_parked;
+	spinlock_release(&heap_lock);
+
+	if (!arenas) {
+		arenas = (Scratch_Arenas*)alloc(get_heap_allocator(), sizeof(Scratch_Arenas));
+		for (u64 i = 0; i < SCRATCH_ARENA_COUNT; i++) {
+			arenas->arenas[i] = make_virtual_arena(SCRATCH_ARENA_SIZE);
+		}
+	}
+
+	arenas->next_parked = 0;
+	scratch_arenas = arenas;
+	return arenas;
+}
+
+// Called when a thread exits
+void scratch_arenas_release() {
+	if (!scratch_arenas) return;
+
+	for (u64 i = 0; i < SCRATCH_ARENA_COUNT; i++) {
+		Arena *arena = &scratch_arenas->arenas[i];
+		assert(arena->next == arena->start, "Thread exited with a scratch_begin() that was never ended");
+		os_decommit_program_memory_pages(arena->start, arena->committed);
+		arena->committed = 0;
+		arena->touched = 0;
+	}
+
+	spinlock_acquire_or_wait(&heap_lock);
+	scratch_arenas->next_parked = parked_scratch_arenas;
+	parked_scratch_arenas = scratch_arenas;
+	spinlock_release(&heap_lock);
+
+	scratch_arenas = 0;
+}
+
+Scratch scratch_begin_in_arena(Arena *arena) {
+	Scratch scratch;
+	scratch.arena = arena;
+	scratch.allocator = make_arena_allocator_from_arena(arena);
+	scratch.mark = arena_get_mark(arena);
+	return scratch;
+}
+
+Scratch scratch_begin() {
+	return scratch_begin_in_arena(&get_scratch_arenas()->arenas[0]);
+}
+// Gives a scratch arena that is not the one conflict allocates in
+Scratch scratch_begin_avoiding(Allocator conflict) {
+	Scratch_Arenas *arenas = get_scratch_arenas();
+	for (u64 i = 0; i < SCRATCH_ARENA_COUNT; i++) {
+		if (conflict.data != &arenas->arenas[i]) return scratch_begin_in_arena(&arenas->arenas[i]);
+	}
+	panic("Internal error: no scratch arena left that doesn't conflict");
+	return scratch_begin();
+}
+
+void scratch_end(Scratch scratch) {
+	arena_rewind(scratch.arena, scratch.mark);
+}
+
+///
+///
+// Pool allocator
+///
+// For lots of objects of the same size. Slots are carved out of slabs, which are allocated
+// with slab_allocator (heap by default) and aligned to the cache line. Free slots store the
+// free list link in themselves, so alloc & dealloc just pop & push the free list.
+// Slabs are only given back in destroy_pool().
+// The thread safe variant (make_thread_safe_pool) takes a spinlock around pop & push.
+
+typedef struct Pool_Slot Pool_Slot;
+typedef struct Pool_Slot {
+	Pool_Slot *next;
+} Pool_Slot;
+
+typedef struct Pool_Slab Pool_Slab;
+typedef struct Pool_Slab {
+	Pool_Slab *next;
+	void *allocation; // Not aligned, for dealloc
+} Pool_Slab;
+
+typedef struct Pool {
+	u64 slot_size;
+	u64 slots_per_slab;
+	Allocator slab_allocator;
+	
+	Pool_Slot *free_list;
+	Pool_Slab *slabs;
+	
+	u64 slab_count;
+	u64 allocated_count; // Slots currently in use
+	
+	bool thread_safe;
+	Spinlock lock;
+} Pool;
+
+// slot_size is rounded up to 16 bytes
+Pool make_pool(u64 slot_size, u64 slots_per_slab) {
+	assert(slot_size > 0, "Pool slot size must be more than 0");
+	assert(slots_per_slab > 0, "Pool needs at least 1 slot per slab");
+	
+	Pool pool = ZERO(Pool);
+	pool.slot_size = align_next(max(slot_size, sizeof(Pool_Slot)), 16);
+	pool.slots_per_slab = slots_per_slab;
+	pool.slab_allocator = get_heap_allocator();
+	spinlock_init(&pool.lock);
+	
+	return pool;
+}
+Pool make_thread_safe_pool(u64 slot_size, u64 slots_per_slab) {
+	Pool pool = make_pool(slot_size, slots_per_slab);
+	pool.thread_safe = true;
+	return pool;
+}
+void destroy_pool(Pool *pool) {
+	Pool_Slab *slab = pool->slabs;
+	while (slab) {
+		Pool_Slab *next = slab->next;
+		dealloc(pool->slab_allocator, slab->allocation);
+		slab = next;
+	}
+	pool->slabs = 0;
+	pool->free_list = 0;
+	pool->slab_count = 0;
+	pool->allocated_count = 0;
+}
+
+// Caller must hold pool->lock if thread safe
+void pool_add_slab(Pool *pool) {
+	// The header gets its own cache line so the slots start on one too
+	u64 slab_size = CACHE_LINE_SIZE + pool->slot_size*pool->slots_per_slab;
+	void *allocation = alloc_uninitialized(pool->slab_allocator, slab_size + CACHE_LINE_SIZE-1);
+	
+	Pool_Slab *slab = (Pool_Slab*)align_next((u64)allocation, CACHE_LINE_SIZE);
+	slab->allocation = allocation;
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	pool->slab_count += 1;
+	
+	// Link back to front so slots are handed out in address order
+	u8 *first_slot = (u8*)slab + CACHE_LINE_SIZE;
+	for (s64 i = (s64)pool->slots_per_slab-1; i >= 0; i--) {
+		Pool_Slot *slot = (Pool_Slot*)(first_slot + i*pool->slot_size);
+		slot->next = pool->free_list;
+		pool->free_list = slot;
+	}
+}
+
+#if VERY_DEBUG
+void pool_check_pointer(Pool *pool, void *p) {
+	Pool_Slab *slab = pool->slabs;
+	while (slab) {
+		u8 *first_slot = (u8*)slab + CACHE_LINE_SIZE;
+		if ((u8*)p >= first_slot && (u8*)p < first_slot + pool->slot_size*pool->slots_per_slab) {
+			assert(((u8*)p - first_slot) % pool->slot_size == 0, "Pointer passed to pool_dealloc is not the start of a slot");
+			return;
+		}
+		slab = slab->next;
+	}
+	panic("Pointer passed to pool_dealloc was not allocated in this pool");
+}
+#endif
+
+void *pool_alloc(Pool *pool) {
+	if (pool->thread_safe) spinlock_acquire_or_wait(&pool->lock);
+	
+	if (!pool->free_list) pool_add_slab(pool);
+	
+	Pool_Slot *slot = pool->free_list;
+	pool->free_list = slot->next;
+	pool->allocated_count += 1;
+	
+	if (pool->thread_safe) spinlock_release(&pool->lock);
+	
+	return slot;
+}
+void pool_dealloc(Pool *pool, void *p) {
+	assert(p != 0, "You tried to deallocate a pointer at adress 0. That doesn't make sense!");
+	
+#if CONFIGURATION == DEBUG
+	memset(p, 0x69, pool->slot_size);
+#endif
+	
+	if (pool->thread_safe) spinlock_acquire_or_wait(&pool->lock);
+	
+#if VERY_DEBUG
+	pool_check_pointer(pool, p);
+#endif
+	
+	assert(pool->allocated_count > 0, "pool_dealloc() was called more times than pool_alloc()");
+	
+	Pool_Slot *slot = (Pool_Slot*)p;
+	slot->next = pool->free_list;
+	pool->free_list = slot;
+	pool->allocated_count -= 1;
+	
+	if (pool->thread_safe) spinlock_release(&pool->lock);
+}
+
+void* pool_allocator_proc(u64 size, void *p, Allocator_Message message, void* data) {
+	Pool *pool = (Pool*)data;
+	switch (message) {
+		case ALLOCATOR_ALLOCATE: {
+			assert(size <= pool->slot_size, "Pool allocator can't allocate %llu bytes, slots are %llu bytes", size, pool->slot_size);
+			return pool_alloc(pool);
+		}
+		case ALLOCATOR_DEALLOCATE: {
+			pool_dealloc(pool, p);
+			return 0;
+		}
+		case ALLOCATOR_REALLOCATE: {
+			if (!p) return pool_allocator_proc(size, p, ALLOCATOR_ALLOCATE, data);
+			assert(size <= pool->slot_size, "Pool allocator can't reallocate to %llu bytes, slots are %llu bytes", size, pool->slot_size);
+			return p;
+		}
+		case ALLOCATOR_TRY_EXPAND: {
+			return size <= pool->slot_size ? p : 0;
+		}
+		case ALLOCATOR_ALLOCATE_ALIGNED: {
+			// Slots start on a cache line in each slab, so they're aligned to whatever the slot size is a multiple of
+			u64 alignment = (u64)p;
+			assert(alignment <= CACHE_LINE_SIZE && pool->slot_size % alignment == 0, "Pool slots of %llu bytes can't be aligned to %llu. Make the slot size a multiple of the alignment (up to CACHE_LINE_SIZE).", pool->slot_size, alignment);
+			return pool_allocator_proc(size, 0, ALLOCATOR_ALLOCATE, data);
+		}
+	}
+	return 0;
+}
+
+// Allocates pool from heap
+Allocator make_pool_allocator(u64 slot_size, u64 slots_per_slab) {
+	Pool *pool = (Pool*)alloc(get_heap_allocator(), sizeof(Pool));
+	*pool = make_pool(slot_size, slots_per_slab);
+	
+	Allocator allocator;
+	allocator.data = pool;
+	allocator.proc = pool_allocator_proc;
+	
+	return allocator;
+}
+// Allocates pool from heap
+Allocator make_thread_safe_pool_allocator(u64 slot_size, u64 slots_per_slab) {
+	Pool *pool = (Pool*)alloc(get_heap_allocator(), sizeof(Pool));
+	*pool = make_thread_safe_pool(slot_size, slots_per_slab);
+	
+	Allocator allocator;
+	allocator.data = pool;
+	allocator.proc = pool_allocator_proc;
+	
+	return allocator;
+}
+Allocator make_pool_allocator_from_pool(Pool *pool) {
+	Allocator allocator;
+	allocator.data = pool;
+	allocator.proc = pool_allocator_proc;
+	
+	return allocator;
+}
+
+///
+///
+// Memory tags
+///
+
+// A tagged allocator wraps another allocator and counts everything it allocates towards a tag,
+// so you can see how much memory each part of the program is using.
+// Each allocation gets a 16 byte header with its size & tag, so we know what to subtract on
+// dealloc. The engine tags its own memory (fonts, images, audio, draw frames, particles,
+// profiler), and you can use MEMORY_TAG_GAME or your own tags from MEMORY_TAG_USER_FIRST and up.
+//
+//     Allocator level_allocator = get_tagged_heap_allocator(MEMORY_TAG_GAME);
+//     set_memory_tag_budget(MEMORY_TAG_AUDIO, MB(64)); // Logs a warning when it goes over
+//     draw_text(font, tprint_memory_usage(), 24, v2(-600, 300), v2(1, 1), COLOR_WHITE);
+
+typedef enum Memory_Tag {
+	MEMORY_TAG_GAME,
+	MEMORY_TAG_FONT,
+	MEMORY_TAG_IMAGES,
+	MEMORY_TAG_AUDIO,
+	MEMORY_TAG_DRAW_FRAME,
+	MEMORY_TAG_PARTICLES,
+	MEMORY_TAG_PROFILER,
+	
+	MEMORY_TAG_USER_FIRST,
+	
+	MEMORY_TAG_MAX = 32,
+} Memory_Tag;
+
+typedef struct Memory_Tag_Stats {
+	u64 current; // Bytes, not including the headers
+	u64 peak;
+	u64 allocation_count;
+	u64 budget; // 0 if none
+} Memory_Tag_Stats;
+
+typedef struct Tagged_Allocator {
+	Allocator parent;
+	Memory_Tag tag;
+} Tagged_Allocator;
+
+typedef struct Memory_Tag_Header {
+	u64 size;
+	u32 offset; // From the start of the parent allocation to the user memory
+	u32 tag;
+} Memory_Tag_Header;
+
+// Own cache line each so threads allocating with different tags don't fight
+typedef struct alignat(64) Memory_Tag_State {
+	volatile u64 current;
+	volatile u64 peak;
+	volatile u64 allocation_count;
+	u64 budget;
+	volatile bool over_budget;
+	string name; // Set with set_memory_tag_name
+} Memory_Tag_State;
+
+// #Global
+ogb_instance Memory_Tag_State memory_tags[MEMORY_TAG_MAX];
+ogb_instance Tagged_Allocator tagged_heap_allocators[MEMORY_TAG_MAX];
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Memory_Tag_State memory_tags[MEMORY_TAG_MAX];
+Tagged_Allocator tagged_heap_allocators[MEMORY_TAG_MAX];
+#endif
+
+string get_memory_tag_name(Memory_Tag tag) {
+	assert(tag < MEMORY_TAG_MAX, "Invalid memory tag %d", tag);
+	if (memory_tags[tag].name.count) return memory_tags[tag].name;
+	switch (tag) {
+		case MEMORY_TAG_GAME:       return STR("game");
+		case MEMORY_TAG_FONT:       return STR("font");
+		case MEMORY_TAG_IMAGES:     return STR("images");
+		case MEMORY_TAG_AUDIO:      return STR("audio");
+		case MEMORY_TAG_DRAW_FRAME: return STR("draw frame");
+		case MEMORY_TAG_PARTICLES:  return STR("particles");
+		case MEMORY_TAG_PROFILER:   return STR("profiler");
+		default:                    return tprint("tag %d", tag);
+	}
+}
+
+void memory_tag_add(Memory_Tag tag, s64 size, s64 count) {
+	Memory_Tag_State *state = &memory_tags[tag];
+	
+	// Just stats, so no ordering with other memory needed
+	u64 current = atomic_fetch_add_relaxed_64(&state->current, (u64)size) + (u64)size;
+	atomic_fetch_add_relaxed_64(&state->allocation_count, (u64)count);
+	
+	if (size <= 0) {
+		if (state->over_budget && current <= state->budget) state->over_budget = false;
+		return;
+	}
+	
+	u64 peak = state->peak;
+	while (current > peak && !compare_and_swap_64(&state->peak, current, peak)) {
+		peak = state->peak;
+	}
+	
+	if (state->budget && current > state->budget && compare_and_swap_bool(&state->over_budget, true, false)) {
+		log_warning("Memory tag '%s' went over its budget of %llu bytes (%llu bytes)", get_memory_tag_name(tag), state->budget, current);
+	}
+}
+
+void* tagged_allocator_proc(u64 size, void *p, Allocator_Message message, void* data) {
+	// Copy it, it might be inside the memory we're deallocating
+	Tagged_Allocator tagged = *(Tagged_Allocator*)data;
+	Allocator parent = tagged.parent;
+	
+	switch (message) {
+		case ALLOCATOR_ALLOCATE:
+		case ALLOCATOR_ALLOCATE_ZEROED:
+		case ALLOCATOR_ALLOCATE_ALIGNED: {
+			u64 offset = sizeof(Memory_Tag_Header);
+			u8 *base;
+			if (message == ALLOCATOR_ALLOCATE_ALIGNED) {
+				offset = max((u64)p, sizeof(Memory_Tag_Header));
+				base = (u8*)parent.proc(size+offset, (void*)offset, message, parent.data);
+			} else {
+				base = (u8*)parent.proc(size+offset, 0, message, parent.data);
+			}
+			if (!base) return 0;
+			
+			Memory_Tag_Header *header = (Memory_Tag_Header*)(base+offset)-1;
+			header->size = size;
+			header->offset = (u32)offset;
+			header->tag = tagged.tag;
+			memory_tag_add(tagged.tag, (s64)size, 1);
+			
+			return base+offset;
+		}
+		case ALLOCATOR_DEALLOCATE: {
+			Memory_Tag_Header *header = (Memory_Tag_Header*)p-1;
+			memory_tag_add((Memory_Tag)header->tag, -(s64)header->size, -1);
+			parent.proc(0, (u8*)p-header->offset, ALLOCATOR_DEALLOCATE, parent.data);
+			return 0;
+		}
+		case ALLOCATOR_REALLOCATE: {
+			if (!p) return tagged_allocator_proc(size, 0, ALLOCATOR_ALLOCATE, data);
+			Memory_Tag_Header *header = (Memory_Tag_Header*)p-1;
+			u64 old_size = header->size;
+			u64 offset = header->offset;
+			Memory_Tag tag = (Memory_Tag)header->tag;
+			
+			u8 *base = (u8*)parent.proc(size+offset, (u8*)p-offset, ALLOCATOR_REALLOCATE, parent.data);
+			
+			header = (Memory_Tag_Header*)(base+offset)-1;
+			header->size = size;
+			memory_tag_add(tag, (s64)size-(s64)old_size, 0);
+			
+			return base+offset;
+		}
+		case ALLOCATOR_TRY_EXPAND: {
+			Memory_Tag_Header *header = (Memory_Tag_Header*)p-1;
+			if (!parent.proc(size+header->offset, (u8*)p-header->offset, ALLOCATOR_TRY_EXPAND, parent.data)) return 0;
+			memory_tag_add((Memory_Tag)header->tag, (s64)size-(s64)header->size, 0);
+			header->size = size;
+			return p;
+		}
+	}
+	return 0;
+}
+
+// t needs to live as long as the allocator is used
+Allocator make_tagged_allocator_in_place(Tagged_Allocator *t, Allocator parent, Memory_Tag tag) {
+	assert(tag < MEMORY_TAG_MAX, "Invalid memory tag %d", tag);
+	t->parent = parent;
+	t->tag = tag;
+	
+	Allocator allocator;
+	allocator.data = t;
+	allocator.proc = tagged_allocator_proc;
+	
+	return allocator;
+}
+// Allocates the Tagged_Allocator from heap
+Allocator make_tagged_allocator(Allocator parent, Memory_Tag tag) {
+	Tagged_Allocator *t = (Tagged_Allocator*)alloc(get_heap_allocator(), sizeof(Tagged_Allocator));
+	return make_tagged_allocator_in_place(t, parent, tag);
+}
+Allocator get_tagged_heap_allocator(Memory_Tag tag) {
+	// Always written with the same values, so it doesn't matter if threads race on it
+	return make_tagged_allocator_in_place(&tagged_heap_allocators[tag], get_heap_allocator(), tag);
+}
+// For engine code which should honor the context allocator. If that is already tagged, the
+// memory is counted towards that tag instead. Otherwise the tagged allocator is made in
+// storage, which has to stay around for as long as the allocator is used (i.e. in the struct
+// that owns the memory, like Draw_Frame).
+Allocator get_tagged_context_allocator(Memory_Tag tag, Tagged_Allocator *storage) {
+	Allocator parent = get_context_allocator();
+	if (parent.proc == heap_allocator_proc) return get_tagged_heap_allocator(tag);
+	if (parent.proc == tagged_allocator_proc) return parent;
+	
+	return make_tagged_allocator_in_place(storage, parent, tag);
+}
+
+Memory_Tag_Stats get_memory_tag_stats(Memory_Tag tag) {
+	assert(tag < MEMORY_TAG_MAX, "Invalid memory tag %d", tag);
+	Memory_Tag_Stats stats;
+	stats.current = memory_tags[tag].current;
+	stats.peak = memory_tags[tag].peak;
+	stats.allocation_count = memory_tags[tag].allocation_count;
+	stats.budget = memory_tags[tag].budget;
+	return stats;
+}
+// 0 for no budget
+void set_memory_tag_budget(Memory_Tag tag, u64 budget) {
+	assert(tag < MEMORY_TAG_MAX, "Invalid memory tag %d", tag);
+	memory_tags[tag].budget = budget;
+	memory_tags[tag].over_budget = false;
+}
+// For your own tags, name is not copied
+void set_memory_tag_name(Memory_Tag tag, string name) {
+	assert(tag < MEMORY_TAG_MAX, "Invalid memory tag %d", tag);
+	memory_tags[tag].name = name;
+}
+void reset_memory_tag_peak(Memory_Tag tag) {
+	assert(tag < MEMORY_TAG_MAX, "Invalid memory tag %d", tag);
+	memory_tags[tag].peak = memory_tags[tag].current;
+}
+
+// One line per tag that has been used, allocated with temp allocator
+string tprint_memory_usage() {
+	String_Builder b;
+	string_builder_init_reserve(&b, 1024, get_temporary_allocator());
+	
+	for (u64 i = 0; i < MEMORY_TAG_MAX; i++) {
+		Memory_Tag_Stats stats = get_memory_tag_stats((Memory_Tag)i);
+		if (stats.peak == 0 && stats.budget == 0) continue;
+		
+		string_builder_print(&b, STR("%s: %.2f mb"), get_memory_tag_name((Memory_Tag)i), (f64)stats.current/(f64)MB(1));
+		if (stats.budget) string_builder_print(&b, STR(" / %.2f mb"), (f64)stats.budget/(f64)MB(1));
+		string_builder_print(&b, STR(" (peak %.2f mb, %llu allocations)\n"), (f64)stats.peak/(f64)MB(1), stats.allocation_count);
+	}
+	
+	return string_builder_get_string(b);
+}
+
+///
+///
+// Allocation profiler
+///
+
+// Every allocation_profiler_sample_interval'th allocation through alloc() & co on a thread
+// grabs the stack and counts it towards its call site. A site is the stack + the allocator.
+// Nothing is tracked on dealloc, so this tells you where allocations come from and how much,
+// not what's leaking.
+// dump_allocation_profile() writes the sites to allocation_profile.txt, biggest first.
+// It's called at exit if ENABLE_ALLOCATION_PROFILING.
+
+#ifndef ALLOCATION_PROFILER_SAMPLE_INTERVAL
+	#define ALLOCATION_PROFILER_SAMPLE_INTERVAL 128
+#endif
+#define ALLOCATION_PROFILER_MAX_FRAMES 16
+#define ALLOCATION_PROFILER_MAX_SITES 4096 // Must be power of 2
+
+typedef struct Allocation_Site {
+	u64 hash; // 0 if slot is unused
+	Allocator_Proc allocator_proc;
+	u64 frame_count;
+	void *frames[ALLOCATION_PROFILER_MAX_FRAMES];
+	u64 sample_count;
+	u64 sampled_bytes;
+	u64 largest_size;
+} Allocation_Site;
+
+typedef struct Allocation_Profiler {
+	Allocation_Site *sites;
+	u64 site_count;
+	u64 sample_count;
+	u64 dropped_sample_count; // Ran out of sites
+	Spinlock lock;
+} Allocation_Profiler;
+
+// #Global
+ogb_instance Allocation_Profiler allocation_profiler;
+ogb_instance u64 allocation_profiler_sample_interval;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Allocation_Profiler allocation_profiler = {0};
+u64 allocation_profiler_sample_interval = ALLOCATION_PROFILER_SAMPLE_INTERVAL;
+#endif
+
+#if ENABLE_ALLOCATION_PROFILING
+
+void allocation_profiler_sample(Allocator allocator, u64 size) {
+	allocation_profiler_countdown = (s64)allocation_profiler_sample_interval-1;
+	
+	void *frames[ALLOCATION_PROFILER_MAX_FRAMES];
+	u64 frame_count = os_capture_stack_trace(frames, ALLOCATION_PROFILER_MAX_FRAMES, 1);
+	
+	u64 hash = xx_hash((u64)allocator.proc);
+	for (u64 i = 0; i < frame_count; i++) hash = xx_hash(hash ^ (u64)frames[i]);
+	if (hash == 0) hash = 1;
+	
+	spinlock_acquire_or_wait(&allocation_profiler.lock);
+	
+	if (!allocation_profiler.sites) {
+		// Not alloc(), that would sample
+		u64 sites_size = sizeof(Allocation_Site)*ALLOCATION_PROFILER_MAX_SITES;
+		allocation_profiler.sites = (Allocation_Site*)heap_alloc(sites_size);
+		memset(allocation_profiler.sites, 0, sites_size);
+	}
+	
+	allocation_profiler.sample_count += 1;
+	
+	Allocation_Site *site = 0;
+	for (u64 probe = 0; probe < ALLOCATION_PROFILER_MAX_SITES; probe++) {
+		Allocation_Site *s = &allocation_profiler.sites[(hash+probe) & (ALLOCATION_PROFILER_MAX_SITES-1)];
+		if (s->hash == hash && s->allocator_proc == allocator.proc && s->frame_count == frame_count
+			&& memcmp(s->frames, frames, frame_count*sizeof(void*)) == 0) {
+			site = s;
+			break;
+		}
+		if (s->hash == 0) {
+			// Keep the probes short, better to drop a few samples
+			if (allocation_profiler.site_count >= ALLOCATION_PROFILER_MAX_SITES/4*3) break;
+			s->hash = hash;
+			s->allocator_proc = allocator.proc;
+			s->frame_count = frame_count;
+			memcpy(s->frames, frames, frame_count*sizeof(void*));
+			allocation_profiler.site_count += 1;
+			site = s;
+			break;
+		}
+	}
+	
+	if (site) {
+		site->sample_count += 1;
+		site->sampled_bytes += size;
+		site->largest_size = max(site->largest_size, size);
+	} else {
+		allocation_profiler.dropped_sample_count += 1;
+	}
+	
+	spinlock_release(&allocation_profiler.lock);
+}
+
+string get_allocator_proc_name(Allocator_Proc proc) {
+	if (proc == heap_allocator_proc)           return STR("heap");
+	if (proc == temp_allocator_proc)           return STR("temporary");
+	if (proc == arena_allocator_proc)          return STR("arena");
+	if (proc == pool_allocator_proc)           return STR("pool");
+	if (proc == initialization_allocator_proc) return STR("initialization");
+	if (proc == tagged_allocator_proc)         return STR("tagged");
+	return STR("other");
+}
+
+int compare_allocation_sites(const void *a, const void *b) {
+	Allocation_Site *site_a = *(Allocation_Site**)a;
+	Allocation_Site *site_b = *(Allocation_Site**)b;
+	if (site_a->sampled_bytes == site_b->sampled_bytes) return 0;
+	return site_a->sampled_bytes > site_b->sampled_bytes ? -1 : 1;
+}
+
+void dump_allocation_profile() {
+	Scratch scratch = scratch_begin();
+	
+	// Copy it out so we don't hold the lock while allocating (which would sample)
+	spinlock_acquire_or_wait(&allocation_profiler.lock);
+	u64 site_count = allocation_profiler.site_count;
+	u64 sample_count = allocation_profiler.sample_count;
+	u64 dropped_sample_count = allocation_profiler.dropped_sample_count;
+	Allocation_Site *sites = (Allocation_Site*)arena_push(scratch.arena, max(site_count, 1)*sizeof(Allocation_Site));
+	u64 n = 0;
+	for (u64 i = 0; allocation_profiler.sites && i < ALLOCATION_PROFILER_MAX_SITES; i++) {
+		if (allocation_profiler.sites[i].hash) sites[n++] = allocation_profiler.sites[i];
+	}
+	spinlock_release(&allocation_profiler.lock);
+	
+	Allocation_Site **sorted = (Allocation_Site**)alloc(scratch.allocator, max(site_count, 1)*sizeof(Allocation_Site*));
+	Allocation_Site **help = (Allocation_Site**)alloc(scratch.allocator, max(site_count, 1)*sizeof(Allocation_Site*));
+	for (u64 i = 0; i < site_count; i++) sorted[i] = &sites[i];
+	merge_sort(sorted, help, site_count, sizeof(Allocation_Site*), compare_allocation_sites);
+	
+	u64 interval = allocation_profiler_sample_interval;
+	
+	String_Builder b;
+	string_builder_init_reserve(&b, KB(64), scratch.allocator);
+	string_builder_print(&b, STR("Allocation profile: 1 in %llu allocations were sampled.\n"), interval);
+	string_builder_print(&b, STR("%llu samples, %llu dropped, %llu call sites. Counts and bytes are estimates (samples * %llu).\n"), sample_count, dropped_sample_count, site_count, interval);
+	
+	for (u64 i = 0; i < site_count; i++) {
+		Allocation_Site *site = sorted[i];
+		string_builder_print(&b, STR("\n#%llu: ~%llu allocations, ~%llu kb, largest sampled %llu bytes, %s allocator\n"),
+			i+1, site->sample_count*interval, (site->sampled_bytes*interval)/1024, site->largest_size, get_allocator_proc_name(site->allocator_proc));
+		
+		string *symbols = os_get_stack_trace_symbols(site->frames, site->frame_count, scratch.allocator);
+		for (u64 j = 0; j < site->frame_count; j++) {
+			string_builder_print(&b, STR("\t%s\n"), symbols[j]);
+		}
+	}
+	
+	os_write_entire_file_s(STR("allocation_profile.txt"), string_builder_get_string(b));
+	
+	log_verbose("Wrote allocation profile to allocation_profile.txt");
+	
+	scratch_end(scratch);
+}
+
+#endif // ENABLE_ALLOCATION_PROFILING
@@ -126,6 +126,22 @@
 					tm_scope_var
 					tm_scope_accum
 					
+		- ENABLE_ALLOCATION_PROFILING
+			Sample 1 in allocation_profiler_sample_interval allocations made through an Allocator
+			and dump where they came from to allocation_profile.txt at exit.
+			This is cheap enough to leave on in playtest builds.
+		
+			0: Disable
+			1: Enable
+			
+			Example:
+			
+				#define ENABLE_ALLOCATION_PROFILING 1
+				
+			Note:
+				In release builds there are no symbols, so call sites are printed as offsets
+				into the executable which you can look up in the .pdb or .map file.
+					
 		- OOGABOOGA_HEADLESS
             Run oogabooga in headless mode, i.e. no window, no graphics, no audio.
             Useful if you only need the oogabooga standard library for something like a game server.
@@ -219,6 +235,10 @@ typedef u8 bool;
 	#define ENABLE_SIMD 1
 #endif
 
+#ifndef ENABLE_ALLOCATION_PROFILING
+	#define ENABLE_ALLOCATION_PROFILING 0
+#endif
+
 #ifndef INITIAL_PROGRAM_MEMORY_SIZE
     #define INITIAL_PROGRAM_MEMORY_SIZE MB(5)
 #endif
@@ -328,10 +348,12 @@ typedef u8 bool;
 
 #include "concurrency.c"
 
-#include "profiling.c"
 #include "random.c"
 #include "color.c"
 #include "memory.c"
+#include "profiling.c"
+#include "string_interner.c"
+#include "jobs.c"
 #include "input.c"
 
 #ifndef OOGABOOGA_HEADLESS
@@ -413,10 +435,15 @@ void oogabooga_init(u64 program_memory_size) {
 	Cpu_Capabilities features = query_cpu_capabilities();
 	os_init(program_memory_size);
 	heap_init();
+	context.allocator = get_heap_allocator();
 	temporary_storage_init(TEMPORARY_STORAGE_SIZE);
+	string_interner_init();
+	job_system_init(0);
 	log_info("Ooga booga version is %d.%02d.%03d", OGB_VERSION_MAJOR, OGB_VERSION_MINOR, OGB_VERSION_PATCH);
 #ifndef OOGABOOGA_HEADLESS
 	gfx_init();
+	cached_images_init();
+	cached_fonts_init();
 #else
     log_info("Headless mode on");
 #endif
@@ -471,6 +498,12 @@ int main(int argc, char **argv) {
 	
 	dump_profile_result();
 	
+#endif
+
+#if ENABLE_ALLOCATION_PROFILING
+
+	dump_allocation_profile();
+
 #endif
 	
 	// This is so any threads waiting for window to close will close on exit
@@ -21,6 +21,10 @@
 #define VIRTUAL_MEMORY_BASE ((void*)0x0000690000000000ULL)
 void* heap_alloc(u64);
 void heap_dealloc(void*);
+void heap_thread_cache_release();
+void temporary_storage_deinit();
+void scratch_arenas_release();
+void heap_purge();
 
 u16 *win32_fixed_utf8_to_null_terminated_wide(string utf8, Allocator allocator) {
 
@@ -476,7 +480,7 @@ void os_init(u64 program_memory_capacity) {
     os_thread_start(&audio_thread);
     os_thread_start(&audio_poll_default_device_thread);
     
-    while (!win32_has_audio_thread_started) { os_yield_thread(); }
+    while (!atomic_load_acquire_bool(&win32_has_audio_thread_started)) { os_yield_thread(); }
 #endif /* NOT OOGABOOGA_HEADLESS */
 
 
@@ -618,7 +622,9 @@ DWORD WINAPI win32_thread_invoker(LPVOID param) {
 	
 	t->proc(t);
 	
-	heap_dealloc(temporary_storage);
+	temporary_storage_deinit();
+	scratch_arenas_release();
+	heap_thread_cache_release();
 	
 	return 0;
 }
@@ -742,6 +748,19 @@ void os_binary_semaphore_signal(Binary_Semaphore *sem) {
 	SetEvent(sem->os_event);
 }
 
+void os_wait_on_address(volatile void *address, void *compare, u64 size) {
+	assert(size == 1 || size == 2 || size == 4 || size == 8, "Invalid size %llu for os_wait_on_address", size);
+	WaitOnAddress(address, compare, (SIZE_T)size, INFINITE);
+}
+
+void os_wake_one_on_address(volatile void *address) {
+	WakeByAddressSingle((PVOID)address);
+}
+
+void os_wake_all_on_address(volatile void *address) {
+	WakeByAddressAll((PVOID)address);
+}
+
 
 void os_sleep(u32 ms) {
     Sleep(ms);
@@ -1235,6 +1254,41 @@ os_get_number_of_logical_processors() {
 ///
 #define WIN32_MAX_STACK_FRAMES 64
 #define WIN32_MAX_SYMBOL_NAME_LENGTH 256
+#if CONFIGURATION == DEBUG
+string
+win32_get_symbol_string(HANDLE process, DWORD64 address, Allocator allocator) {
+    DWORD64 displacement = 0;
+    char buffer[sizeof(SYMBOL_INFO) + WIN32_MAX_SYMBOL_NAME_LENGTH * sizeof(TCHAR)];
+    PSYMBOL_INFO symbol = (PSYMBOL_INFO)buffer;
+    symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+    symbol->MaxNameLen = WIN32_MAX_SYMBOL_NAME_LENGTH;
+
+    string s;
+    if (SymFromAddr(process, address, &displacement, symbol)) {
+        IMAGEHLP_LINE64 line;
+        DWORD displacement_line;
+        line.SizeOfStruct = sizeof(IMAGEHLP_LINE64);
+
+        char *result;
+        if (SymGetLineFromAddr64(process, address, &displacement_line, &line)) {
+            u64 length = (u64)(symbol->NameLen + strlen(line.FileName) + 50);
+            result = (char *)alloc(allocator, length);
+            format_string_to_buffer_va(result, length, "%cs:%d: %cs", line.FileName, line.LineNumber, symbol->Name);
+        } else {
+            u64 length = (u64)(symbol->NameLen + 1);
+            result = (char *)alloc(allocator, length);
+            memcpy(result, symbol->Name, symbol->NameLen + 1);
+        }
+        s.data = (u8 *)result;
+        s.count = strlen(result);
+    } else {
+        s.data = (u8 *)alloc(allocator, 32);
+        s.count = format_string_to_buffer_va((char *)s.data, 32, "0x%llx", address);
+    }
+    return s;
+}
+#endif // DEBUG
+
 string *
 os_get_stack_trace(u64 *trace_count, Allocator allocator) {
 #if CONFIGURATION == DEBUG
@@ -1285,35 +1339,8 @@ os_get_stack_trace(u64 *trace_count, Allocator allocator) {
             break;
         }
 
-        DWORD64 displacement = 0;
-        char buffer[sizeof(SYMBOL_INFO) + WIN32_MAX_SYMBOL_NAME_LENGTH * sizeof(TCHAR)];
-        PSYMBOL_INFO symbol = (PSYMBOL_INFO)buffer;
-        symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
-        symbol->MaxNameLen = WIN32_MAX_SYMBOL_NAME_LENGTH;
-
-        if (SymFromAddr(process, stack.AddrPC.Offset, &displacement, symbol)) {
-            IMAGEHLP_LINE64 line;
-            DWORD displacement_line;
-            line.SizeOfStruct = sizeof(IMAGEHLP_LINE64);
-
-            char *result;
-            if (SymGetLineFromAddr64(process, stack.AddrPC.Offset, &displacement_line, &line)) {
-                u64 length = (u64)(symbol->NameLen + strlen(line.FileName) + 50);
-                result = (char *)alloc(allocator, length);
-                format_string_to_buffer_va(result, length, "%cs:%d: %cs", line.FileName, line.LineNumber, symbol->Name);
-            } else {
-                u64 length = (u64)(symbol->NameLen + 1);
-                result = (char *)alloc(allocator, length);
-                memcpy(result, symbol->Name, symbol->NameLen + 1);
-            }
-            stack_strings[*trace_count].data = (u8 *)result;
-            stack_strings[*trace_count].count = strlen(result);
-            (*trace_count)++;
-        } else {
-            stack_strings[*trace_count].data = (u8 *)alloc(allocator, 32);
-            stack_strings[*trace_count].count = format_string_to_buffer_va((char *)stack_strings[*trace_count].data, 32, "0x%llx", stack.AddrPC.Offset);
-            (*trace_count)++;
-        }
+        stack_strings[*trace_count] = win32_get_symbol_string(process, stack.AddrPC.Offset, allocator);
+        (*trace_count)++;
     }
 
     return stack_strings;
@@ -1330,6 +1357,31 @@ os_get_stack_trace(u64 *trace_count, Allocator allocator) {
 #endif // NOT DEBUG
 }
 
+u64
+os_capture_stack_trace(void **frames, u64 max_frames, u64 frames_to_skip) {
+	// +1 for this function
+	return (u64)RtlCaptureStackBackTrace((DWORD)(frames_to_skip+1), (DWORD)max_frames, frames, 0);
+}
+
+string *
+os_get_stack_trace_symbols(void **frames, u64 frame_count, Allocator allocator) {
+	string *strings = (string *)alloc(allocator, max(frame_count, 1) * sizeof(string));
+#if CONFIGURATION == DEBUG
+	HANDLE process = GetCurrentProcess();
+	for (u64 i = 0; i < frame_count; i++) {
+		strings[i] = win32_get_symbol_string(process, (DWORD64)frames[i], allocator);
+	}
+#else
+	// Look these up in the .pdb/.map
+	u64 module_base = (u64)GetModuleHandleW(0);
+	for (u64 i = 0; i < frame_count; i++) {
+		strings[i].data = (u8 *)alloc(allocator, 32);
+		strings[i].count = format_string_to_buffer_va((char *)strings[i].data, 32, "exe+0x%llx", (u64)frames[i]-module_base);
+	}
+#endif
+	return strings;
+}
+
 bool os_grow_program_memory(u64 new_size) {
 	os_lock_mutex(program_memory_mutex); // #Sync
 	if (program_memory_capacity >= new_size) {
@@ -1349,18 +1401,14 @@ bool os_grow_program_memory(u64 new_size) {
 		u64 aligned_size = align_next(new_size, os.granularity);
 		void *aligned_base = (void*)align_next(VIRTUAL_MEMORY_BASE, os.granularity);
 
-		program_memory = VirtualAlloc(aligned_base, aligned_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		// Only reserved, pages are committed in os_reserve_next_memory_pages
+		program_memory = VirtualAlloc(aligned_base, aligned_size, MEM_RESERVE, PAGE_READWRITE);
 		if (program_memory == 0) { 
 			os_unlock_mutex(program_memory_mutex); // #Sync
 			return false;
 		}
 		program_memory_next = program_memory;
 		program_memory_capacity = aligned_size;
-#if CONFIGURATION == DEBUG
-		memset(program_memory, 0xBA, program_memory_capacity);
-        DWORD _ = PAGE_READWRITE;
-		VirtualProtect(aligned_base, aligned_size, PAGE_NOACCESS, &_);
-#endif
 	} else {
 		void* tail = (u8*)program_memory + program_memory_capacity;
 		
@@ -1370,12 +1418,7 @@ bool os_grow_program_memory(u64 new_size) {
 		u64 amount_to_allocate = align_next(new_size-program_memory_capacity, os.granularity);
 		
 		// Just keep allocating at the tail of the current chunk
-		void* result = VirtualAlloc(tail, amount_to_allocate, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
-#if CONFIGURATION == DEBUG
-		memset(result, 0xBA, amount_to_allocate);
-		DWORD _ = PAGE_READWRITE;
-		VirtualProtect(tail, amount_to_allocate, PAGE_NOACCESS, &_);
-#endif
+		void* result = VirtualAlloc(tail, amount_to_allocate, MEM_RESERVE, PAGE_READWRITE);
 		if (result == 0) { 
 			os_unlock_mutex(program_memory_mutex); // #Sync
 			return false;
@@ -1398,8 +1441,8 @@ bool os_grow_program_memory(u64 new_size) {
 }
 
 void*
-os_reserve_next_memory_pages(u64 size) {
-	assert(size % os.page_size == 0, "size was not aligned to page size in os_reserve_next_memory_pages");
+os_reserve_next_memory_pages_uncommitted(u64 size) {
+	assert(size % os.page_size == 0, "size was not aligned to page size in os_reserve_next_memory_pages_uncommitted");
 
 	void *p = program_memory_next;
 	
@@ -1423,6 +1466,23 @@ os_reserve_next_memory_pages(u64 size) {
 	return p;
 }
 
+void*
+os_reserve_next_memory_pages(u64 size) {
+	assert(size % os.page_size == 0, "size was not aligned to page size in os_reserve_next_memory_pages");
+
+	void *p = os_reserve_next_memory_pages_uncommitted(size);
+	
+	bool ok = os_commit_program_memory_pages(p, size);
+	assert(ok, "OS is not letting us commit more memory. Maybe we are out of memory? You sure must be using a lot of memory then.");
+	
+#if CONFIGURATION == DEBUG
+	memset(p, 0xBA, size);
+	os_lock_program_memory_pages(p, size);
+#endif
+	
+	return p;
+}
+
 void
 os_unlock_program_memory_pages(void *start, u64 size) {
 #if CONFIGURATION == DEBUG
@@ -1455,6 +1515,56 @@ os_lock_program_memory_pages(void *start, u64 size) {
 #endif
 }
 
+void
+os_decommit_program_memory_pages(void *start, u64 size) {
+	assert((u64)start % os.page_size == 0, "When decommitting memory pages, the start address must be the start of a page");
+	assert(size       % os.page_size == 0, "When decommitting memory pages, the size must be aligned to page_size");
+	
+	// The pages may be across multiple allocated regions, and VirtualFree can only decommit
+	// within one, so we go one run of pages with the same state at a time.
+	u8 *p = (u8*)start;
+	u8 *end = (u8*)start + size;
+	while (p < end) {
+		MEMORY_BASIC_INFORMATION mbi;
+		SIZE_T ok = VirtualQuery(p, &mbi, sizeof(mbi));
+		assert(ok, "VirtualQuery Failed with error %d", GetLastError());
+		
+		u8 *run_end = min((u8*)mbi.BaseAddress + mbi.RegionSize, end);
+		if (mbi.State == MEM_COMMIT) {
+			BOOL freed = VirtualFree(p, (SIZE_T)(run_end-p), MEM_DECOMMIT);
+			assert(freed, "VirtualFree Failed with error %d", GetLastError());
+		}
+		p = run_end;
+	}
+}
+
+bool
+os_commit_program_memory_pages(void *start, u64 size) {
+	assert((u64)start % os.page_size == 0, "When committing memory pages, the start address must be the start of a page");
+	assert(size       % os.page_size == 0, "When committing memory pages, the size must be aligned to page_size");
+	
+	// #Copypaste from os_decommit_program_memory_pages
+	u8 *p = (u8*)start;
+	u8 *end = (u8*)start + size;
+	while (p < end) {
+		MEMORY_BASIC_INFORMATION mbi;
+		SIZE_T ok = VirtualQuery(p, &mbi, sizeof(mbi));
+		assert(ok, "VirtualQuery Failed with error %d", GetLastError());
+		
+		u8 *run_end = min((u8*)mbi.BaseAddress + mbi.RegionSize, end);
+		if (mbi.State == MEM_COMMIT) {
+			// Might be locked
+			DWORD old_protect;
+			VirtualProtect(p, (SIZE_T)(run_end-p), PAGE_READWRITE, &old_protect);
+		} else {
+			void *result = VirtualAlloc(p, (SIZE_T)(run_end-p), MEM_COMMIT, PAGE_READWRITE);
+			if (!result) return false;
+		}
+		p = run_end;
+	}
+	return true;
+}
+
 ///
 ///
 // Mouse pointer
@@ -1728,7 +1838,7 @@ win32_audio_init() {
 
 void
 win32_audio_poll_default_device_thread(Thread *t) {
-	while (!win32_has_audio_thread_started) {
+	while (!atomic_load_acquire_bool(&win32_has_audio_thread_started)) {
 		os_yield_thread();
 	}
 
@@ -1773,7 +1883,7 @@ win32_audio_thread(Thread *t) {
 	mutex_init(&audio_init_mutex);
 	
     mutex_acquire_or_wait(&audio_init_mutex);
-    win32_has_audio_thread_started = true;
+    atomic_store_release_bool(&win32_has_audio_thread_started, true);
 	win32_audio_init();
     mutex_release(&audio_init_mutex);
 	
@@ -1930,6 +2040,9 @@ void os_update() {
 	}
 
 	has_os_update_been_called_at_all = true;
+	
+	// End of frame, give back free memory that's over the budget
+	heap_purge();
 
 	win32_do_handle_raw_input = true;
 #ifndef OOGABOOGA_HEADLESS
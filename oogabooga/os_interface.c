@@ -188,6 +188,20 @@ os_binary_semaphore_wait(Binary_Semaphore *sem);
 void ogb_instance
 os_binary_semaphore_signal(Binary_Semaphore *sem);
 
+///
+// Wait on address
+// Sleeps the thread while the size (1, 2, 4 or 8) bytes at address are equal to the ones at
+// compare, until another thread wakes it. Can return without being woken, so check again.
+// For building your own locks, Mutex in concurrency.c is built on this.
+void ogb_instance
+os_wait_on_address(volatile void *address, void *compare, u64 size);
+
+void ogb_instance
+os_wake_one_on_address(volatile void *address);
+
+void ogb_instance
+os_wake_all_on_address(volatile void *address);
+
 ///
 // Threading utilities
 
@@ -442,6 +456,15 @@ os_get_number_of_logical_processors();
 ogb_instance string*
 os_get_stack_trace(u64 *trace_count, Allocator allocator);
 
+// Only grabs the return addresses, which is cheap enough to do often. Symbols can be looked up
+// later with os_get_stack_trace_symbols. Returns number of frames written.
+ogb_instance u64
+os_capture_stack_trace(void **frames, u64 max_frames, u64 frames_to_skip);
+
+// In release there are no symbols, so it's the addresses relative to the executable.
+ogb_instance string*
+os_get_stack_trace_symbols(void **frames, u64 frame_count, Allocator allocator);
+
 inline void 
 dump_stack_trace() {
 	u64 count;
@@ -481,12 +504,26 @@ os_grow_program_memory(size_t new_size);
 // - Pages will be locked (Win32 PAGE_NOACCESS) so you need to unlock with os_unlock_program_memory_pages() before use.
 ogb_instance void*
 os_reserve_next_memory_pages(u64 size);
+// Same as os_reserve_next_memory_pages() but the pages are not committed, so they don't cost
+// any memory until you os_commit_program_memory_pages() them.
+ogb_instance void*
+os_reserve_next_memory_pages_uncommitted(u64 size);
 
 void ogb_instance
 os_unlock_program_memory_pages(void *start, u64 size);
 void ogb_instance
 os_lock_program_memory_pages(void *start, u64 size);
 
+// Gives the physical memory behind program memory pages back to the OS. The address range
+// stays reserved, so call os_commit_program_memory_pages() before touching it again.
+// - start and size must be aligned to os.page_size
+void ogb_instance
+os_decommit_program_memory_pages(void *start, u64 size);
+// Commits pages so they can be used (unlocked). Returns false if the OS is out of memory.
+// - start and size must be aligned to os.page_size
+bool ogb_instance
+os_commit_program_memory_pages(void *start, u64 size);
+
 ///
 ///
 // Mouse pointer
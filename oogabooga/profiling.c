@@ -27,7 +27,7 @@ void _profiler_report_time(string name, f64 count, f64 start) {
 		spinlock_init(&_profiler_lock);
 		profiler_initted = true;
 		
-		string_builder_init_reserve(&_profile_output, 1024*1000, get_heap_allocator());	
+		string_builder_init_reserve(&_profile_output, 1024*1000, get_tagged_heap_allocator(MEMORY_TAG_PROFILER));	
 		
 	}
 	
@@ -800,3 +800,35 @@ inline void basic_rsqrt_float32_512(float32 *a, float32 *result) {
     basic_rsqrt_float32_256(a+8, result+8);
 }
 
+
+// Clears with non-temporal stores when it's big enough that it would just push everything else
+// out of the cache. Smaller clears are left to memset, that memory is probably about to be used.
+#ifndef STREAMING_ZERO_THRESHOLD
+	#define STREAMING_ZERO_THRESHOLD (256ULL*1024ULL)
+#endif
+void zero_memory_streaming(void *p, u64 size) {
+#if ENABLE_SIMD && SIMD_ENABLE_SSE2
+	if (size >= STREAMING_ZERO_THRESHOLD) {
+		u8 *start = (u8*)p;
+		u8 *end = start + size;
+		u8 *first_line = (u8*)align_next((u64)start, 64);
+		u8 *last_line = (u8*)align_previous((u64)end, 64);
+		
+		memset(start, 0, first_line-start);
+		
+		__m128i zero = _mm_setzero_si128();
+		for (u8 *line = first_line; line < last_line; line += 64) {
+			_mm_stream_si128((__m128i*)(line +  0), zero);
+			_mm_stream_si128((__m128i*)(line + 16), zero);
+			_mm_stream_si128((__m128i*)(line + 32), zero);
+			_mm_stream_si128((__m128i*)(line + 48), zero);
+		}
+		// Streaming stores are weakly ordered
+		_mm_sfence();
+		
+		memset(last_line, 0, end-last_line);
+		return;
+	}
+#endif
+	memset(p, 0, size);
+}
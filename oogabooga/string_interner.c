@@ -0,0 +1,181 @@
+
+///
+///
+// String interning
+///
+// Every distinct string gets a small id (Atom) that stays the same for the rest of the
+// program. Comparing two atoms is comparing two integers, and the hash is computed once when
+// the string is interned. Good for asset paths, names & identifiers that are looked up a lot.
+/*
+
+	Atom player_sprite = intern_string(STR("res/player.png"));
+	...
+	if (entity->sprite == player_sprite) { ... }
+	string path = atom_get_string(entity->sprite);
+
+*/
+// The interned strings are copied into an arena & never freed, so don't intern strings that
+// are only used once (like formatted text).
+// Atom 0 is the empty string, so a zero initialized Atom is valid.
+// All functions are thread safe.
+
+#ifndef STRING_INTERNER_MAX_ATOMS
+	#define STRING_INTERNER_MAX_ATOMS (1 << 20)
+#endif
+#ifndef STRING_INTERNER_MAX_BYTES
+	#define STRING_INTERNER_MAX_BYTES MB(64)
+#endif
+
+typedef u32 Atom;
+
+#define ATOM_EMPTY 0
+
+typedef struct Interned_String {
+	string str;
+	u64 hash;
+	// Older atom with the same 64-bit hash, or 0
+	Atom next_with_same_hash;
+} Interned_String;
+
+typedef struct String_Interner {
+	// u64 hash -> newest Atom with that hash. Only the shards are used, so lookups can walk
+	// the collision chain under the shard lock.
+	Concurrent_Hash_Table atoms_by_hash;
+
+	// Entries & string data are pushed to virtual arenas, so they never move and atom_get_string()
+	// doesn't need a lock.
+	Arena entry_arena;
+	Arena string_arena;
+	Interned_String *entries;
+	volatile u32 count;
+	Spinlock arena_lock;
+
+	bool initted;
+} String_Interner;
+
+// #Global
+ogb_instance String_Interner string_interner;
+
+ogb_instance void
+string_interner_init();
+
+// Returns the atom for s, adding a copy of it if it's new.
+ogb_instance Atom
+intern_string(string s);
+
+// Like intern_string(), but returns false instead of adding s if it's not interned yet.
+ogb_instance bool
+find_interned_string(string s, Atom *atom);
+
+ogb_instance string
+atom_get_string(Atom atom);
+
+ogb_instance u64
+atom_get_hash(Atom atom);
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+String_Interner string_interner = {0};
+
+void
+string_interner_init() {
+	if (string_interner.initted) return;
+
+	string_interner.atoms_by_hash = make_concurrent_hash_table(u64, Atom, get_heap_allocator());
+	string_interner.entry_arena  = make_virtual_arena(sizeof(Interned_String)*STRING_INTERNER_MAX_ATOMS);
+	string_interner.string_arena = make_virtual_arena(STRING_INTERNER_MAX_BYTES);
+	string_interner.entries = (Interned_String*)string_interner.entry_arena.start;
+	spinlock_init(&string_interner.arena_lock);
+
+	// Atom 0 is the empty string
+	Interned_String *empty = (Interned_String*)arena_push_zeroed(&string_interner.entry_arena, sizeof(Interned_String));
+	empty->hash = string_get_hash(ZERO(string));
+	string_interner.count = 1;
+
+	string_interner.initted = true;
+}
+
+// Call with the shard locked
+Atom
+string_interner_find_locked(Concurrent_Hash_Table_Shard *shard, string s, u64 hash, Atom **first) {
+	*first = (Atom*)hash_table_find(&shard->table, hash);
+	if (!*first) return ATOM_EMPTY;
+
+	for (Atom atom = **first; atom != ATOM_EMPTY; atom = string_interner.entries[atom].next_with_same_hash) {
+		if (strings_match(string_interner.entries[atom].str, s)) return atom;
+	}
+
+	return ATOM_EMPTY;
+}
+
+Atom
+intern_string(string s) {
+	assert(string_interner.initted, "The string interner is not initialized. Call string_interner_init() first (oogabooga_init does it).");
+	if (s.count == 0) return ATOM_EMPTY;
+
+	u64 hash = string_get_hash(s);
+	Concurrent_Hash_Table_Shard *shard = concurrent_hash_table_get_shard(&string_interner.atoms_by_hash, hash);
+
+	spinlock_acquire_or_wait(&shard->lock);
+
+	Atom *first;
+	Atom atom = string_interner_find_locked(shard, s, hash, &first);
+
+	if (atom == ATOM_EMPTY) {
+		spinlock_acquire_or_wait(&string_interner.arena_lock);
+
+		assert(string_interner.count < STRING_INTERNER_MAX_ATOMS, "Interned more than STRING_INTERNER_MAX_ATOMS (%d) strings", STRING_INTERNER_MAX_ATOMS);
+
+		atom = string_interner.count;
+		Interned_String *entry = (Interned_String*)arena_push(&string_interner.entry_arena, sizeof(Interned_String));
+		entry->str.count = s.count;
+		entry->str.data = (u8*)arena_push(&string_interner.string_arena, s.count);
+		memcpy(entry->str.data, s.data, s.count);
+		entry->hash = hash;
+		entry->next_with_same_hash = first ? *first : ATOM_EMPTY;
+
+		// The entry must be written before other threads can see it in count
+		atomic_store_release_32(&string_interner.count, atom + 1);
+
+		spinlock_release(&string_interner.arena_lock);
+
+		// New atom becomes the head of the chain
+		hash_table_set(&shard->table, hash, atom);
+	}
+
+	spinlock_release(&shard->lock);
+
+	return atom;
+}
+
+bool
+find_interned_string(string s, Atom *atom) {
+	assert(string_interner.initted, "The string interner is not initialized. Call string_interner_init() first (oogabooga_init does it).");
+	if (s.count == 0) {
+		*atom = ATOM_EMPTY;
+		return true;
+	}
+
+	u64 hash = string_get_hash(s);
+	Concurrent_Hash_Table_Shard *shard = concurrent_hash_table_get_shard(&string_interner.atoms_by_hash, hash);
+
+	spinlock_acquire_or_wait(&shard->lock);
+	Atom *first;
+	*atom = string_interner_find_locked(shard, s, hash, &first);
+	spinlock_release(&shard->lock);
+
+	return *atom != ATOM_EMPTY;
+}
+
+string
+atom_get_string(Atom atom) {
+	assert(atom < string_interner.count, "Invalid atom %u", atom);
+	return string_interner.entries[atom].str;
+}
+
+u64
+atom_get_hash(Atom atom) {
+	assert(atom < string_interner.count, "Invalid atom %u", atom);
+	return string_interner.entries[atom].hash;
+}
+
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
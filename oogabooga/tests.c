@@ -14,17 +14,18 @@ void log_heap() {
 		
 		print("\tBLOCK @ 0x%I64x, %llu bytes\n", (u64)block, block->size);
 		
-		Heap_Free_Node *node = block->free_head;
+		Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)block->start;
 
 		u64 total_free = 0;
 		
-		while (node != 0) {
+		while (heap_chunk_size(meta) != 0) {
 		
-			print("\t\tFREE NODE @ 0x%I64x, %llu bytes\n", (u64)node, node->size);
-			
-			total_free += node->size;
+			if (heap_chunk_is_free(meta)) {
+				print("\t\tFREE NODE @ 0x%I64x, %llu bytes\n", (u64)meta, heap_chunk_size(meta));
+				total_free += heap_chunk_size(meta);
+			}
 		
-			node = node->next;
+			meta = heap_chunk_next_physical(meta);
 		}
 		
 		print("\t TOTAL FREE: %llu\n\n", total_free);
@@ -69,8 +70,107 @@ void test_allocator(bool do_log_heap) {
     
     
     // Allocate and free large block
-    //void* large_block = alloc(heap, 1024 * 1024 * 100);
-    //dealloc(heap, large_block);
+    void* large_block = alloc(heap, 1024 * 1024 * 100);
+    dealloc(heap, large_block);
+    
+    // Large blocks should reuse freed ranges and resize in place
+    u64 large_size = HEAP_LARGE_ALLOCATION_SIZE*3;
+    u8 *large_a = (u8*)alloc(heap, large_size);
+    for (u64 i = 0; i < large_size; i += 1) large_a[i] = (u8)(i*7);
+    u8 *large_b = (u8*)heap.proc(large_size+large_size/4, large_a, ALLOCATOR_REALLOCATE, heap.data);
+    assert(large_b == large_a, "Large realloc within reserved pages should not move");
+    large_b = (u8*)heap.proc(large_size/2, large_b, ALLOCATOR_REALLOCATE, heap.data);
+    assert(large_b == large_a, "Large realloc shrink should not move");
+    large_b = (u8*)heap.proc(large_size*16, large_b, ALLOCATOR_REALLOCATE, heap.data);
+    for (u64 i = 0; i < large_size/2; i += 1) {
+    	assert(large_b[i] == (u8)(i*7), "Large realloc corrupted memory");
+    }
+    memset(large_b, 0, large_size*16);
+    dealloc(heap, large_b);
+    u8 *large_c = (u8*)alloc(heap, large_size);
+    memset(large_c, 0, large_size);
+    u8 *small_after_large = (u8*)heap.proc(large_size*2, large_c, ALLOCATOR_REALLOCATE, heap.data);
+    small_after_large = (u8*)heap.proc(128, small_after_large, ALLOCATOR_REALLOCATE, heap.data);
+    dealloc(heap, small_after_large);
+    
+    // Neighbouring freed large ranges are merged, so a bigger allocation fits in them after
+    u8 *large_neighbours[3];
+    for (u64 i = 0; i < 3; i++) large_neighbours[i] = (u8*)alloc(heap, MB(3));
+    for (u64 i = 0; i < 3; i++) dealloc(heap, large_neighbours[i]);
+    void *program_memory_next_before = program_memory_next;
+    u8 *large_merged = (u8*)alloc(heap, MB(10));
+    memset(large_merged, 1, MB(10));
+    assert(program_memory_next == program_memory_next_before, "Freed large neighbours were not merged");
+    dealloc(heap, large_merged);
+    
+    // Large churn
+    u8 *large_churn[32] = {0};
+    u64 large_churn_sizes[32] = {0};
+    for (u64 round = 0; round < 300; round++) {
+        u64 i = get_random_int_in_range(0, 31);
+        if (large_churn[i]) {
+            for (u64 j = 0; j < large_churn_sizes[i]; j += 4096) {
+                assert(large_churn[i][j] == (u8)i, "Large allocation memory corrupted");
+            }
+            if (get_random_int_in_range(0, 1) == 0) {
+                dealloc(heap, large_churn[i]);
+                large_churn[i] = 0;
+                continue;
+            }
+            u64 new_size = get_random_int_in_range(HEAP_LARGE_ALLOCATION_SIZE, HEAP_LARGE_ALLOCATION_SIZE*8);
+            large_churn[i] = (u8*)heap.proc(new_size, large_churn[i], ALLOCATOR_REALLOCATE, heap.data);
+            large_churn_sizes[i] = new_size;
+        } else {
+            large_churn_sizes[i] = get_random_int_in_range(HEAP_LARGE_ALLOCATION_SIZE, HEAP_LARGE_ALLOCATION_SIZE*8);
+            large_churn[i] = (u8*)alloc(heap, large_churn_sizes[i]);
+        }
+        for (u64 j = 0; j < large_churn_sizes[i]; j += 4096) large_churn[i][j] = (u8)i;
+    }
+    for (u64 i = 0; i < 32; i++) if (large_churn[i]) dealloc(heap, large_churn[i]);
+    
+    // Freed memory stays committed until purged, and purged memory can be used again
+    Heap_Stats stats_before = get_heap_stats();
+    u8 *purgeable = (u8*)alloc(heap, KB(500));
+    assert(get_heap_stats().in_use_bytes >= stats_before.in_use_bytes + KB(500), "Heap in use stat is wrong");
+    memset(purgeable, 1, KB(500));
+    dealloc(heap, purgeable);
+    assert(get_heap_stats().in_use_bytes == stats_before.in_use_bytes, "Heap in use stat is wrong");
+    u64 retained_before = heap_retained_free_bytes;
+    heap_retained_free_bytes = 0;
+    heap_purge();
+    Heap_Stats stats_purged = get_heap_stats();
+    assert(stats_purged.committed_bytes + KB(400) < stats_before.committed_bytes + KB(500), "Heap purge did not decommit freed memory");
+    assert(stats_purged.free_committed_bytes < stats_before.free_committed_bytes, "Heap purge did not decommit freed memory");
+    purgeable = (u8*)alloc(heap, KB(500));
+    memset(purgeable, 2, KB(500));
+    dealloc(heap, purgeable);
+
+    // Allocating from a purged chunk only commits what the allocation covers, and the rest
+    // stays purged so purging again has nothing left to do
+    heap_purge();
+    Heap_Stats stats_tail_purged = get_heap_stats();
+    u8 *from_purged = (u8*)alloc(heap, KB(100));
+    memset(from_purged, 3, KB(100));
+    assert(get_heap_stats().committed_bytes <= stats_tail_purged.committed_bytes + KB(100) + os.page_size*2, "Allocating from a purged chunk committed all of it");
+    heap_purge();
+    u64 committed_after_first_purge = get_heap_stats().committed_bytes;
+    heap_purge();
+    assert(get_heap_stats().committed_bytes == committed_after_first_purge, "Heap purge decommitted the same memory twice");
+    dealloc(heap, from_purged);
+    heap_retained_free_bytes = retained_before;
+    
+    // Shrinking and growing back into the freed tail should not move
+    u8 *resized = (u8*)alloc(heap, 4000);
+    for (u64 i = 0; i < 4000; i += 1) resized[i] = (u8)i;
+    assert(try_expand(heap, resized, 1000), "Shrink in place failed");
+    assert(try_expand(heap, resized, 4000), "Expanding back into the freed tail failed");
+    u8 *reallocated = (u8*)heap.proc(3000, resized, ALLOCATOR_REALLOCATE, heap.data);
+    assert(reallocated == resized, "Shrinking realloc should not move");
+    for (u64 i = 0; i < 1000; i += 1) {
+    	assert(resized[i] == (u8)i, "Resizing in place corrupted memory");
+    }
+    assert(!try_expand(heap, resized, GB(1000)), "Expanded to something unreasonable");
+    dealloc(heap, resized);
 
     // Allocate multiple small blocks
     void* blocks[100];
@@ -139,6 +239,25 @@ void test_allocator(bool do_log_heap) {
     
     assert(old_foo == foo, "Temp allocator goof");
     
+    // Overflowing temporary storage should chain more memory instead of overwriting
+    u64 overflow_count = temporary_storage_size/1000 + 10;
+    u8 **temps = (u8**)alloc(heap, overflow_count*sizeof(u8*));
+    for (u64 i = 0; i < overflow_count; i++) {
+        temps[i] = (u8*)talloc(1000);
+        memset(temps[i], (u8)i, 1000);
+    }
+    for (u64 i = 0; i < overflow_count; i++) {
+        for (u64 j = 0; j < 1000; j++) assert(temps[i][j] == (u8)i, "Temporary storage overflow overwrote live memory");
+    }
+    assert(temporary_storage_chunks != 0, "Temporary storage should have chained a chunk");
+    reset_temporary_storage();
+    assert(get_temporary_storage_peak() >= overflow_count*1000, "Temporary storage peak is wrong");
+    assert(temporary_storage_size >= overflow_count*1000, "Temporary storage did not grow to fit the peak");
+    for (u64 i = 0; i < overflow_count; i++) temps[i] = (u8*)talloc(1000);
+    assert(temporary_storage_chunks == 0, "Temporary storage should fit the peak without chaining now");
+    reset_temporary_storage();
+    dealloc(heap, temps);
+    
     // Repeated Allocation and Free
     for (int i = 0; i < 10000; ++i) {
         void* temp = alloc(heap, 128);
@@ -194,6 +313,38 @@ void test_allocator(bool do_log_heap) {
     
     assert(bytes_match(check_bytes, check_bytes_copy, 1024), "Memory corrupt");
     
+    // Churn: lots of different sizes alive at the same time, replaced in random order
+    const u64 churn_count = 2000;
+    u8 **churn = (u8**)alloc(heap, churn_count*sizeof(u8*));
+    u64 *churn_sizes = (u64*)alloc(heap, churn_count*sizeof(u64));
+    for (u64 i = 0; i < churn_count; i++) {
+        churn_sizes[i] = get_random_int_in_range(1, 5000);
+        churn[i] = (u8*)alloc(heap, churn_sizes[i]);
+        memset(churn[i], (u8)i, churn_sizes[i]);
+    }
+    for (u64 round = 0; round < 10; round++) {
+        for (u64 i = 0; i < churn_count; i++) {
+            if (get_random_int_in_range(0, 1) == 0) continue;
+            for (u64 j = 0; j < churn_sizes[i]; j++) {
+                assert(churn[i][j] == (u8)i, "Heap memory corrupted during churn");
+            }
+            dealloc(heap, churn[i]);
+            churn_sizes[i] = get_random_int_in_range(1, 5000);
+            churn[i] = (u8*)alloc(heap, churn_sizes[i]);
+            memset(churn[i], (u8)i, churn_sizes[i]);
+        }
+    }
+    for (u64 i = 0; i < churn_count; i++) {
+        for (u64 j = 0; j < churn_sizes[i]; j++) {
+            assert(churn[i][j] == (u8)i, "Heap memory corrupted during churn");
+        }
+        dealloc(heap, churn[i]);
+    }
+    dealloc(heap, churn);
+    dealloc(heap, churn_sizes);
+    
+    assert(bytes_match(check_bytes, check_bytes_copy, 1024), "Memory corrupt");
+    
     if (do_log_heap) log_heap();
 }
 
@@ -225,6 +376,12 @@ void test_threads() {
 	os_unlock_mutex(m);
 }
 
+typedef struct Threaded_Allocator_Test_Data {
+    // Allocated on another thread, freed here so they go through the remote free queue
+    void **foreign_blocks;
+    u64 foreign_block_count;
+} Threaded_Allocator_Test_Data;
+
 void test_allocator_threaded(Thread *t) {
 
 	Allocator heap = get_heap_allocator();
@@ -256,8 +413,556 @@ void test_allocator_threaded(Thread *t) {
             dealloc(heap, mixed_blocks[i]);
         }
     }
+    
+    // Every small size class, kept alive at the same time
+    u8* small_blocks[HEAP_CACHE_CLASS_COUNT*4];
+    for (int i = 0; i < HEAP_CACHE_CLASS_COUNT*4; ++i) {
+        u64 size = (i % HEAP_CACHE_CLASS_COUNT + 1) * HEAP_CACHE_CLASS_STEP;
+        small_blocks[i] = (u8*)alloc(heap, size);
+        memset(small_blocks[i], (u8)i, size);
+    }
+    for (int i = 0; i < HEAP_CACHE_CLASS_COUNT*4; ++i) {
+        u64 size = (i % HEAP_CACHE_CLASS_COUNT + 1) * HEAP_CACHE_CLASS_STEP;
+        for (u64 j = 0; j < size; j++) {
+            assert(small_blocks[i][j] == (u8)i, "Small block memory corrupted");
+        }
+        dealloc(heap, small_blocks[i]);
+    }
+    
+    Threaded_Allocator_Test_Data *data = (Threaded_Allocator_Test_Data*)t->data;
+    if (data) {
+        for (u64 i = 0; i < data->foreign_block_count; i++) {
+            assert(*(u64*)data->foreign_blocks[i] == i, "Memory allocated on another thread was corrupted");
+            dealloc(heap, data->foreign_blocks[i]);
+        }
+    }
 }
 
+#define ALLOCATOR_CONTENTION_ITERATIONS 200000
+void allocator_contention_proc(Thread *t) {
+    Allocator heap = get_heap_allocator();
+    void *blocks[32];
+    for (int i = 0; i < ALLOCATOR_CONTENTION_ITERATIONS; i += 32) {
+        for (int j = 0; j < 32; j++) blocks[j] = alloc_uninitialized(heap, (j % 8 + 1) * 24);
+        for (int j = 0; j < 32; j++) dealloc(heap, blocks[j]);
+    }
+}
+void test_allocator_threaded_contention() {
+    
+    const int num_threads = 8;
+    const u64 foreign_blocks_per_thread = 500;
+    
+    Allocator heap = get_heap_allocator();
+    
+    Thread *threads = alloc(heap, sizeof(Thread)*num_threads);
+    Threaded_Allocator_Test_Data *datas = alloc(heap, sizeof(Threaded_Allocator_Test_Data)*num_threads);
+    
+    // Small blocks from this thread's cache, freed by the test threads
+    for (u64 i = 0; i < num_threads; i++) {
+        datas[i].foreign_block_count = foreign_blocks_per_thread;
+        datas[i].foreign_blocks = alloc(heap, sizeof(void*)*foreign_blocks_per_thread);
+        for (u64 j = 0; j < foreign_blocks_per_thread; j++) {
+            datas[i].foreign_blocks[j] = alloc(heap, sizeof(u64) + (j % 8) * 16);
+            *(u64*)datas[i].foreign_blocks[j] = j;
+        }
+        
+        os_thread_init(&threads[i], test_allocator_threaded);
+        threads[i].data = &datas[i];
+    }
+    for (u64 i = 0; i < num_threads; i++) os_thread_start(&threads[i]);
+    for (u64 i = 0; i < num_threads; i++) {
+        os_thread_join(&threads[i]);
+        os_thread_destroy(&threads[i]);
+        dealloc(heap, datas[i].foreign_blocks);
+    }
+    
+    // These should be served from the remotely freed blocks
+    void *blocks[500];
+    for (u64 i = 0; i < 500; i++) blocks[i] = alloc(heap, sizeof(u64));
+    for (u64 i = 0; i < 500; i++) dealloc(heap, blocks[i]);
+    
+    // Spans go back to the heap once all their slots are free, except one per class to
+    // allocate from
+    u64 in_use_before_spans = get_heap_stats().in_use_bytes;
+    void *span_blocks[2048];
+    for (u64 i = 0; i < 2048; i++) span_blocks[i] = alloc(heap, 32);
+    assert(get_heap_stats().in_use_bytes >= in_use_before_spans + HEAP_CACHE_SPAN_SIZE*2, "Expected more than one thread cache span");
+    for (u64 i = 0; i < 2048; i++) dealloc(heap, span_blocks[i]);
+    assert(get_heap_stats().in_use_bytes <= in_use_before_spans + HEAP_CACHE_SPAN_SIZE, "Thread cache spans were not given back to the heap");
+    
+    // And a cache that's parked when its thread exits keeps none of them
+    os_thread_init(&threads[0], allocator_contention_proc);
+    os_thread_start(&threads[0]);
+    os_thread_join(&threads[0]);
+    os_thread_destroy(&threads[0]);
+    assert(get_heap_stats().in_use_bytes < in_use_before_spans + HEAP_CACHE_SPAN_SIZE, "Parked thread cache kept its unused spans");
+    
+#if VERY_DEBUG
+    sanity_check_heap();
+#endif
+    
+    // Benchmark small allocations with and without thread caches
+    for (int use_caches = 0; use_caches <= 1; use_caches++) {
+        heap_use_thread_caches = use_caches;
+        
+        float64 start_seconds = os_get_elapsed_seconds();
+        for (u64 i = 0; i < num_threads; i++) {
+            os_thread_init(&threads[i], allocator_contention_proc);
+            os_thread_start(&threads[i]);
+        }
+        for (u64 i = 0; i < num_threads; i++) {
+            os_thread_join(&threads[i]);
+            os_thread_destroy(&threads[i]);
+        }
+        float64 end_seconds = os_get_elapsed_seconds();
+        
+        print("%d threads doing %d small allocations each %cs thread caches took %.2f ms\n", num_threads, ALLOCATOR_CONTENTION_ITERATIONS, use_caches ? "with" : "without", (end_seconds-start_seconds)*1000.0);
+    }
+    heap_use_thread_caches = true;
+    
+    dealloc(heap, threads);
+    dealloc(heap, datas);
+}
+
+void test_scratch_thread(Thread *t) {
+    for (u64 round = 0; round < 100; round++) {
+        Scratch scratch = scratch_begin();
+        u64 *numbers = (u64*)alloc(scratch.allocator, sizeof(u64)*1000);
+        for (u64 i = 0; i < 1000; i++) numbers[i] = i + round;
+        for (u64 i = 0; i < 1000; i++) assert(numbers[i] == i + round, "Scratch memory shared between threads");
+        scratch_end(scratch);
+    }
+}
+void test_arena() {
+    
+    Arena fixed = make_arena(1024);
+    u8 *a = (u8*)arena_push(&fixed, 100);
+    u8 *b = (u8*)arena_push(&fixed, 100);
+    assert(b == a + 100, "Arena pushes should be contiguous");
+    assert(fixed.high_water == 200, "Wrong arena high water");
+    dealloc(get_heap_allocator(), fixed.start);
+    
+    // Reserve a lot, only the pushed pages get committed
+    Arena arena = make_virtual_arena(GB(1));
+    assert(arena.committed == 0, "Virtual arena should not commit on creation");
+    
+    u64 *numbers = (u64*)arena_push(&arena, sizeof(u64)*1000);
+    for (u64 i = 0; i < 1000; i++) numbers[i] = i;
+    assert(arena.committed >= sizeof(u64)*1000 && arena.committed <= MB(1), "Virtual arena committed a weird amount");
+    
+    Arena_Mark mark = arena_get_mark(&arena);
+    u8 *big = (u8*)arena_push(&arena, MB(20));
+    memset(big, 0xAB, MB(20));
+    assert(arena.committed >= MB(20), "Virtual arena did not commit pushed pages");
+    assert(arena.high_water == sizeof(u64)*1000 + MB(20), "Wrong arena high water");
+    
+    arena_rewind(&arena, mark);
+    u8 *after_rewind = (u8*)arena_push(&arena, 16);
+    assert(after_rewind == big, "Arena rewind did not go back to the mark");
+    for (u64 i = 0; i < 1000; i++) assert(numbers[i] == i, "Arena memory before the mark was corrupted");
+    
+    u64 committed_before_reset = arena.committed;
+    arena_reset(&arena);
+    assert(arena.committed == committed_before_reset, "Arena reset should keep pages unless decommit_on_reset");
+    
+    arena.decommit_on_reset = true;
+    arena_reset(&arena);
+    assert(arena.committed == 0, "Arena reset did not decommit");
+    u8 *again = (u8*)arena_push(&arena, 64);
+    assert(again == arena.start, "Arena reset did not go back to the start");
+    memset(again, 1, 64);
+    assert(arena.high_water == sizeof(u64)*1000 + MB(20), "Arena high water should survive reset");
+    
+    destroy_virtual_arena(&arena);
+    
+    Allocator arena_allocator = make_virtual_arena_allocator(MB(100));
+    for (u64 i = 0; i < 1000; i++) {
+        u8 *p = (u8*)alloc(arena_allocator, 1000);
+        memset(p, (u8)i, 1000);
+    }
+    Arena *parena = (Arena*)arena_allocator.data;
+    assert(parena->high_water >= 1000*1000, "Arena allocator did not push to the arena");
+    destroy_virtual_arena(parena);
+    dealloc(get_heap_allocator(), parena);
+    
+    // Scratch arenas
+    Scratch outer = scratch_begin();
+    u64 *outer_numbers = (u64*)alloc(outer.allocator, sizeof(u64)*100);
+    for (u64 i = 0; i < 100; i++) outer_numbers[i] = i;
+    
+    for (u64 round = 0; round < 100; round++) {
+        Scratch inner = scratch_begin();
+        u8 *junk = (u8*)alloc(inner.allocator, KB(64));
+        memset(junk, 0xCD, KB(64));
+        scratch_end(inner);
+    }
+    assert(outer.arena->high_water < KB(64)*2, "Nested scratch memory was not reused");
+    
+    // A function getting a scratch allocator and needing temporaries of its own
+    Scratch other = scratch_begin_avoiding(outer.allocator);
+    assert(other.arena != outer.arena, "scratch_begin_avoiding gave the conflicting arena");
+    u64 *other_numbers = (u64*)alloc(other.allocator, sizeof(u64)*100);
+    for (u64 i = 0; i < 100; i++) other_numbers[i] = i*2;
+    u64 *result = (u64*)alloc(outer.allocator, sizeof(u64));
+    *result = other_numbers[99];
+    scratch_end(other);
+    
+    assert(*result == 198, "Scratch memory corrupted");
+    for (u64 i = 0; i < 100; i++) assert(outer_numbers[i] == i, "Scratch memory corrupted");
+    scratch_end(outer);
+    assert(outer.arena->next == outer.arena->start, "scratch_end did not rewind");
+    
+    // Threads get their own scratch arenas
+    Thread threads[4];
+    for (u64 i = 0; i < 4; i++) {
+        os_thread_init(&threads[i], test_scratch_thread);
+        os_thread_start(&threads[i]);
+    }
+    for (u64 i = 0; i < 4; i++) {
+        os_thread_join(&threads[i]);
+        os_thread_destroy(&threads[i]);
+    }
+}
+
+void test_pool_thread(Thread *t) {
+    Allocator pool = *(Allocator*)t->data;
+    u64 *slots[64];
+    for (u64 round = 0; round < 1000; round++) {
+        for (u64 i = 0; i < 64; i++) {
+            slots[i] = (u64*)alloc(pool, sizeof(u64)*3);
+            slots[i][0] = slots[i][2] = (u64)t;
+        }
+        for (u64 i = 0; i < 64; i++) {
+            assert(slots[i][0] == (u64)t && slots[i][2] == (u64)t, "Pool slot was handed out twice");
+            dealloc(pool, slots[i]);
+        }
+    }
+}
+void test_pool() {
+    
+    Pool pool = make_pool(24, 100);
+    assert(pool.slot_size == 32, "Pool slot size should be rounded up to 16");
+    
+    u64 *slots[1000];
+    for (u64 i = 0; i < 1000; i++) {
+        slots[i] = (u64*)pool_alloc(&pool);
+        assert((u64)slots[i] % 16 == 0, "Pool slot is not aligned");
+        slots[i][0] = i;
+        slots[i][2] = i*3;
+    }
+    assert(pool.slab_count == 10, "Wrong pool slab count");
+    assert(pool.allocated_count == 1000, "Wrong pool allocated count");
+    for (Pool_Slab *slab = pool.slabs; slab; slab = slab->next) {
+        assert((u64)slab % CACHE_LINE_SIZE == 0, "Pool slab is not aligned to cache line");
+    }
+    
+    for (u64 i = 0; i < 1000; i += 2) pool_dealloc(&pool, slots[i]);
+    for (u64 i = 1; i < 1000; i += 2) {
+        assert(slots[i][0] == i && slots[i][2] == i*3, "Pool memory corrupted");
+    }
+    // Freed slots should be reused before making new slabs
+    for (u64 i = 0; i < 1000; i += 2) slots[i] = (u64*)pool_alloc(&pool);
+    assert(pool.slab_count == 10, "Pool did not reuse freed slots");
+    for (u64 i = 0; i < 1000; i++) pool_dealloc(&pool, slots[i]);
+    assert(pool.allocated_count == 0, "Wrong pool allocated count");
+    destroy_pool(&pool);
+    
+    // Through the Allocator interface, from multiple threads
+    Allocator pool_allocator = make_thread_safe_pool_allocator(sizeof(u64)*3, 256);
+    Thread threads[4];
+    for (u64 i = 0; i < 4; i++) {
+        os_thread_init(&threads[i], test_pool_thread);
+        threads[i].data = &pool_allocator;
+        os_thread_start(&threads[i]);
+    }
+    for (u64 i = 0; i < 4; i++) {
+        os_thread_join(&threads[i]);
+        os_thread_destroy(&threads[i]);
+    }
+    Pool *shared_pool = (Pool*)pool_allocator.data;
+    assert(shared_pool->allocated_count == 0, "Wrong pool allocated count");
+    assert(shared_pool->slab_count <= 4, "Threaded pool made more slabs than it needed");
+    destroy_pool(shared_pool);
+    dealloc(get_heap_allocator(), shared_pool);
+}
+
+void test_aligned_allocation() {
+    Allocator heap = get_heap_allocator();
+    
+    u64 alignments[] = {16, 32, 64, 256, 4096};
+    u64 sizes[] = {1, 24, 200, 1000, 12345, MB(2)};
+    
+    void *ps[100];
+    u64 count = 0;
+    for (u64 round = 0; round < 3; round++) {
+        for (u64 i = 0; i < sizeof(alignments)/sizeof(u64); i++) {
+            for (u64 j = 0; j < sizeof(sizes)/sizeof(u64); j++) {
+                u8 *p = (u8*)alloc_aligned(heap, sizes[j], alignments[i]);
+                assert((u64)p % alignments[i] == 0, "Heap allocation of %llu bytes is not aligned to %llu", sizes[j], alignments[i]);
+                memset(p, (u8)j, sizes[j]);
+                ps[count++] = p;
+            }
+        }
+        // Free every other one so the next round has holes to fill
+        for (u64 i = 0; i < count; i += 2) {
+            if (ps[i]) dealloc(heap, ps[i]);
+            ps[i] = 0;
+        }
+    }
+    for (u64 i = 0; i < count; i++) {
+        if (ps[i]) dealloc(heap, ps[i]);
+    }
+
+    // Large allocations with alignments past a cache line still get their own page range, and
+    // can grow in place and be reused after they're freed
+    u64 large_alignments[] = {128, 4096, KB(64)};
+    for (u64 i = 0; i < sizeof(large_alignments)/sizeof(u64); i++) {
+        u64 alignment = large_alignments[i];
+        u64 in_use_before = get_heap_stats().in_use_bytes;
+        u8 *large = (u8*)alloc_aligned(heap, HEAP_LARGE_ALLOCATION_SIZE*2, alignment);
+        assert((u64)large % alignment == 0, "Large allocation is not aligned to %llu", alignment);
+        Heap_Allocation_Metadata *large_meta = (Heap_Allocation_Metadata*)(large-sizeof(Heap_Allocation_Metadata));
+        assert(large_meta->size & HEAP_CHUNK_LARGE, "Large aligned allocation did not get its own pages");
+        assert(get_heap_stats().in_use_bytes - in_use_before < HEAP_LARGE_ALLOCATION_SIZE*2 + alignment + os.page_size, "Large aligned allocation used too much memory");
+        memset(large, 7, HEAP_LARGE_ALLOCATION_SIZE*2);
+
+        if (try_expand(heap, large, HEAP_LARGE_ALLOCATION_SIZE*3)) {
+            memset(large + HEAP_LARGE_ALLOCATION_SIZE*2, 8, HEAP_LARGE_ALLOCATION_SIZE);
+            assert(large[HEAP_LARGE_ALLOCATION_SIZE*2-1] == 7, "Expanding a large aligned allocation corrupted memory");
+        }
+
+        dealloc(heap, large);
+        assert(get_heap_stats().in_use_bytes == in_use_before, "Large aligned allocation was not freed");
+
+        u8 *reused = (u8*)alloc(heap, HEAP_LARGE_ALLOCATION_SIZE*2);
+        memset(reused, 9, HEAP_LARGE_ALLOCATION_SIZE*2);
+        dealloc(heap, reused);
+    }
+
+    // SIMD friendly float buffer
+    float32 *floats = (float32*)alloc_aligned(heap, sizeof(float32)*1024, 32);
+    for (u64 i = 0; i < 1024; i++) floats[i] = (float32)i;
+    float32 sums[8];
+    simd_add_float32_256_aligned(floats, floats+8, sums);
+    assert(sums[0] == 8.0f && sums[7] == 22.0f, "Aligned SIMD add gave the wrong result");
+    dealloc(heap, floats);
+    
+    Arena arena = make_arena(KB(4));
+    arena_push(&arena, 3);
+    u8 *a = (u8*)arena_push_aligned(&arena, 100, 64);
+    assert((u64)a % 64 == 0, "Arena push is not aligned");
+    u8 *b = (u8*)arena_push(&arena, 1);
+    assert(b == a + 100, "Aligned arena push moved next wrong");
+    Allocator arena_allocator = make_arena_allocator_from_arena(&arena);
+    a = (u8*)alloc_aligned(arena_allocator, 10, 256);
+    assert((u64)a % 256 == 0, "Arena allocator allocation is not aligned");
+    dealloc(heap, arena.start);
+    
+    reset_temporary_storage();
+    for (u64 i = 0; i < 1000; i++) {
+        talloc(i % 7 + 1);
+        u8 *t = (u8*)alloc_aligned(get_temporary_allocator(), 1000, 64);
+        assert((u64)t % 64 == 0, "Temporary allocation is not aligned");
+        memset(t, 0xAB, 1000);
+    }
+    reset_temporary_storage();
+    
+    Allocator pool = make_pool_allocator(64, 100);
+    for (u64 i = 0; i < 200; i++) {
+        u8 *p = (u8*)alloc_aligned(pool, 64, 64);
+        assert((u64)p % 64 == 0, "Pool allocation is not aligned");
+    }
+    destroy_pool((Pool*)pool.data);
+    dealloc(heap, pool.data);
+}
+
+bool is_all_zero(void *p, u64 size) {
+    for (u64 i = 0; i < size; i++) if (((u8*)p)[i] != 0) return false;
+    return true;
+}
+void test_zeroed_allocation() {
+    Allocator heap = get_heap_allocator();
+    
+    // Unaligned start and end
+    u8 *buffer = (u8*)alloc_uninitialized(heap, MB(1)+200);
+    memset(buffer, 0xFF, MB(1)+200);
+    zero_memory_streaming(buffer+3, MB(1)+100);
+    assert(buffer[2] == 0xFF && buffer[MB(1)+103] == 0xFF, "zero_memory_streaming wrote out of bounds");
+    assert(is_all_zero(buffer+3, MB(1)+100), "zero_memory_streaming did not clear everything");
+    dealloc(heap, buffer);
+    
+    // Dirty memory first so it's reused
+    u64 sizes[] = {100, KB(300), MB(2), MB(5)+123};
+    for (u64 round = 0; round < 2; round++) {
+        for (u64 i = 0; i < sizeof(sizes)/sizeof(u64); i++) {
+            u8 *dirty = (u8*)alloc_uninitialized(heap, sizes[i]);
+            memset(dirty, 0xFF, sizes[i]);
+            dealloc(heap, dirty);
+            
+            u8 *p = (u8*)alloc_zeroed(heap, sizes[i]);
+            assert(is_all_zero(p, sizes[i]), "Heap alloc_zeroed of %llu bytes was not zero", sizes[i]);
+            memset(p, 0xFF, sizes[i]);
+            dealloc(heap, p);
+        }
+    }
+    
+    Arena arena = make_virtual_arena(MB(64));
+    u8 *a = (u8*)arena_push(&arena, MB(1));
+    memset(a, 0xFF, MB(1));
+    arena_reset(&arena);
+    a = (u8*)arena_push_zeroed(&arena, MB(2));
+    assert(is_all_zero(a, MB(2)), "Arena push zeroed was not zero after reset");
+    assert(arena.touched == MB(2), "Wrong arena touched size");
+    arena.decommit_on_reset = true;
+    arena_reset(&arena);
+    assert(arena.touched == 0, "Decommitting arena did not reset touched size");
+    Allocator arena_allocator = make_arena_allocator_from_arena(&arena);
+    a = (u8*)alloc_zeroed(arena_allocator, MB(1));
+    assert(is_all_zero(a, MB(1)), "Arena alloc_zeroed was not zero");
+    destroy_virtual_arena(&arena);
+    
+    // Pool doesn't handle it, alloc_zeroed clears it
+    Allocator pool = make_pool_allocator(64, 10);
+    u8 *slot = (u8*)alloc(pool, 64);
+    memset(slot, 0xFF, 64);
+    dealloc(pool, slot);
+    slot = (u8*)alloc_zeroed(pool, 64);
+    assert(is_all_zero(slot, 64), "Fallback alloc_zeroed was not zero");
+    destroy_pool((Pool*)pool.data);
+    dealloc(heap, pool.data);
+}
+
+void test_memory_tags() {
+    Memory_Tag tag = MEMORY_TAG_USER_FIRST;
+    set_memory_tag_name(tag, STR("test"));
+    assert(strings_match(get_memory_tag_name(tag), STR("test")), "Wrong memory tag name");
+    assert(strings_match(get_memory_tag_name(MEMORY_TAG_AUDIO), STR("audio")), "Wrong memory tag name");
+    
+    Allocator tagged = get_tagged_heap_allocator(tag);
+    Memory_Tag_Stats before = get_memory_tag_stats(tag);
+    
+    u8 *a = (u8*)alloc(tagged, 1000);
+    u8 *b = (u8*)alloc_aligned(tagged, 5000, 64);
+    assert((u64)b % 64 == 0, "Tagged aligned allocation is not aligned");
+    u8 *c = (u8*)alloc(tagged, MB(2));
+    memset(a, 1, 1000);
+    memset(b, 2, 5000);
+    memset(c, 3, MB(2));
+    
+    Memory_Tag_Stats stats = get_memory_tag_stats(tag);
+    assert(stats.current - before.current == 1000+5000+MB(2), "Wrong memory tag current size");
+    assert(stats.allocation_count - before.allocation_count == 3, "Wrong memory tag allocation count");
+    
+    a = (u8*)tagged.proc(3000, a, ALLOCATOR_REALLOCATE, tagged.data);
+    for (u64 i = 0; i < 1000; i++) assert(a[i] == 1, "Tagged realloc lost the data");
+    assert(get_memory_tag_stats(tag).current - before.current == 3000+5000+MB(2), "Wrong memory tag size after realloc");
+    
+    if (try_expand(tagged, c, MB(3))) {
+        assert(get_memory_tag_stats(tag).current - before.current == 3000+5000+MB(3), "Wrong memory tag size after try_expand");
+        for (u64 i = 0; i < MB(2); i += 4096) assert(c[i] == 3, "Tagged try_expand lost the data");
+    }
+    
+    u64 peak = get_memory_tag_stats(tag).current;
+    dealloc(tagged, a);
+    dealloc(tagged, b);
+    dealloc(tagged, c);
+    stats = get_memory_tag_stats(tag);
+    assert(stats.current == before.current, "Memory tag did not go back down after dealloc");
+    assert(stats.allocation_count == before.allocation_count, "Wrong memory tag allocation count after dealloc");
+    assert(stats.peak >= peak, "Memory tag peak is wrong");
+    
+    // Tags on top of other allocators
+    Arena arena = make_arena(KB(64));
+    Tagged_Allocator tagged_arena;
+    Allocator arena_allocator = make_tagged_allocator_in_place(&tagged_arena, make_arena_allocator_from_arena(&arena), tag);
+    for (u64 i = 0; i < 10; i++) alloc(arena_allocator, 100);
+    assert(get_memory_tag_stats(tag).current - before.current == 1000, "Wrong memory tag size for tagged arena");
+    dealloc(get_heap_allocator(), arena.start);
+    
+    set_memory_tag_budget(tag, KB(1));
+    u8 *over = (u8*)alloc(tagged, KB(2)); // Should log a warning
+    assert(memory_tags[tag].over_budget, "Memory tag should be over budget");
+    dealloc(tagged, over);
+    assert(!memory_tags[tag].over_budget, "Memory tag should not be over budget anymore");
+    set_memory_tag_budget(tag, 0);
+    
+    string usage = tprint_memory_usage();
+    assert(usage.count > 0, "Memory usage string is empty");
+}
+
+void test_context_allocator() {
+    Allocator heap = get_heap_allocator();
+    assert(get_context_allocator().proc == heap.proc, "Context allocator should default to heap");
+    
+    Arena arena = make_arena(KB(64));
+    Allocator arena_allocator = make_arena_allocator_from_arena(&arena);
+    
+    push_allocator(arena_allocator);
+    {
+        Allocator a = get_context_allocator();
+        assert(a.proc == arena_allocator.proc && a.data == &arena, "push_allocator did not set the context allocator");
+        
+        u8 *p = (u8*)alloc(a, 100);
+        assert(p >= (u8*)arena.start && p < (u8*)arena.start+arena.size, "Context allocation was not in the arena");
+        
+        Memory_Tag_Stats before = get_memory_tag_stats(MEMORY_TAG_USER_FIRST);
+        Tagged_Allocator tagged_storage;
+        Allocator tagged = get_tagged_context_allocator(MEMORY_TAG_USER_FIRST, &tagged_storage);
+        assert(tagged.data == &tagged_storage, "Tagged context allocator was not made in the given storage");
+        u8 *q = (u8*)alloc(tagged, 200);
+        assert(q >= (u8*)arena.start && q < (u8*)arena.start+arena.size, "Tagged context allocation was not in the arena");
+        assert(get_memory_tag_stats(MEMORY_TAG_USER_FIRST).current - before.current == 200, "Tagged context allocation was not counted");
+        dealloc(tagged, q);
+        
+        // Other fields are kept
+        assert(get_context().thread_id == context.thread_id, "push_allocator lost the thread id");
+        
+        push_allocator(heap);
+        assert(get_context_allocator().proc == heap.proc, "Nested push_allocator did not work");
+        assert(get_tagged_context_allocator(MEMORY_TAG_USER_FIRST, &tagged_storage).data == &tagged_heap_allocators[MEMORY_TAG_USER_FIRST], "Tagged context allocator for heap should be the tagged heap allocator");
+        pop_context();
+        
+        assert(get_context_allocator().data == &arena, "pop_context did not restore the allocator");
+    }
+    pop_context();
+    
+    assert(get_context_allocator().proc == heap.proc, "pop_context did not restore the allocator");
+    
+    dealloc(heap, arena.start);
+}
+
+#if ENABLE_ALLOCATION_PROFILING
+Allocation_Site *find_allocation_site(u64 largest_size) {
+    for (u64 i = 0; i < ALLOCATION_PROFILER_MAX_SITES; i++) {
+        Allocation_Site *site = &allocation_profiler.sites[i];
+        if (site->hash && site->largest_size == largest_size) return site;
+    }
+    return 0;
+}
+void test_allocation_profiler() {
+    Allocator heap = get_heap_allocator();
+    
+    u64 old_interval = allocation_profiler_sample_interval;
+    allocation_profiler_sample_interval = 1;
+    allocation_profiler_countdown = 0;
+    u64 samples_before = allocation_profiler.sample_count;
+    
+    for (u64 i = 0; i < 100; i++) dealloc(heap, alloc(heap, 12345));
+    for (u64 i = 0; i < 50; i++)  dealloc(heap, alloc_uninitialized(heap, 54321));
+    
+    allocation_profiler_sample_interval = old_interval;
+    
+    assert(allocation_profiler.sample_count - samples_before == 150, "Every allocation should be sampled at interval 1");
+    
+    Allocation_Site *a = find_allocation_site(12345);
+    Allocation_Site *b = find_allocation_site(54321);
+    assert(a && b && a != b, "Allocation profiler did not separate call sites");
+    assert(a->sample_count == 100 && a->sampled_bytes == 100*12345, "Allocation site has wrong count");
+    assert(b->sample_count == 50 && b->sampled_bytes == 50*54321, "Allocation site has wrong count");
+    assert(a->allocator_proc == heap.proc, "Allocation site has wrong allocator");
+}
+#endif
+
 void test_strings() {
 	Allocator heap = get_heap_allocator();
 	{
@@ -1307,6 +2012,107 @@ void test_intmath() {
     assert(v4i_result.x == 1 && v4i_result.y == 2 && v4i_result.z == 3 && v4i_result.w == 4, "v4i_divi incorrect");
 }
 
+void test_hashing() {
+    Allocator heap = get_heap_allocator();
+    
+    u64 max_size = 3000;
+    u8 *bytes = (u8*)alloc(heap, max_size);
+    for (u64 i = 0; i < max_size; i += 1) bytes[i] = (u8)get_random();
+    
+    for (u64 size = 0; size <= max_size; size += (size < 300 ? 1 : 37)) {
+        u64 expected = hash_bytes(bytes, size, 1234);
+        
+        // Same bytes fed in random sized pieces must give the same hash
+        Hasher h;
+        hasher_begin(&h, 1234);
+        u64 done = 0;
+        while (done < size) {
+            u64 piece = get_random_int_in_range(0, 200);
+            piece = min(piece, size-done);
+            hasher_update(&h, bytes+done, piece);
+            done += piece;
+        }
+        assert(hasher_finish(&h) == expected, "Streaming hash does not match one-shot hash for %llu bytes", size);
+        
+        assert(hash_bytes(bytes, size, 1235) != expected, "Seed did not change hash for %llu bytes", size);
+        
+        if (size > 0) {
+            // Flipping any bit should change it
+            u64 bit = get_random_int_in_range(0, size*8-1);
+            bytes[bit/8] ^= (u8)(1 << (bit%8));
+            assert(hash_bytes(bytes, size, 1234) != expected, "Flipping bit %llu did not change hash for %llu bytes", bit, size);
+            bytes[bit/8] ^= (u8)(1 << (bit%8));
+        }
+    }
+    
+    // Finish doesn't end the hasher
+    Hasher h;
+    hasher_begin(&h, 0);
+    hasher_update(&h, bytes, 1000);
+    assert(hasher_finish(&h) == hash_bytes(bytes, 1000, 0), "Streaming hash mismatch");
+    hasher_update(&h, bytes+1000, 1000);
+    assert(hasher_finish(&h) == hash_bytes(bytes, 2000, 0), "Streaming hash mismatch after continuing");
+    
+    string a = STR("Hello there");
+    string b = string_copy(a, heap);
+    assert(string_get_hash(a) == string_get_hash(b), "Equal strings hashed differently");
+    assert(string_get_hash(STR("ab")) != string_get_hash(STR("ba")), "Hash ignores byte order");
+    u8 zeros[2] = {0};
+    assert(hash_bytes(zeros, 1, 0) != hash_bytes(zeros, 2, 0), "Hash ignores length");
+    dealloc_string(heap, b);
+    
+    // Lots of similar short keys, like "entity_1", "entity_2", ...
+    u64 key_count = 100000;
+    Hash_Table seen = make_hash_table(u64, u64, heap);
+    for (u64 i = 0; i < key_count; i += 1) {
+        string key = tprint("entity_%llu", i);
+        u64 hash = string_get_hash(key);
+        assert(!hash_table_contains(&seen, hash), "Hash collision for '%s'", key);
+        hash_table_add(&seen, hash, i);
+    }
+    hash_table_destroy(&seen);
+    reset_temporary_storage();
+    
+    dealloc(heap, bytes);
+}
+
+void benchmark_hashing() {
+    Allocator heap = get_heap_allocator();
+    
+    u64 max_size = MB(1);
+    u8 *bytes = (u8*)alloc(heap, max_size);
+    for (u64 i = 0; i < max_size; i += 1) bytes[i] = (u8)get_random();
+    
+    u64 sizes[] = {16, 64, 256, KB(4), MB(1)};
+    for (u64 s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s += 1) {
+        u64 size = sizes[s];
+        u64 iterations = max(MB(256)/size, 4);
+        string str = (string){size, bytes};
+        u64 sum = 0;
+        
+        float64 start = os_get_elapsed_seconds();
+        for (u64 i = 0; i < iterations; i += 1) {
+            str.data[0] = (u8)i;
+            sum += hash_bytes(str.data, str.count, 0);
+        }
+        float64 new_seconds = os_get_elapsed_seconds()-start;
+        
+        // What string_get_hash used to do
+        start = os_get_elapsed_seconds();
+        for (u64 i = 0; i < iterations; i += 1) {
+            str.data[0] = (u8)i;
+            sum += size > 32 ? djb2_hash(str) : city_hash(str);
+        }
+        float64 old_seconds = os_get_elapsed_seconds()-start;
+        
+        float64 gb = (float64)(size*iterations)/(float64)GB(1);
+        print("Hashing %llu bytes: %.2f GB/s, old string hash %.2f GB/s (%llu)\n", 
+            size, gb/new_seconds, gb/old_seconds, sum % 10);
+    }
+    
+    dealloc(heap, bytes);
+}
+
 void test_hash_table() {
     Hash_Table table = make_hash_table(string, int, get_heap_allocator());
     
@@ -1342,6 +2148,143 @@ void test_hash_table() {
     assert(table.entries == NULL, "Failed: Hash table entries should be NULL after destroy");
     assert(table.count == 0, "Failed: Hash table count should be 0 after destroy");
     assert(table.capacity_count == 0, "Failed: Hash table capacity count should be 0 after destroy");
+    
+    // Many keys, through a few grows
+    table = make_hash_table(u64, u64, get_heap_allocator());
+    for (u64 i = 0; i < 100000; i += 1) {
+        u64 key = i*7;
+        u64 value = i;
+        hash_table_add(&table, key, value);
+    }
+    assert(table.count == 100000, "Failed: Wrong count after many adds");
+    for (u64 i = 0; i < 100000; i += 1) {
+        u64 key = i*7;
+        u64 *value = hash_table_find(&table, key);
+        assert(value && *value == i, "Failed: Key %llu was lost", key);
+        
+        u64 missing_key = i*7+3;
+        assert(!hash_table_contains(&table, missing_key), "Failed: Found key %llu which was never added", missing_key);
+    }
+    for (u64 i = 0; i < 100000; i += 1) {
+        assert(*(u64*)hash_table_get_nth_value(&table, i) == i, "Failed: Entries should stay in insertion order");
+    }
+    
+    // Remove every other key, the rest must still be found
+    for (u64 i = 0; i < 100000; i += 2) {
+        u64 key = i*7;
+        assert(hash_table_remove(&table, key), "Failed: Key %llu should have been removed", key);
+        assert(!hash_table_remove(&table, key), "Failed: Key %llu was removed twice", key);
+    }
+    assert(table.count == 50000, "Failed: Wrong count after removing");
+    for (u64 i = 0; i < 100000; i += 1) {
+        u64 key = i*7;
+        u64 *value = hash_table_find(&table, key);
+        if (i % 2 == 0) {
+            assert(!value, "Failed: Found removed key %llu", key);
+        } else {
+            assert(value && *value == i, "Failed: Key %llu was lost after removing others", key);
+        }
+    }
+    
+    // Iterate
+    u64 iterated = 0;
+    for (Hash_Table_Iterator it = hash_table_iterate(&table); hash_table_next(&it);) {
+        u64 key = *(u64*)it.key;
+        u64 value = *(u64*)it.value;
+        assert(key == value*7 && value % 2 == 1, "Failed: Iterated wrong entry");
+        iterated += 1;
+    }
+    assert(iterated == table.count, "Failed: Iterator did not visit all entries");
+    
+    hash_table_reset(&table);
+    u64 key = 7;
+    assert(!hash_table_contains(&table, key), "Failed: Hash table should be empty after reset");
+    hash_table_destroy(&table);
+    
+    // Keys with colliding hashes must not alias
+    table = make_hash_table(u32, int, get_heap_allocator());
+    for (u32 i = 0; i < 100; i += 1) {
+        int value = (int)i;
+        hash_table_add_raw(&table, 1234, &i, &value, sizeof(u32), sizeof(int));
+    }
+    for (u32 i = 0; i < 100; i += 1) {
+        int *value = hash_table_find_raw(&table, 1234, &i, sizeof(u32));
+        assert(value && *value == (int)i, "Failed: Colliding keys aliased");
+    }
+    for (u32 i = 0; i < 100; i += 3) {
+        assert(hash_table_remove_raw(&table, 1234, &i, sizeof(u32)), "Failed: Could not remove colliding key");
+    }
+    for (u32 i = 0; i < 100; i += 1) {
+        int *value = hash_table_find_raw(&table, 1234, &i, sizeof(u32));
+        if (i % 3 == 0) {
+            assert(!value, "Failed: Found removed colliding key");
+        } else {
+            assert(value && *value == (int)i, "Failed: Colliding key lost after removing others");
+        }
+    }
+    hash_table_destroy(&table);
+    
+    // String keys are compared by content and copied
+    table = make_hash_table(string, int, get_heap_allocator());
+    string temp_key = string_copy(STR("Key 5"), get_heap_allocator());
+    int five = 5;
+    hash_table_add(&table, temp_key, five);
+    memset(temp_key.data, 'x', temp_key.count);
+    dealloc_string(get_heap_allocator(), temp_key);
+    string same_key = STR("Key 5");
+    found_value = hash_table_find(&table, same_key);
+    assert(found_value && *found_value == 5, "Failed: String key should be compared by content and copied");
+    assert(hash_table_remove(&table, same_key), "Failed: Could not remove string key");
+    assert(table.count == 0, "Failed: Hash table should be empty");
+    hash_table_destroy(&table);
+}
+
+// What hash_table_find_raw used to do before the table had an index
+void *hash_table_find_linear(Hash_Table *t, u64 hash) {
+    for (u64 i = 0; i < t->count; i += 1) {
+        u8 *entry = (u8*)t->entries+i*t->_entry_size;
+        if (*(u64*)entry == hash) return entry+t->_value_offset;
+    }
+    return 0;
+}
+void benchmark_hash_table(u64 count) {
+    Hash_Table table = make_hash_table(u64, u64, get_heap_allocator());
+    
+    u64 *keys = (u64*)alloc(get_heap_allocator(), count*sizeof(u64));
+    for (u64 i = 0; i < count; i += 1) keys[i] = get_random();
+    
+    float64 start = os_get_elapsed_seconds();
+    for (u64 i = 0; i < count; i += 1) {
+        hash_table_add(&table, keys[i], i);
+    }
+    float64 insert_seconds = os_get_elapsed_seconds()-start;
+    
+    u64 lookups = count*4;
+    u64 sum = 0;
+    start = os_get_elapsed_seconds();
+    for (u64 i = 0; i < lookups; i += 1) {
+        u64 key = keys[get_random() % count];
+        sum += *(u64*)hash_table_find(&table, key);
+    }
+    float64 find_seconds = os_get_elapsed_seconds()-start;
+    
+    // Linear scan is O(n) per lookup so only do enough to get a stable average
+    u64 linear_lookups = max(10000000/count, 10);
+    start = os_get_elapsed_seconds();
+    for (u64 i = 0; i < linear_lookups; i += 1) {
+        sum += *(u64*)hash_table_find_linear(&table, get_hash(keys[get_random() % count]));
+    }
+    float64 linear_seconds = os_get_elapsed_seconds()-start;
+    
+    print("Hash table with %llu entries: insert %.1f ns, find %.1f ns, old linear find %.1f ns (%llu)\n", 
+        count, 
+        insert_seconds*1e9/(float64)count, 
+        find_seconds*1e9/(float64)lookups, 
+        linear_seconds*1e9/(float64)linear_lookups,
+        sum % 10);
+    
+    dealloc(get_heap_allocator(), keys);
+    hash_table_destroy(&table);
 }
 
 #define NUM_BINS 100
@@ -1390,15 +2333,18 @@ void test_mutex() {
     
     // Test initialization
     mutex_init(&m);
-    assert(m.spin_time_microseconds == MUTEX_DEFAULT_SPIN_TIME_MICROSECONDS, "Failed: Default spin time incorrect");
-    assert(!m.spinlock_acquired, "Failed: Spinlock should not be acquired after initialization");
+    assert(m.state == MUTEX_UNLOCKED, "Failed: Mutex should not be acquired after initialization");
 
     // Test acquire and release without contention
     mutex_acquire_or_wait(&m);
-    assert(m.spinlock_acquired, "Failed: Mutex should be acquired after mutex_acquire_or_wait");
+    assert(m.state == MUTEX_LOCKED, "Failed: Mutex should be acquired after mutex_acquire_or_wait");
+    assert(!mutex_try_acquire(&m), "Failed: mutex_try_acquire should fail on an acquired mutex");
+    
+    mutex_release(&m);
+    assert(m.state == MUTEX_UNLOCKED, "Failed: Mutex should not be acquired after mutex_release");
     
+    assert(mutex_try_acquire(&m), "Failed: mutex_try_acquire should succeed on a released mutex");
     mutex_release(&m);
-    assert(!m.spinlock_acquired, "Failed: Spinlock should not be acquired after mutex_release");
 
     // Clean up
     mutex_destroy(&m);
@@ -1429,6 +2375,998 @@ void test_mutex() {
     mutex_destroy(&data.mutex);
 }
 
+#define ATOMICS_TEST_ITERATIONS 100000
+typedef struct Atomics_Test_Data {
+    volatile u8  counter_8;
+    volatile u16 counter_16;
+    volatile u32 counter_32;
+    volatile u64 counter_64;
+    volatile u64 exchanged_sum;
+    volatile u64 last;
+    volatile u64 published_value;
+    volatile bool published;
+} Atomics_Test_Data;
+void atomics_test_proc(Thread *t) {
+    Atomics_Test_Data *data = (Atomics_Test_Data*)t->data;
+    for (u64 i = 1; i <= ATOMICS_TEST_ITERATIONS; i++) {
+        atomic_fetch_add_relaxed_8(&data->counter_8, 1);
+        atomic_fetch_add_acquire_16(&data->counter_16, 1);
+        atomic_fetch_add_release_32(&data->counter_32, 1);
+        atomic_fetch_add_64(&data->counter_64, 2);
+        
+        // Every value swapped in is swapped out exactly once, by the next exchange or at the end
+        u64 previous = atomic_exchange_64(&data->last, i);
+        atomic_fetch_add_relaxed_64(&data->exchanged_sum, previous);
+    }
+}
+void atomics_test_publisher(Thread *t) {
+    Atomics_Test_Data *data = (Atomics_Test_Data*)t->data;
+    atomic_store_relaxed_64(&data->published_value, 1337);
+    atomic_store_release_bool(&data->published, true);
+}
+void test_atomics() {
+    Atomics_Test_Data data = ZERO(Atomics_Test_Data);
+    
+    atomic_store_relaxed_32(&data.counter_32, 5);
+    assert(atomic_load_relaxed_32(&data.counter_32) == 5, "Failed: atomic store/load");
+    u32 old_32 = atomic_fetch_add_32(&data.counter_32, 3);
+    assert(old_32 == 5, "Failed: fetch_add should return the old value");
+    assert(atomic_load_acquire_32(&data.counter_32) == 8, "Failed: fetch_add");
+    old_32 = atomic_exchange_relaxed_32(&data.counter_32, 0);
+    assert(old_32 == 8 && data.counter_32 == 0, "Failed: exchange should return the old value");
+    
+    atomic_exchange_acquire_16(&data.counter_16, 7);
+    u16 old_16 = atomic_exchange_release_16(&data.counter_16, 0);
+    assert(old_16 == 7, "Failed: exchange");
+    
+    atomic_fetch_add_8(&data.counter_8, 255);
+    u8 old_8 = atomic_fetch_add_8(&data.counter_8, 1);
+    assert(old_8 == 255 && data.counter_8 == 0, "Failed: 8 bit fetch_add should wrap");
+    
+    bool old_bool = atomic_exchange_bool(&data.published, true);
+    assert(!old_bool && atomic_load_relaxed_bool(&data.published), "Failed: bool exchange");
+    atomic_store_relaxed_bool(&data.published, false);
+    
+    const u64 num_threads = 8;
+    Thread threads[8];
+    for (u64 i = 0; i < num_threads; i++) {
+        os_thread_init(&threads[i], atomics_test_proc);
+        threads[i].data = &data;
+        os_thread_start(&threads[i]);
+    }
+    for (u64 i = 0; i < num_threads; i++) {
+        os_thread_join(&threads[i]);
+        os_thread_destroy(&threads[i]);
+    }
+    
+    u64 total = num_threads*ATOMICS_TEST_ITERATIONS;
+    assert(data.counter_8 == (u8)total, "Failed: 8 bit counter is %u, expected %u", data.counter_8, (u8)total);
+    assert(data.counter_16 == (u16)total, "Failed: 16 bit counter");
+    assert(data.counter_32 == (u32)total, "Failed: 32 bit counter");
+    assert(data.counter_64 == total*2, "Failed: 64 bit counter");
+    u64 expected_sum = num_threads*((u64)ATOMICS_TEST_ITERATIONS*(ATOMICS_TEST_ITERATIONS+1)/2);
+    assert(data.exchanged_sum + data.last == expected_sum, "Failed: Values were lost or duplicated by exchange");
+    
+    // Release/acquire publishing
+    Thread publisher;
+    os_thread_init(&publisher, atomics_test_publisher);
+    publisher.data = &data;
+    os_thread_start(&publisher);
+    while (!atomic_load_acquire_bool(&data.published)) os_yield_thread();
+    assert(atomic_load_relaxed_64(&data.published_value) == 1337, "Failed: Published value not visible after acquire");
+    os_thread_join(&publisher);
+    os_thread_destroy(&publisher);
+}
+
+#define LOCK_TEST_ITERATIONS 20000
+typedef struct Lock_Test_Shared_Data {
+    Ticket_Lock ticket_lock;
+    RW_Lock rw_lock;
+    u64 counter;
+    volatile s32 writers_inside;
+    volatile u32 readers_inside;
+} Lock_Test_Shared_Data;
+void ticket_lock_test_proc(Thread *t) {
+    Lock_Test_Shared_Data *data = (Lock_Test_Shared_Data*)t->data;
+    for (u64 i = 0; i < LOCK_TEST_ITERATIONS; i++) {
+        ticket_lock_acquire_or_wait(&data->ticket_lock);
+        assert(data->writers_inside == 0, "Failed: More than one thread is in critical section!");
+        data->writers_inside = 1;
+        data->counter += 1;
+        data->writers_inside = 0;
+        ticket_lock_release(&data->ticket_lock);
+    }
+}
+void rw_lock_test_proc(Thread *t) {
+    Lock_Test_Shared_Data *data = (Lock_Test_Shared_Data*)t->data;
+    for (u64 i = 0; i < LOCK_TEST_ITERATIONS; i++) {
+        if (i % 8 == 0) {
+            rw_lock_acquire_write(&data->rw_lock);
+            assert(data->writers_inside == 0, "Failed: More than one writer is in critical section!");
+            assert(data->readers_inside == 0, "Failed: Reader is in critical section with a writer!");
+            data->writers_inside = 1;
+            data->counter += 1;
+            data->writers_inside = 0;
+            rw_lock_release_write(&data->rw_lock);
+        } else {
+            rw_lock_acquire_read(&data->rw_lock);
+            assert(data->writers_inside == 0, "Failed: Writer is in critical section with a reader!");
+            atomic_fetch_add_32(&data->readers_inside, 1);
+            assert(data->writers_inside == 0, "Failed: Writer is in critical section with a reader!");
+            atomic_fetch_add_32(&data->readers_inside, (u32)-1);
+            rw_lock_release_read(&data->rw_lock);
+        }
+    }
+}
+void test_ticket_lock() {
+    Ticket_Lock l;
+    ticket_lock_init(&l);
+    ticket_lock_acquire_or_wait(&l);
+    assert(l.next_ticket == 1 && l.now_serving == 0, "Failed: Ticket lock should be acquired");
+    ticket_lock_release(&l);
+    assert(l.next_ticket == l.now_serving, "Failed: Ticket lock should be released");
+    
+    Lock_Test_Shared_Data data = ZERO(Lock_Test_Shared_Data);
+    ticket_lock_init(&data.ticket_lock);
+    
+    const u64 num_threads = 8;
+    Thread threads[8];
+    for (u64 i = 0; i < num_threads; i++) {
+        os_thread_init(&threads[i], ticket_lock_test_proc);
+        threads[i].data = &data;
+        os_thread_start(&threads[i]);
+    }
+    for (u64 i = 0; i < num_threads; i++) {
+        os_thread_join(&threads[i]);
+        os_thread_destroy(&threads[i]);
+    }
+    
+    assert(data.counter == num_threads*LOCK_TEST_ITERATIONS, "Failed: Counter does not match expected value after threading tasks");
+}
+void test_rw_lock() {
+    RW_Lock l;
+    rw_lock_init(&l);
+    
+    // Readers don't block each other
+    rw_lock_acquire_read(&l);
+    rw_lock_acquire_read(&l);
+    assert((l.state & RW_LOCK_READER_MASK) == 2, "Failed: RW_Lock should have 2 readers");
+    rw_lock_release_read(&l);
+    rw_lock_release_read(&l);
+    assert(l.state == 0, "Failed: RW_Lock should be released");
+    
+    rw_lock_acquire_write(&l);
+    assert(l.state == RW_LOCK_WRITER, "Failed: RW_Lock should have a writer");
+    rw_lock_release_write(&l);
+    assert(l.state == 0, "Failed: RW_Lock should be released");
+    
+    Lock_Test_Shared_Data data = ZERO(Lock_Test_Shared_Data);
+    rw_lock_init(&data.rw_lock);
+    
+    const u64 num_threads = 8;
+    Thread threads[8];
+    for (u64 i = 0; i < num_threads; i++) {
+        os_thread_init(&threads[i], rw_lock_test_proc);
+        threads[i].data = &data;
+        os_thread_start(&threads[i]);
+    }
+    for (u64 i = 0; i < num_threads; i++) {
+        os_thread_join(&threads[i]);
+        os_thread_destroy(&threads[i]);
+    }
+    
+    assert(data.counter == num_threads*(LOCK_TEST_ITERATIONS/8), "Failed: Counter does not match expected value after threading tasks");
+    assert(data.readers_inside == 0 && data.rw_lock.state == 0, "Failed: RW_Lock should be released");
+}
+
+#define LOCK_BENCHMARK_OPS 200000
+typedef enum Lock_Benchmark_Kind {
+    LOCK_BENCHMARK_SPINLOCK,
+    LOCK_BENCHMARK_TICKET_LOCK,
+    LOCK_BENCHMARK_MUTEX,
+    LOCK_BENCHMARK_OS_MUTEX,
+    LOCK_BENCHMARK_RW_LOCK_WRITE,
+    LOCK_BENCHMARK_RW_LOCK_MOSTLY_READ,
+    LOCK_BENCHMARK_KIND_COUNT
+} Lock_Benchmark_Kind;
+typedef struct Lock_Benchmark_Data {
+    Lock_Benchmark_Kind kind;
+    Spinlock spinlock;
+    Ticket_Lock ticket_lock;
+    Mutex mutex;
+    Mutex_Handle os_mutex;
+    RW_Lock rw_lock;
+    u64 counter;
+} Lock_Benchmark_Data;
+void lock_benchmark_proc(Thread *t) {
+    Lock_Benchmark_Data *data = (Lock_Benchmark_Data*)t->data;
+    u64 sum = 0;
+    for (u64 i = 0; i < LOCK_BENCHMARK_OPS; i++) {
+        switch (data->kind) {
+            case LOCK_BENCHMARK_SPINLOCK:
+                spinlock_acquire_or_wait(&data->spinlock);
+                data->counter += 1;
+                spinlock_release(&data->spinlock);
+                break;
+            case LOCK_BENCHMARK_TICKET_LOCK:
+                ticket_lock_acquire_or_wait(&data->ticket_lock);
+                data->counter += 1;
+                ticket_lock_release(&data->ticket_lock);
+                break;
+            case LOCK_BENCHMARK_MUTEX:
+                mutex_acquire_or_wait(&data->mutex);
+                data->counter += 1;
+                mutex_release(&data->mutex);
+                break;
+            case LOCK_BENCHMARK_OS_MUTEX:
+                os_lock_mutex(data->os_mutex);
+                data->counter += 1;
+                os_unlock_mutex(data->os_mutex);
+                break;
+            case LOCK_BENCHMARK_RW_LOCK_WRITE:
+                rw_lock_acquire_write(&data->rw_lock);
+                data->counter += 1;
+                rw_lock_release_write(&data->rw_lock);
+                break;
+            case LOCK_BENCHMARK_RW_LOCK_MOSTLY_READ:
+                // 1 in 10 writes
+                if (i % 10 == 0) {
+                    rw_lock_acquire_write(&data->rw_lock);
+                    data->counter += 1;
+                    rw_lock_release_write(&data->rw_lock);
+                } else {
+                    rw_lock_acquire_read(&data->rw_lock);
+                    sum += data->counter;
+                    rw_lock_release_read(&data->rw_lock);
+                }
+                break;
+            default: panic("Unhandled lock benchmark kind");
+        }
+    }
+    // Keep the reads from being optimized out
+    if (sum == 0xFFFFFFFFFFFFFFFF) print("");
+}
+void benchmark_locks() {
+    const char *names[LOCK_BENCHMARK_KIND_COUNT] = {
+        "Spinlock", "Ticket_Lock", "Mutex", "OS mutex", "RW_Lock (writes)", "RW_Lock (90% reads)"
+    };
+    
+    u64 num_threads = max(os_get_number_of_logical_processors(), 4);
+    num_threads = min(num_threads, 64);
+    Allocator heap = get_heap_allocator();
+    Thread *threads = alloc(heap, sizeof(Thread)*num_threads);
+    
+    for (u64 kind = 0; kind < LOCK_BENCHMARK_KIND_COUNT; kind++) {
+        Lock_Benchmark_Data data = ZERO(Lock_Benchmark_Data);
+        data.kind = (Lock_Benchmark_Kind)kind;
+        spinlock_init(&data.spinlock);
+        ticket_lock_init(&data.ticket_lock);
+        mutex_init(&data.mutex);
+        data.os_mutex = os_make_mutex();
+        rw_lock_init(&data.rw_lock);
+        
+        float64 start_seconds = os_get_elapsed_seconds();
+        for (u64 i = 0; i < num_threads; i++) {
+            os_thread_init(&threads[i], lock_benchmark_proc);
+            threads[i].data = &data;
+            os_thread_start(&threads[i]);
+        }
+        for (u64 i = 0; i < num_threads; i++) {
+            os_thread_join(&threads[i]);
+            os_thread_destroy(&threads[i]);
+        }
+        float64 seconds = os_get_elapsed_seconds()-start_seconds;
+        
+        f64 mops = (f64)(num_threads*LOCK_BENCHMARK_OPS)/seconds/1000000.0;
+        print("%llu threads, %cs: %.2f million ops per second\n", num_threads, names[kind], mops);
+        
+        mutex_destroy(&data.mutex);
+        os_destroy_mutex(data.os_mutex);
+    }
+    
+    dealloc(heap, threads);
+}
+
+#define QUEUE_TEST_ITEMS_PER_PRODUCER 200000
+typedef struct Queue_Test_Data {
+    Spsc_Queue *spsc;
+    Mpmc_Queue *mpmc;
+    u64 producer_count;
+    u64 items_per_consumer;
+    u64 max_batch;
+    volatile u32 next_producer_index;
+    volatile u64 sum;
+    volatile u64 popped;
+} Queue_Test_Data;
+// Items are (producer index << 32) | (number pushed by that producer before it)
+void queue_test_producer(Thread *t) {
+    Queue_Test_Data *data = (Queue_Test_Data*)t->data;
+    u32 producer_index = atomic_fetch_add_32(&data->next_producer_index, 1);
+    
+    u64 items[64];
+    u64 pushed = 0;
+    while (pushed < QUEUE_TEST_ITEMS_PER_PRODUCER) {
+        u64 batch = min(data->max_batch, QUEUE_TEST_ITEMS_PER_PRODUCER-pushed);
+        batch = max(1, (pushed*7) % (batch+1));
+        for (u64 i = 0; i < batch; i++) items[i] = ((u64)producer_index << 32) | (pushed+i);
+        
+        u64 count = 0;
+        while (count < batch) {
+            u64 n;
+            if (data->spsc) n = spsc_queue_push_batch(data->spsc, items+count, batch-count);
+            else            n = mpmc_queue_push_batch(data->mpmc, items+count, batch-count);
+            // Might be more threads than cores, so let the consumers run
+            if (n == 0) os_yield_thread();
+            count += n;
+        }
+        pushed += batch;
+    }
+}
+void queue_test_consumer(Thread *t) {
+    Queue_Test_Data *data = (Queue_Test_Data*)t->data;
+    
+    // Items from one producer must come out in the order they were pushed
+    u64 next_expected[64] = {0};
+    assert(data->producer_count <= 64, "Too many producers in queue test");
+    
+    u64 items[64];
+    u64 popped = 0;
+    u64 sum = 0;
+    while (popped < data->items_per_consumer) {
+        u64 max_count = min(data->max_batch, data->items_per_consumer-popped);
+        u64 n;
+        if (data->spsc) n = spsc_queue_pop_batch(data->spsc, items, max_count);
+        else            n = mpmc_queue_pop_batch(data->mpmc, items, max_count);
+        if (n == 0) os_yield_thread();
+        
+        for (u64 i = 0; i < n; i++) {
+            u64 producer_index = items[i] >> 32;
+            u64 number = items[i] & 0xFFFFFFFF;
+            assert(producer_index < data->producer_count, "Failed: Popped garbage from queue");
+            assert(number >= next_expected[producer_index], "Failed: Items from one producer came out of order (got %llu, expected at least %llu)", number, next_expected[producer_index]);
+            next_expected[producer_index] = number+1;
+            sum += items[i];
+        }
+        popped += n;
+    }
+    
+    atomic_fetch_add_64(&data->sum, sum);
+    atomic_fetch_add_64(&data->popped, popped);
+}
+// Returns seconds taken
+float64 run_queue_test(Spsc_Queue *spsc, Mpmc_Queue *mpmc, u64 producer_count, u64 consumer_count, u64 max_batch) {
+    Queue_Test_Data data = ZERO(Queue_Test_Data);
+    data.spsc = spsc;
+    data.mpmc = mpmc;
+    data.producer_count = producer_count;
+    data.max_batch = max_batch;
+    u64 total = producer_count*QUEUE_TEST_ITEMS_PER_PRODUCER;
+    data.items_per_consumer = total/consumer_count;
+    assert(total % consumer_count == 0, "Items must split evenly between consumers");
+    
+    Thread threads[128];
+    u64 thread_count = producer_count+consumer_count;
+    assert(thread_count <= 128, "Too many threads in queue test");
+    
+    float64 start_seconds = os_get_elapsed_seconds();
+    for (u64 i = 0; i < thread_count; i++) {
+        os_thread_init(&threads[i], i < producer_count ? queue_test_producer : queue_test_consumer);
+        threads[i].data = &data;
+        os_thread_start(&threads[i]);
+    }
+    for (u64 i = 0; i < thread_count; i++) {
+        os_thread_join(&threads[i]);
+        os_thread_destroy(&threads[i]);
+    }
+    float64 seconds = os_get_elapsed_seconds()-start_seconds;
+    
+    u64 expected_sum = 0;
+    for (u64 p = 0; p < producer_count; p++) {
+        for (u64 i = 0; i < QUEUE_TEST_ITEMS_PER_PRODUCER; i++) expected_sum += (p << 32) | i;
+    }
+    assert(data.popped == total, "Failed: Popped %llu items, expected %llu", data.popped, total);
+    assert(data.sum == expected_sum, "Failed: Items were lost or duplicated in queue");
+    
+    return seconds;
+}
+void test_spsc_queue() {
+    Allocator heap = get_heap_allocator();
+    Spsc_Queue q;
+    spsc_queue_init(&q, 5, sizeof(u32), heap);
+    assert(q.capacity == 8, "Failed: Capacity should be rounded up to power of two");
+    
+    u32 value = 0;
+    assert(!spsc_queue_pop(&q, &value), "Failed: Popped from empty queue");
+    
+    // Fill it, wrapping around the end of the buffer
+    u32 items[16];
+    for (u32 i = 0; i < 16; i++) items[i] = i;
+    assert(spsc_queue_push_batch(&q, items, 5) == 5, "Failed: Batch push");
+    assert(spsc_queue_pop_batch(&q, items, 3) == 3, "Failed: Batch pop");
+    assert(items[0] == 0 && items[1] == 1 && items[2] == 2, "Failed: Batch pop order");
+    for (u32 i = 0; i < 16; i++) items[i] = 100+i;
+    assert(spsc_queue_push_batch(&q, items, 16) == 6, "Failed: Batch push should stop when full");
+    assert(!spsc_queue_push(&q, &value), "Failed: Pushed to full queue");
+    assert(spsc_queue_get_count(&q) == 8, "Failed: Queue count");
+    
+    u32 out[16];
+    assert(spsc_queue_pop_batch(&q, out, 16) == 8, "Failed: Batch pop should stop when empty");
+    assert(out[0] == 3 && out[1] == 4, "Failed: Batch pop order after wrapping");
+    for (u32 i = 0; i < 6; i++) assert(out[2+i] == 100+i, "Failed: Batch pop order after wrapping");
+    assert(!spsc_queue_pop(&q, &value), "Failed: Popped from empty queue");
+    
+    spsc_queue_destroy(&q);
+    
+    // Stress, small capacity so it's full & empty a lot
+    u64 batches[] = {1, 7, 64};
+    for (u64 i = 0; i < sizeof(batches)/sizeof(batches[0]); i++) {
+        spsc_queue_init(&q, 32, sizeof(u64), heap);
+        run_queue_test(&q, 0, 1, 1, batches[i]);
+        spsc_queue_destroy(&q);
+    }
+}
+void test_mpmc_queue() {
+    Allocator heap = get_heap_allocator();
+    Mpmc_Queue q;
+    mpmc_queue_init(&q, 5, sizeof(u32), heap);
+    assert(q.capacity == 8, "Failed: Capacity should be rounded up to power of two");
+    
+    u32 value = 0;
+    assert(!mpmc_queue_pop(&q, &value), "Failed: Popped from empty queue");
+    
+    u32 items[16];
+    for (u32 i = 0; i < 16; i++) items[i] = i;
+    assert(mpmc_queue_push_batch(&q, items, 5) == 5, "Failed: Batch push");
+    assert(mpmc_queue_pop_batch(&q, items, 3) == 3, "Failed: Batch pop");
+    assert(items[0] == 0 && items[1] == 1 && items[2] == 2, "Failed: Batch pop order");
+    for (u32 i = 0; i < 16; i++) items[i] = 100+i;
+    assert(mpmc_queue_push_batch(&q, items, 16) == 6, "Failed: Batch push should stop when full");
+    assert(!mpmc_queue_push(&q, &value), "Failed: Pushed to full queue");
+    assert(mpmc_queue_get_count(&q) == 8, "Failed: Queue count");
+    
+    u32 out[16];
+    assert(mpmc_queue_pop_batch(&q, out, 16) == 8, "Failed: Batch pop should stop when empty");
+    assert(out[0] == 3 && out[1] == 4, "Failed: Batch pop order after wrapping");
+    for (u32 i = 0; i < 6; i++) assert(out[2+i] == 100+i, "Failed: Batch pop order after wrapping");
+    assert(!mpmc_queue_pop(&q, &value), "Failed: Popped from empty queue");
+    
+    mpmc_queue_destroy(&q);
+    
+    // Elements that aren't a multiple of 8 bytes
+    mpmc_queue_init(&q, 4, 3, heap);
+    assert(mpmc_queue_push(&q, "abc") && mpmc_queue_push(&q, "def"), "Failed: Push");
+    char chars[3];
+    assert(mpmc_queue_pop(&q, chars) && memcmp(chars, "abc", 3) == 0, "Failed: Pop");
+    assert(mpmc_queue_pop(&q, chars) && memcmp(chars, "def", 3) == 0, "Failed: Pop");
+    mpmc_queue_destroy(&q);
+    
+    // Stress
+    u64 batches[] = {1, 7, 64};
+    for (u64 i = 0; i < sizeof(batches)/sizeof(batches[0]); i++) {
+        mpmc_queue_init(&q, 64, sizeof(u64), heap);
+        run_queue_test(0, &q, 4, 4, batches[i]);
+        run_queue_test(0, &q, 1, 4, batches[i]);
+        run_queue_test(0, &q, 4, 1, batches[i]);
+        mpmc_queue_destroy(&q);
+    }
+}
+void benchmark_queues() {
+    Allocator heap = get_heap_allocator();
+    
+    u64 half_threads = max(os_get_number_of_logical_processors()/2, 1);
+    half_threads = min(half_threads, 32);
+    
+    u64 batches[] = {1, 32};
+    for (u64 i = 0; i < sizeof(batches)/sizeof(batches[0]); i++) {
+        u64 batch = batches[i];
+        
+        Spsc_Queue spsc;
+        spsc_queue_init(&spsc, 1024, sizeof(u64), heap);
+        float64 seconds = run_queue_test(&spsc, 0, 1, 1, batch);
+        print("Spsc_Queue, 1 producer, 1 consumer, batch %llu: %.2f million items per second\n", batch, (f64)QUEUE_TEST_ITEMS_PER_PRODUCER/seconds/1000000.0);
+        spsc_queue_destroy(&spsc);
+        
+        Mpmc_Queue mpmc;
+        mpmc_queue_init(&mpmc, 1024, sizeof(u64), heap);
+        seconds = run_queue_test(0, &mpmc, 1, 1, batch);
+        print("Mpmc_Queue, 1 producer, 1 consumer, batch %llu: %.2f million items per second\n", batch, (f64)QUEUE_TEST_ITEMS_PER_PRODUCER/seconds/1000000.0);
+        seconds = run_queue_test(0, &mpmc, half_threads, half_threads, batch);
+        print("Mpmc_Queue, %llu producers, %llu consumers, batch %llu: %.2f million items per second\n", half_threads, half_threads, batch, (f64)(half_threads*QUEUE_TEST_ITEMS_PER_PRODUCER)/seconds/1000000.0);
+        mpmc_queue_destroy(&mpmc);
+    }
+}
+
+#define CONCURRENT_HASH_TABLE_TEST_KEYS 20000
+typedef struct Concurrent_Hash_Table_Test_Data {
+    Concurrent_Hash_Table *table;
+    u64 inserted;
+} Concurrent_Hash_Table_Test_Data;
+void concurrent_hash_table_test_proc(Thread *t) {
+    Concurrent_Hash_Table_Test_Data *data = (Concurrent_Hash_Table_Test_Data*)t->data;
+    // Every thread races to insert the same keys, in a different order
+    for (u64 i = 0; i < CONCURRENT_HASH_TABLE_TEST_KEYS; i += 1) {
+        u64 key = (i*7919 + context.thread_id) % CONCURRENT_HASH_TABLE_TEST_KEYS;
+        u64 value = key*3;
+        if (concurrent_hash_table_get_or_insert(data->table, key, value)) data->inserted += 1;
+        assert(value == key*3, "Failed: get_or_insert returned the wrong value");
+        
+        u64 found = 0;
+        assert(concurrent_hash_table_find(data->table, key, found) && found == key*3, "Failed: Could not find key %llu after inserting it", key);
+    }
+}
+void test_concurrent_hash_table() {
+    Allocator heap = get_heap_allocator();
+    
+    Concurrent_Hash_Table table = make_concurrent_hash_table(string, int, heap);
+    
+    string key = STR("Some key");
+    int value = 5;
+    assert(concurrent_hash_table_get_or_insert(&table, key, value), "Failed: Key should be newly added");
+    value = 6;
+    assert(!concurrent_hash_table_get_or_insert(&table, key, value), "Failed: Key should already exist");
+    assert(value == 5, "Failed: get_or_insert should give back the existing value");
+    
+    value = 7;
+    assert(!concurrent_hash_table_set(&table, key, value), "Failed: Key should already exist");
+    int found = 0;
+    assert(concurrent_hash_table_find(&table, key, found) && found == 7, "Failed: Wrong value after set");
+    
+    string other_key = STR("Other key");
+    assert(!concurrent_hash_table_contains(&table, other_key), "Failed: Table should not contain other key");
+    assert(concurrent_hash_table_remove(&table, key), "Failed: Could not remove key");
+    assert(!concurrent_hash_table_contains(&table, key), "Failed: Key still there after remove");
+    assert(concurrent_hash_table_get_count(&table) == 0, "Failed: Table should be empty");
+    
+    concurrent_hash_table_destroy(&table);
+    
+    // Threads racing on the same keys, each key must be inserted exactly once
+    const int num_threads = 8;
+    Concurrent_Hash_Table shared = make_concurrent_hash_table(u64, u64, heap);
+    Thread *threads = alloc(heap, sizeof(Thread)*num_threads);
+    Concurrent_Hash_Table_Test_Data *datas = alloc(heap, sizeof(Concurrent_Hash_Table_Test_Data)*num_threads);
+    for (u64 i = 0; i < num_threads; i++) {
+        datas[i].table = &shared;
+        datas[i].inserted = 0;
+        os_thread_init(&threads[i], concurrent_hash_table_test_proc);
+        threads[i].data = &datas[i];
+    }
+    for (u64 i = 0; i < num_threads; i++) os_thread_start(&threads[i]);
+    u64 inserted = 0;
+    for (u64 i = 0; i < num_threads; i++) {
+        os_thread_join(&threads[i]);
+        os_thread_destroy(&threads[i]);
+        inserted += datas[i].inserted;
+    }
+    assert(inserted == CONCURRENT_HASH_TABLE_TEST_KEYS, "Failed: Keys were inserted %llu times, expected %d", inserted, CONCURRENT_HASH_TABLE_TEST_KEYS);
+    assert(concurrent_hash_table_get_count(&shared) == CONCURRENT_HASH_TABLE_TEST_KEYS, "Failed: Wrong count after threaded inserts");
+    
+    concurrent_hash_table_destroy(&shared);
+    dealloc(heap, threads);
+    dealloc(heap, datas);
+}
+
+#define STRING_INTERNER_TEST_KEYS 5000
+typedef struct String_Interner_Test_Data {
+    string *keys;
+    Atom *atoms;
+} String_Interner_Test_Data;
+void string_interner_test_proc(Thread *t) {
+    String_Interner_Test_Data *data = (String_Interner_Test_Data*)t->data;
+    // Every thread races to intern the same strings, in a different order
+    for (u64 i = 0; i < STRING_INTERNER_TEST_KEYS; i += 1) {
+        u64 k = (i*7919 + context.thread_id) % STRING_INTERNER_TEST_KEYS;
+        data->atoms[k] = intern_string(data->keys[k]);
+        assert(strings_match(atom_get_string(data->atoms[k]), data->keys[k]), "Failed: Atom string does not match the interned string");
+    }
+}
+void test_string_interner() {
+    Allocator heap = get_heap_allocator();
+    
+    string a = STR("res/player.png");
+    string a_copy = string_copy(a, heap);
+    Atom atom_a = intern_string(a);
+    assert(atom_a != ATOM_EMPTY, "Failed: Non-empty string got the empty atom");
+    assert(intern_string(a_copy) == atom_a, "Failed: Same string got different atoms");
+    assert(atom_get_string(atom_a).data != a.data, "Failed: Interned string should be a copy");
+    assert(strings_match(atom_get_string(atom_a), a), "Failed: Interned string does not match");
+    assert(atom_get_hash(atom_a) == string_get_hash(a), "Failed: Wrong atom hash");
+    
+    Atom atom_b = intern_string(STR("res/player.pn"));
+    assert(atom_b != atom_a, "Failed: Different strings got the same atom");
+    
+    assert(intern_string(ZERO(string)) == ATOM_EMPTY, "Failed: Empty string should be ATOM_EMPTY");
+    assert(atom_get_string(ATOM_EMPTY).count == 0, "Failed: ATOM_EMPTY should be the empty string");
+    
+    Atom found = 0;
+    assert(find_interned_string(a_copy, &found) && found == atom_a, "Failed: Could not find interned string");
+    assert(!find_interned_string(STR("This was never interned"), &found), "Failed: Found a string that was never interned");
+    
+    dealloc_string(heap, a_copy);
+    
+    const int num_threads = 8;
+    string *keys = alloc(heap, sizeof(string)*STRING_INTERNER_TEST_KEYS);
+    for (u64 i = 0; i < STRING_INTERNER_TEST_KEYS; i += 1) {
+        keys[i] = sprint(heap, STR("interner_test_%llu"), i);
+    }
+    
+    Thread *threads = alloc(heap, sizeof(Thread)*num_threads);
+    String_Interner_Test_Data *datas = alloc(heap, sizeof(String_Interner_Test_Data)*num_threads);
+    for (u64 i = 0; i < num_threads; i++) {
+        datas[i].keys = keys;
+        datas[i].atoms = alloc(heap, sizeof(Atom)*STRING_INTERNER_TEST_KEYS);
+        os_thread_init(&threads[i], string_interner_test_proc);
+        threads[i].data = &datas[i];
+    }
+    for (u64 i = 0; i < num_threads; i++) os_thread_start(&threads[i]);
+    for (u64 i = 0; i < num_threads; i++) {
+        os_thread_join(&threads[i]);
+        os_thread_destroy(&threads[i]);
+    }
+    
+    Hash_Table seen = make_hash_table(Atom, u64, heap);
+    for (u64 i = 0; i < STRING_INTERNER_TEST_KEYS; i += 1) {
+        Atom atom = datas[0].atoms[i];
+        for (u64 j = 1; j < num_threads; j++) {
+            assert(datas[j].atoms[i] == atom, "Failed: Threads got different atoms for the same string");
+        }
+        assert(!hash_table_contains(&seen, atom), "Failed: Two strings got the same atom");
+        hash_table_add(&seen, atom, i);
+    }
+    hash_table_destroy(&seen);
+    
+    for (u64 i = 0; i < num_threads; i++) dealloc(heap, datas[i].atoms);
+    for (u64 i = 0; i < STRING_INTERNER_TEST_KEYS; i += 1) dealloc_string(heap, keys[i]);
+    dealloc(heap, keys);
+    dealloc(heap, threads);
+    dealloc(heap, datas);
+}
+
+#define JOB_TEST_COUNT 10000
+typedef struct Job_Test_Item {
+    u64 index;
+    u64 result;
+    s64 worker;
+} Job_Test_Item;
+void job_test_square(void *data) {
+    Job_Test_Item *item = (Job_Test_Item*)data;
+    item->result = item->index*item->index;
+    item->worker = job_get_worker_index();
+    
+    u8 *scratch = (u8*)talloc(256);
+    memset(scratch, (int)item->index, 256);
+}
+// Spawns jobs & waits for them, from inside a job
+typedef struct Job_Test_Parent {
+    Job_Test_Item *items;
+    u64 count;
+    u64 sum;
+} Job_Test_Parent;
+void job_test_parent(void *data) {
+    Job_Test_Parent *parent = (Job_Test_Parent*)data;
+    Job_Counter children = {0};
+    for (u64 i = 0; i < parent->count; i += 1) {
+        job_run(job_test_square, &parent->items[i], &children);
+    }
+    job_counter_wait(&children);
+    
+    parent->sum = 0;
+    for (u64 i = 0; i < parent->count; i += 1) parent->sum += parent->items[i].result;
+}
+void job_test_outside_thread(Thread *t) {
+    assert(job_get_worker_index() == -1, "Failed: A thread that isn't a worker should have worker index -1");
+    Job_Counter counter = {0};
+    job_run(job_test_parent, t->data, &counter);
+    job_counter_wait(&counter);
+}
+u64 job_test_expected_sum(Job_Test_Item *items, u64 count) {
+    u64 sum = 0;
+    for (u64 i = 0; i < count; i += 1) sum += items[i].index*items[i].index;
+    return sum;
+}
+void job_test_empty(void *data) {}
+void job_test_fire_and_forget(Thread *t) {
+    job_run(job_test_square, t->data, 0);
+}
+void test_job_system() {
+    Allocator heap = get_heap_allocator();
+    
+    assert(job_get_worker_index() == 0, "Failed: Main thread should be worker 0");
+    assert(job_system_get_worker_count() >= 1, "Failed: No job workers");
+    
+    Job_Test_Item *items = (Job_Test_Item*)alloc(heap, sizeof(Job_Test_Item)*JOB_TEST_COUNT);
+    for (u64 i = 0; i < JOB_TEST_COUNT; i += 1) {
+        items[i].index = i;
+        items[i].result = 0;
+        items[i].worker = -2;
+    }
+    
+    // More jobs than fit in a queue, so some run right away
+    Job_Counter counter = {0};
+    for (u64 i = 0; i < JOB_TEST_COUNT; i += 1) {
+        job_run(job_test_square, &items[i], &counter);
+    }
+    job_counter_wait(&counter);
+    assert(job_counter_is_done(&counter), "Failed: Counter not done after waiting");
+    
+    u64 workers_used = 0;
+    for (u64 w = 0; w < job_system_get_worker_count(); w += 1) {
+        for (u64 i = 0; i < JOB_TEST_COUNT; i += 1) {
+            if (items[i].worker == (s64)w) {
+                workers_used += 1;
+                break;
+            }
+        }
+    }
+    for (u64 i = 0; i < JOB_TEST_COUNT; i += 1) {
+        assert(items[i].result == i*i, "Failed: Job %llu did not run", i);
+        assert(items[i].worker >= 0 && items[i].worker < (s64)job_system_get_worker_count(), "Failed: Job %llu ran on an invalid worker %lld", i, items[i].worker);
+    }
+    
+    // Jobs waiting on their own jobs
+    const u64 parent_count = 16;
+    Job_Test_Parent parents[16];
+    u64 per_parent = JOB_TEST_COUNT/parent_count;
+    counter = (Job_Counter){0};
+    for (u64 i = 0; i < parent_count; i += 1) {
+        parents[i].items = items + i*per_parent;
+        parents[i].count = per_parent;
+        parents[i].sum = 0;
+        job_run(job_test_parent, &parents[i], &counter);
+    }
+    job_counter_wait(&counter);
+    for (u64 i = 0; i < parent_count; i += 1) {
+        assert(parents[i].sum == job_test_expected_sum(parents[i].items, per_parent), "Failed: Wrong sum from nested jobs");
+    }
+    
+    // From threads that aren't workers
+    const int num_threads = 4;
+    Thread threads[4];
+    for (u64 i = 0; i < num_threads; i++) {
+        parents[i].sum = 0;
+        os_thread_init(&threads[i], job_test_outside_thread);
+        threads[i].data = &parents[i];
+    }
+    for (u64 i = 0; i < num_threads; i++) os_thread_start(&threads[i]);
+    for (u64 i = 0; i < num_threads; i++) {
+        os_thread_join(&threads[i]);
+        os_thread_destroy(&threads[i]);
+        assert(parents[i].sum == job_test_expected_sum(parents[i].items, per_parent), "Failed: Wrong sum from jobs started outside the job system");
+    }
+    
+    // Overhead per job
+    const u64 empty_jobs = 1000000;
+    float64 start = os_get_elapsed_seconds();
+    counter = (Job_Counter){0};
+    for (u64 i = 0; i < empty_jobs; i += 1) {
+        job_run(job_test_empty, 0, &counter);
+        // Stay under the queue capacity so we measure queueing, not running in place
+        if (i % 1024 == 1023) job_counter_wait(&counter);
+    }
+    job_counter_wait(&counter);
+    float64 seconds = os_get_elapsed_seconds()-start;
+    print("%llu job workers, %llu used, %.1f ns per empty job\n", job_system_get_worker_count(), workers_used, seconds*1e9/(float64)empty_jobs);
+    
+    // With one worker there are no threads taking jobs off the queues, so jobs that nobody
+    // waits on still need to run
+    u64 original_worker_count = job_system_get_worker_count();
+    job_system_deinit();
+    job_system_init(1);
+    for (u64 i = 0; i < 64; i += 1) {
+        items[i].result = 0;
+        job_run(job_test_square, &items[i], 0);
+    }
+    items[64].result = 0;
+    os_thread_init(&threads[0], job_test_fire_and_forget);
+    threads[0].data = &items[64];
+    os_thread_start(&threads[0]);
+    os_thread_join(&threads[0]);
+    os_thread_destroy(&threads[0]);
+    for (u64 i = 0; i <= 64; i += 1) {
+        assert(items[i].result == i*i, "Failed: Job %llu was never run with one worker", i);
+    }
+    job_system_deinit();
+    job_system_init(original_worker_count);
+    
+    dealloc(heap, items);
+}
+
+void parallel_for_test_mark(u64 first, u64 end, void *userdata) {
+    u32 *marks = (u32*)userdata;
+    for (u64 i = first; i < end; i += 1) marks[i] += 1;
+}
+void parallel_reduce_test_sum(u64 first, u64 end, void *partial, void *userdata) {
+    u64 *sum = (u64*)partial;
+    for (u64 i = first; i < end; i += 1) *sum += i;
+}
+void parallel_reduce_test_add(void *result, void *partial, void *userdata) {
+    *(u64*)result += *(u64*)partial;
+}
+void test_parallel_for() {
+    Allocator heap = get_heap_allocator();
+    
+    u64 counts[] = {0, 1, 7, 1000, 100003, 1000000};
+    u64 batches[] = {0, 1, 64, 5000};
+    
+    u32 *marks = (u32*)alloc(heap, sizeof(u32)*1000000);
+    for (u64 c = 0; c < sizeof(counts)/sizeof(counts[0]); c += 1) {
+        for (u64 b = 0; b < sizeof(batches)/sizeof(batches[0]); b += 1) {
+            u64 count = counts[c];
+            memset(marks, 0, sizeof(u32)*1000000);
+            
+            parallel_for(count, batches[b], parallel_for_test_mark, marks);
+            for (u64 i = 0; i < 1000000; i += 1) {
+                assert(marks[i] == (i < count ? 1 : 0), "Failed: parallel_for(%llu, %llu) visited %llu %u times", count, batches[b], i, marks[i]);
+            }
+            
+            u64 sum = 0;
+            parallel_reduce(count, batches[b], parallel_reduce_test_sum, parallel_reduce_test_add, 0, &sum, sizeof(sum));
+            u64 expected = count ? count*(count-1)/2 : 0;
+            assert(sum == expected, "Failed: parallel_reduce(%llu, %llu) summed to %llu, expected %llu", count, batches[b], sum, expected);
+        }
+    }
+    dealloc(heap, marks);
+}
+
+// Like building quads for a lot of sprites
+typedef struct Parallel_Benchmark_Sprites {
+    Vector2 *positions;
+    float32 *rotations;
+    Vector2 *corners;
+} Parallel_Benchmark_Sprites;
+void parallel_benchmark_build_quads(u64 first, u64 end, void *userdata) {
+    Parallel_Benchmark_Sprites *sprites = (Parallel_Benchmark_Sprites*)userdata;
+    for (u64 i = first; i < end; i += 1) {
+        Vector2 p = sprites->positions[i];
+        float32 s = sinf(sprites->rotations[i]);
+        float32 c = cosf(sprites->rotations[i]);
+        Vector2 *out = sprites->corners + i*4;
+        out[0] = v2(p.x + (-c + s)*8, p.y + (-s - c)*8);
+        out[1] = v2(p.x + ( c + s)*8, p.y + ( s - c)*8);
+        out[2] = v2(p.x + ( c - s)*8, p.y + ( s + c)*8);
+        out[3] = v2(p.x + (-c - s)*8, p.y + (-s + c)*8);
+    }
+}
+void parallel_benchmark_sum_lengths(u64 first, u64 end, void *partial, void *userdata) {
+    Vector2 *corners = (Vector2*)userdata;
+    float64 *sum = (float64*)partial;
+    for (u64 i = first; i < end; i += 1) *sum += sqrt(corners[i].x*corners[i].x + corners[i].y*corners[i].y);
+}
+void parallel_benchmark_add(void *result, void *partial, void *userdata) {
+    *(float64*)result += *(float64*)partial;
+}
+void benchmark_parallel_for() {
+    Allocator heap = get_heap_allocator();
+    
+    const u64 sprite_count = 150000;
+    Parallel_Benchmark_Sprites sprites;
+    sprites.positions = (Vector2*)alloc(heap, sizeof(Vector2)*sprite_count);
+    sprites.rotations = (float32*)alloc(heap, sizeof(float32)*sprite_count);
+    sprites.corners   = (Vector2*)alloc(heap, sizeof(Vector2)*sprite_count*4);
+    for (u64 i = 0; i < sprite_count; i += 1) {
+        sprites.positions[i] = v2(get_random_float32_in_range(-500, 500), get_random_float32_in_range(-500, 500));
+        sprites.rotations[i] = get_random_float32_in_range(0, 6.28f);
+    }
+    
+    u64 original_worker_count = job_system_get_worker_count();
+    u64 max_threads = os_get_number_of_logical_processors();
+    float64 single_thread_quads = 0;
+    float64 single_thread_sum = 0;
+    
+    // 1, 2, 4 ... and all of them
+    for (u64 threads = 1; ; threads = min(threads*2, max_threads)) {
+        job_system_deinit();
+        job_system_init(threads);
+        
+        const u64 iterations = 20;
+        float64 start = os_get_elapsed_seconds();
+        for (u64 i = 0; i < iterations; i += 1) {
+            parallel_for(sprite_count, 64, parallel_benchmark_build_quads, &sprites);
+        }
+        float64 quads_seconds = (os_get_elapsed_seconds()-start)/(float64)iterations;
+        
+        float64 sum = 0;
+        start = os_get_elapsed_seconds();
+        for (u64 i = 0; i < iterations; i += 1) {
+            sum = 0;
+            parallel_reduce(sprite_count*4, 1024, parallel_benchmark_sum_lengths, parallel_benchmark_add, sprites.corners, &sum, sizeof(sum));
+        }
+        float64 sum_seconds = (os_get_elapsed_seconds()-start)/(float64)iterations;
+        
+        if (threads == 1) {
+            single_thread_quads = quads_seconds;
+            single_thread_sum = sum_seconds;
+        }
+        
+        print("%llu threads: %llu quads in %.3f ms (%.2fx), reduce %llu lengths in %.3f ms (%.2fx) (%llu)\n", 
+            threads, sprite_count, quads_seconds*1000.0, single_thread_quads/quads_seconds,
+            sprite_count*4, sum_seconds*1000.0, single_thread_sum/sum_seconds, (u64)sum % 10);
+        
+        if (threads == max_threads) break;
+    }
+    
+    job_system_deinit();
+    job_system_init(original_worker_count);
+    
+    dealloc(heap, sprites.positions);
+    dealloc(heap, sprites.rotations);
+    dealloc(heap, sprites.corners);
+}
+
+#define HASH_TABLE_CONTENTION_KEYS 100000
+#define HASH_TABLE_CONTENTION_OPS 1000000
+typedef struct Hash_Table_Contention_Data {
+    Concurrent_Hash_Table *concurrent;
+    Hash_Table *locked;
+    Mutex *mutex;
+} Hash_Table_Contention_Data;
+// Mostly reads, like an asset cache: 1 in 16 is a get_or_insert which might miss
+void hash_table_contention_proc(Thread *t) {
+    Hash_Table_Contention_Data *data = (Hash_Table_Contention_Data*)t->data;
+    seed_for_random = context.thread_id + 1;
+    for (u64 i = 0; i < HASH_TABLE_CONTENTION_OPS; i += 1) {
+        u64 r = get_random();
+        u64 key = (r >> 8) % (HASH_TABLE_CONTENTION_KEYS*2);
+        u64 value = key;
+        bool insert = (r & 15) == 0;
+        if (data->concurrent) {
+            if (insert) concurrent_hash_table_get_or_insert(data->concurrent, key, value);
+            else        concurrent_hash_table_find(data->concurrent, key, value);
+        } else {
+            mutex_acquire_or_wait(data->mutex);
+            u64 *existing = hash_table_find(data->locked, key);
+            if (existing) value = *existing;
+            else if (insert) hash_table_add(data->locked, key, value);
+            mutex_release(data->mutex);
+        }
+    }
+}
+void benchmark_concurrent_hash_table() {
+    Allocator heap = get_heap_allocator();
+    
+    u64 max_threads = min(os_get_number_of_logical_processors(), 64);
+    Thread *threads = alloc(heap, sizeof(Thread)*max_threads);
+    
+    for (u64 num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        for (int use_concurrent = 0; use_concurrent <= 1; use_concurrent++) {
+            Concurrent_Hash_Table concurrent = make_concurrent_hash_table(u64, u64, heap);
+            Hash_Table locked = make_hash_table(u64, u64, heap);
+            Mutex mutex;
+            mutex_init(&mutex);
+            
+            for (u64 key = 0; key < HASH_TABLE_CONTENTION_KEYS; key += 1) {
+                if (use_concurrent) concurrent_hash_table_set(&concurrent, key, key);
+                else                hash_table_set(&locked, key, key);
+            }
+            
+            Hash_Table_Contention_Data data;
+            data.concurrent = use_concurrent ? &concurrent : 0;
+            data.locked = &locked;
+            data.mutex = &mutex;
+            
+            float64 start_seconds = os_get_elapsed_seconds();
+            for (u64 i = 0; i < num_threads; i++) {
+                os_thread_init(&threads[i], hash_table_contention_proc);
+                threads[i].data = &data;
+                os_thread_start(&threads[i]);
+            }
+            for (u64 i = 0; i < num_threads; i++) {
+                os_thread_join(&threads[i]);
+                os_thread_destroy(&threads[i]);
+            }
+            float64 seconds = os_get_elapsed_seconds()-start_seconds;
+            
+            f64 mops = (f64)(num_threads*HASH_TABLE_CONTENTION_OPS)/seconds/1000000.0;
+            print("%llu threads, %cs: %.2f million ops per second\n", num_threads, use_concurrent ? "Concurrent_Hash_Table" : "Hash_Table + Mutex", mops);
+            
+            concurrent_hash_table_destroy(&concurrent);
+            hash_table_destroy(&locked);
+            mutex_destroy(&mutex);
+        }
+    }
+    
+    dealloc(heap, threads);
+}
+
 #ifndef OOGABOOGA_HEADLESS
 int compare_draw_quads(const void *a, const void *b) {
     return ((Draw_Quad*)a)->z-((Draw_Quad*)b)->z;
@@ -1499,6 +3437,27 @@ void test_sort() {
     
     print("Merge sort took on average %llu cycles and %.2f ms\n", cycles / num_samples, (seconds * 1000.0) / (float64)num_samples);
 }
+void test_draw_frame_in_arena() {
+    Arena arena = make_arena(MB(4));
+    
+    Draw_Frame frame;
+    push_allocator(make_arena_allocator_from_arena(&arena));
+    draw_frame_init(&frame);
+    pop_context();
+    
+    // Reset has to keep the tagged allocator the quad buffer grows with
+    draw_frame_reset(&frame);
+    frame.projection = m4_scalar(1.0);
+    for (u64 i = 0; i < 1000; i++) {
+        draw_rect_in_frame(v2(-0.5, -0.5), v2(1, 1), COLOR_WHITE, &frame);
+    }
+    assert(growing_array_get_valid_count(frame.quad_buffer) == 1000, "Draw frame lost quads");
+    u8 *quads = (u8*)frame.quad_buffer;
+    assert(quads >= (u8*)arena.start && quads < (u8*)arena.start+arena.size, "Draw frame quads were not allocated in the arena");
+    
+    growing_array_deinit((void**)&frame.quad_buffer);
+    dealloc(get_heap_allocator(), arena.start);
+}
 #endif /* OOGABOOGA_HEADLESS */
 
 typedef struct Test_Thing {
@@ -1712,6 +3671,40 @@ void oogabooga_run_tests() {
 	test_threads();
 	print("OK!\n");
 	
+	print("Testing threaded allocator... ");
+	test_allocator_threaded_contention();
+	print("OK!\n");
+	
+	print("Testing arena... ");
+	test_arena();
+	print("OK!\n");
+	
+	print("Testing pool allocator... ");
+	test_pool();
+	print("OK!\n");
+	
+	print("Testing aligned allocation... ");
+	test_aligned_allocation();
+	print("OK!\n");
+	
+	print("Testing zeroed allocation... ");
+	test_zeroed_allocation();
+	print("OK!\n");
+	
+	print("Testing memory tags... ");
+	test_memory_tags();
+	print("OK!\n");
+	
+	print("Testing context allocator... ");
+	test_context_allocator();
+	print("OK!\n");
+	
+#if ENABLE_ALLOCATION_PROFILING
+	print("Testing allocation profiler... ");
+	test_allocation_profiler();
+	print("OK!\n");
+#endif
+	
 	print("Testing strings... ");
 	test_strings();
 	print("OK!\n");
@@ -1732,18 +3725,71 @@ void oogabooga_run_tests() {
 	test_simd();
 	print("OK!\n");
 	
+	print("Testing hashing... ");
+	test_hashing();
+	print("OK!\n");
+	
+	benchmark_hashing();
+	
 	print("Testing hash table... ");
 	test_hash_table();
 	print("OK!\n");
 	
+	benchmark_hash_table(10000);
+	benchmark_hash_table(1000000);
+	
 	print("Testing random distribution... ");
 	test_random_distribution();
 	print("OK!\n");
 	
+	print("Testing atomics... ");
+	test_atomics();
+	print("OK!\n");
+	
 	print("Testing mutex... ");
 	test_mutex();
 	print("OK!\n");
 	
+	print("Testing ticket lock... ");
+	test_ticket_lock();
+	print("OK!\n");
+	
+	print("Testing rw lock... ");
+	test_rw_lock();
+	print("OK!\n");
+	
+	benchmark_locks();
+	
+	print("Testing spsc queue... ");
+	test_spsc_queue();
+	print("OK!\n");
+	
+	print("Testing mpmc queue... ");
+	test_mpmc_queue();
+	print("OK!\n");
+	
+	benchmark_queues();
+	
+	print("Testing concurrent hash table... ");
+	test_concurrent_hash_table();
+	print("OK!\n");
+	
+	benchmark_concurrent_hash_table();
+	
+	print("Testing string interner... ");
+	test_string_interner();
+	print("OK!\n");
+	
+	print("Testing job system... ");
+	test_job_system();
+	print("OK!\n");
+	
+	print("Testing parallel for... ");
+	test_parallel_for();
+	print("OK!\n");
+	
+	benchmark_parallel_for();
+	
 	print("Testing binary semaphore... ");
 	test_os_binary_semaphore();
 	print("OK!\n");
@@ -1752,6 +3798,10 @@ void oogabooga_run_tests() {
 	print("Testing radix sort... ");
 	test_sort();
 	print("OK!\n");
+	
+	print("Testing draw frame in arena... ");
+	test_draw_frame_in_arena();
+	print("OK!\n");
 #endif
 
 	